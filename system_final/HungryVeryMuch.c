@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,8 +6,89 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#define SHM_RING_SLOTS 1024
+#define SHM_HELLO -1
+#define ORDER_CANCEL -2
+#define ORDER_STATUS -3
+#define STATUS_WINDOW 64  // Queries in flight per connection under --status-load
+#define SHM_ACK_TIMEOUT_MS 5000
+#define TRACE_MAGIC "PIDETRC2"
+#define MENU_ITEMS 256  // Must match PideShop.c
+
+// Must match OrderMessage in PideShop.c
+typedef struct __attribute__((packed)) {
+    int32_t number_of_clients;
+    int32_t pid;
+    int32_t x, y;
+    int32_t item;
+} OrderMessage;
+
+// Must match TraceRecord in PideShop.c (written by --record)
+typedef struct __attribute__((packed)) {
+    uint32_t delta_us;
+    int32_t pid;
+    int32_t number_of_clients;
+    int32_t x, y;
+    int32_t item;
+} TraceRecord;
+
+// Must match the shared-memory layout in PideShop.c
+enum { SHM_PLACED, SHM_REJECTED, SHM_DELIVERED, SHM_CANCELLED, SHM_CANCEL_LATE };
+
+typedef struct {
+    int32_t order_id;
+    int32_t state;
+    uint32_t slot;
+} ShmStatus;
+
+// Must match StatusReply in PideShop.c
+enum { STATUS_UNKNOWN, STATUS_QUEUED, STATUS_COOKING, STATUS_READY, STATUS_OUT, STATUS_DELIVERED, STATUS_CANCELLED, STATUS_STATES };
+
+typedef struct __attribute__((packed)) {
+    int32_t order_id;
+    int32_t state;
+    int32_t age_ms;
+    int32_t ready_ms, out_ms, done_ms;
+} StatusReply;
+
+const char* status_names[STATUS_STATES] = { "unknown", "queued", "cooking", "ready", "out for delivery", "delivered", "cancelled" };
+
+typedef struct {
+    _Atomic uint32_t head __attribute__((aligned(64)));
+    _Atomic uint32_t tail __attribute__((aligned(64)));
+} ShmRing;
+
+typedef struct {
+    ShmRing order_ring;
+    ShmRing status_ring;
+    OrderMessage orders[SHM_RING_SLOTS];
+    ShmStatus status[SHM_RING_SLOTS];
+} ShmRegion;
 
 int client_socket;
+int order_doorbell;
+int cancel_percent;
+int cancels_sent, cancels_made, cancels_late;
+
+int send_all(int socket, const void* data, size_t length);
+int connect_to_shop(const char* target, int port);
+int drain_status(ShmRegion* region, int* rejected);
+void ring_shop(ShmRegion* region, int doorbell);
+void request_cancel(ShmRegion* region, int order_id);
+int run_shared_memory(const char* target, int numberOfClients, int p, int q, int per_connection, pid_t pid);
+int replay_trace(const char* path, const char* target, int port, double speed, int connections);
+int pick_menu_item();
+int query_status(const char* target, int port, int order_id);
+int status_load(const char* target, int port, int seconds, int connections, int max_order_id);
 
 void handle_sigint(int sig) {
     printf("\nHungryVeryMuch client shutting down...\n");
@@ -15,8 +97,22 @@ void handle_sigint(int sig) {
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 6) {
-        fprintf(stderr, "Usage: %s [server_ip] [portnumber] [numberOfClients] [p] [q]\n", argv[0]);
+    if (argc >= 4 && argc <= 6 && strncmp(argv[1], "--replay=", 9) == 0) {
+        signal(SIGINT, handle_sigint);
+        double speed = argc >= 5 ? (strcmp(argv[4], "max") == 0 ? 0 : atof(argv[4])) : 1;
+        return replay_trace(argv[1] + 9, argv[2], atoi(argv[3]), speed, argc == 6 ? atoi(argv[5]) : 1);
+    }
+    if (argc == 4 && strncmp(argv[1], "--status=", 9) == 0) {
+        return query_status(argv[2], atoi(argv[3]), atoi(argv[1] + 9));
+    }
+    if (argc >= 4 && argc <= 6 && strncmp(argv[1], "--status-load=", 14) == 0) {
+        return status_load(argv[2], atoi(argv[3]), atoi(argv[1] + 14), argc >= 5 ? atoi(argv[4]) : 1, argc == 6 ? atoi(argv[5]) : 1000);
+    }
+    if (argc < 6 || argc > 8) {
+        fprintf(stderr, "Usage: %s [server_ip|unix:PATH|shm:PATH] [portnumber] [numberOfClients] [p] [q] [ordersPerConnection] [cancelPercent]\n", argv[0]);
+        fprintf(stderr, "       %s --replay=TRACE [server_ip|unix:PATH] [portnumber] [speed|max] [connections]\n", argv[0]);
+        fprintf(stderr, "       %s --status=ORDER_ID [server_ip|unix:PATH] [portnumber]\n", argv[0]);
+        fprintf(stderr, "       %s --status-load=SECONDS [server_ip|unix:PATH] [portnumber] [connections] [maxOrderId]\n", argv[0]);
         exit(1);
     }
 
@@ -25,6 +121,11 @@ int main(int argc, char *argv[]) {
     int numberOfClients = atoi(argv[3]);
     int p = atoi(argv[4]);
     int q = atoi(argv[5]);
+    int per_connection = argc >= 7 ? atoi(argv[6]) : 1;
+    cancel_percent = argc == 8 ? atoi(argv[7]) : 0;  // Only honoured over shared memory
+    if (per_connection < 1) {
+        per_connection = 1;
+    }
 
     signal(SIGINT, handle_sigint);
 
@@ -32,38 +133,455 @@ int main(int argc, char *argv[]) {
     pid_t pid = getpid();
     printf("HungryVeryMuch client PID: %d\n", pid);
 
-    for (int i = 0; i < numberOfClients; i++) {
-        struct sockaddr_in server_addr;
-        if ((client_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    if (strncmp(server_ip, "shm:", 4) == 0) {
+        return run_shared_memory(server_ip, numberOfClients, p, q, per_connection, pid);
+    }
+
+    OrderMessage* messages = malloc(per_connection * sizeof(OrderMessage));
+    for (int i = 0; i < numberOfClients; i += per_connection) {
+        if ((client_socket = connect_to_shop(server_ip, port)) == -1) {
+            continue;
+        }
+
+        // Every order on this connection goes out in a single send
+        int count = numberOfClients - i < per_connection ? numberOfClients - i : per_connection;
+        for (int j = 0; j < count; j++) {
+            srand(time(NULL) + i + j);
+            messages[j].number_of_clients = numberOfClients;
+            messages[j].pid = pid;
+            messages[j].x = rand() % p;
+            messages[j].y = rand() % q;
+            messages[j].item = pick_menu_item();
+        }
+        if (send_all(client_socket, messages, count * sizeof(OrderMessage)) == -1) {
+            perror("Send failed");
+        }
+
+        for (int j = 0; j < count; j++) {
+            printf("Order placed from location (%d, %d), item %d\n", messages[j].x, messages[j].y, messages[j].item);
+        }
+        if (per_connection == 1) {
+            sleep(1); // Simulate order placement interval
+        }
+        close(client_socket); // Close the socket after placing the order
+    }
+    free(messages);
+
+    return 0;
+}
+
+int send_all(int socket, const void* data, size_t length) {
+    const char* cursor = data;
+    while (length > 0) {
+        ssize_t sent = send(socket, cursor, length, MSG_NOSIGNAL);
+        if (sent == -1) {
+            return -1;
+        }
+        cursor += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// "unix:PATH" and "shm:PATH" reach a shop on this host through its
+// --unix-socket listener; anything else is an IPv4 address.
+int connect_to_shop(const char* target, int port) {
+    int sock;
+    if (strncmp(target, "unix:", 5) == 0 || strncmp(target, "shm:", 4) == 0) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, strchr(target, ':') + 1, sizeof(addr.sun_path) - 1);
+        if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
             perror("Socket creation failed");
             exit(1);
         }
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            perror("Connect failed");
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
 
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(port);
-        server_addr.sin_addr.s_addr = inet_addr(server_ip);
+    struct sockaddr_in server_addr;
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("Socket creation failed");
+        exit(1);
+    }
 
-        if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-            perror("Connect failed");
-            close(client_socket);
-            continue;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr(target);
+
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        perror("Connect failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Returns how many orders the shop answered (placed or rejected).
+int drain_status(ShmRegion* region, int* rejected) {
+    int answered = 0;
+    uint32_t head = atomic_load_explicit(&region->status_ring.head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&region->status_ring.tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        ShmStatus status = region->status[head % SHM_RING_SLOTS];
+        if (status.state == SHM_PLACED) {
+            answered++;
+            if (rand() % 100 < cancel_percent) {
+                request_cancel(region, status.order_id);
+            }
+        } else if (status.state == SHM_CANCELLED) {
+            cancels_made++;
+        } else if (status.state == SHM_CANCEL_LATE) {
+            cancels_late++;
+        } else if (status.state == SHM_REJECTED) {
+            answered++;
+            (*rejected)++;
+        } else {
+            printf("Order %d delivered\n", status.order_id);
         }
+    }
+    atomic_store_explicit(&region->status_ring.head, head, memory_order_release);
+    return answered;
+}
+
+// Wakes the shop if orders are still waiting in the ring, as they are when
+// it paused for a full status ring
+void ring_shop(ShmRegion* region, int doorbell) {
+    if (atomic_load_explicit(&region->order_ring.head, memory_order_acquire) == atomic_load_explicit(&region->order_ring.tail, memory_order_relaxed)) {
+        return;
+    }
+    uint64_t rings = 1;
+    if (write(doorbell, &rings, sizeof(rings)) == -1) {
+        perror("Doorbell write failed");
+    }
+}
 
-        // Send numberOfClients and PID to the server
-        send(client_socket, &numberOfClients, sizeof(int), 0);
-        send(client_socket, &pid, sizeof(pid_t), 0);
+// Takes back an order the shop has accepted, if there is room to ask
+void request_cancel(ShmRegion* region, int order_id) {
+    uint32_t tail = atomic_load_explicit(&region->order_ring.tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&region->order_ring.head, memory_order_acquire) == SHM_RING_SLOTS) {
+        return;
+    }
+    OrderMessage* cancel = &region->orders[tail % SHM_RING_SLOTS];
+    cancel->number_of_clients = ORDER_CANCEL;
+    cancel->pid = getpid();
+    cancel->x = order_id;
+    cancel->y = 0;
+    cancel->item = 0;
+    atomic_store_explicit(&region->order_ring.tail, tail + 1, memory_order_release);
+    uint64_t rings = 1;
+    if (write(order_doorbell, &rings, sizeof(rings)) == -1) {
+        perror("Doorbell write failed");
+    }
+    cancels_sent++;
+}
 
+// Orders go through a ring in a memfd shared with the shop. The Unix-domain
+// connection only carries the descriptors and, by closing, says goodbye.
+int run_shared_memory(const char* target, int numberOfClients, int p, int q, int per_connection, pid_t pid) {
+    if ((client_socket = connect_to_shop(target, 0)) == -1) {
+        return 1;
+    }
+    int fds[3];
+    fds[0] = memfd_create("hungryverymuch", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    fds[1] = eventfd(0, EFD_CLOEXEC);  // Rung by us: new orders
+    fds[2] = eventfd(0, EFD_CLOEXEC);  // Rung by the shop: new status
+    if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1 || ftruncate(fds[0], sizeof(ShmRegion)) == -1 ||
+        fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == -1) {  // The shop refuses a resizable region
+        perror("Shared memory setup failed");
+        return 1;
+    }
+    order_doorbell = fds[1];
+    ShmRegion* region = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (region == MAP_FAILED) {
+        perror("Shared memory mapping failed");
+        return 1;
+    }
+
+    OrderMessage hello = { SHM_HELLO, pid, 0, 0, 0 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(client_socket, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+        perror("Shared memory handshake failed");
+        return 1;
+    }
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int answered = 0, rejected = 0;
+    struct pollfd doorbell = { .fd = fds[2], .events = POLLIN };
+    uint64_t rings = 1;
+    for (int i = 0; i < numberOfClients; i++) {
+        // Status is drained as we go: the shop stops taking orders while it
+        // has no room left to answer them
+        answered += drain_status(region, &rejected);
+        uint32_t tail = atomic_load_explicit(&region->order_ring.tail, memory_order_relaxed);
+        while (tail - atomic_load_explicit(&region->order_ring.head, memory_order_acquire) == SHM_RING_SLOTS) {
+            poll(&doorbell, 1, 1);
+            answered += drain_status(region, &rejected);
+            ring_shop(region, fds[1]);
+        }
         srand(time(NULL) + i);
-        int x = rand() % p;
-        int y = rand() % q;
+        OrderMessage* order = &region->orders[tail % SHM_RING_SLOTS];
+        order->number_of_clients = numberOfClients;
+        order->pid = pid;
+        order->x = rand() % p;
+        order->y = rand() % q;
+        order->item = pick_menu_item();
+        atomic_store_explicit(&region->order_ring.tail, tail + 1, memory_order_release);
+        if ((i + 1) % per_connection == 0 || i + 1 == numberOfClients) {
+            rings = 1;
+            if (write(fds[1], &rings, sizeof(rings)) == -1) {
+                perror("Doorbell write failed");
+            }
+        }
+    }
 
-        send(client_socket, &x, sizeof(int), 0);
-        send(client_socket, &y, sizeof(int), 0);
+    while (answered < numberOfClients || cancels_made + cancels_late < cancels_sent) {
+        if (poll(&doorbell, 1, SHM_ACK_TIMEOUT_MS) <= 0) {
+            fprintf(stderr, "No answer from the shop for %d orders\n", numberOfClients - answered + cancels_sent - cancels_made - cancels_late);
+            break;
+        }
+        if (read(fds[2], &rings, sizeof(rings)) == -1) {
+            perror("Doorbell read failed");
+        }
+        answered += drain_status(region, &rejected);
+        ring_shop(region, fds[1]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    printf("%d orders answered over shared memory (%d rejected) in %.3f s\n", answered, rejected, seconds);
+    if (cancels_sent > 0) {
+        printf("%d cancellations asked: %d made, %d too late\n", cancels_sent, cancels_made, cancels_late);
+    }
 
-        printf("Order placed from location (%d, %d)\n", x, y);
-        sleep(1); // Simulate order placement interval
-        close(client_socket); // Close the socket after placing the order
+    munmap(region, sizeof(ShmRegion));
+    close(client_socket);
+    return 0;
+}
+
+// Re-sends a PideShop --record trace with the recorded gaps divided by speed
+// (0 sends as fast as possible). Each recorded client stays on one
+// connection so its orders arrive in their original order.
+int replay_trace(const char* path, const char* target, int port, double speed, int connections) {
+    FILE* trace = fopen(path, "r");
+    char magic[8];
+    if (trace == NULL || fread(magic, 1, 8, trace) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s is not an order trace\n", path);
+        return 1;
+    }
+    int count = 0, capacity = 1024;
+    TraceRecord* records = malloc(capacity * sizeof(TraceRecord));
+    while (fread(&records[count], sizeof(TraceRecord), 1, trace) == 1) {
+        if (++count == capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(TraceRecord));
+        }
+    }
+    fclose(trace);
+    if (strncmp(target, "shm:", 4) == 0 || connections < 1) {
+        fprintf(stderr, "Replay needs a socket target and at least one connection\n");
+        return 1;
+    }
+
+    int* sockets = malloc(connections * sizeof(int));
+    for (int i = 0; i < connections; i++) {
+        if ((sockets[i] = connect_to_shop(target, port)) == -1) {
+            return 1;
+        }
+    }
+
+    struct timespec start, due, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double trace_us = 0, lag_sum_ms = 0, lag_max_ms = 0;
+    for (int i = 0; i < count; i++) {
+        trace_us += records[i].delta_us;
+        if (speed > 0) {
+            long offset_ns = (long)(trace_us / speed * 1000);
+            due = start;
+            due.tv_sec += offset_ns / 1000000000L;
+            due.tv_nsec += offset_ns % 1000000000L;
+            if (due.tv_nsec >= 1000000000L) {
+                due.tv_sec++;
+                due.tv_nsec -= 1000000000L;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double lag_ms = (now.tv_sec - due.tv_sec) * 1000.0 + (now.tv_nsec - due.tv_nsec) / 1e6;
+            lag_sum_ms += lag_ms;
+            if (lag_ms > lag_max_ms) {
+                lag_max_ms = lag_ms;
+            }
+        }
+        OrderMessage message = { records[i].number_of_clients, records[i].pid, records[i].x, records[i].y, records[i].item };
+        int connection = (unsigned)records[i].pid % connections;
+        if (send_all(sockets[connection], &message, sizeof(message)) == -1) {
+            perror("Send failed");
+            return 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < connections; i++) {
+        close(sockets[i]);
+    }
+    double seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Replayed %d orders over %d connections in %.3f s (trace spans %.3f s", count, connections, seconds, trace_us / 1e6);
+    if (speed > 0) {
+        printf(", %gx, send lag mean %.2f ms max %.2f ms)\n", speed, count > 0 ? lag_sum_ms / count : 0, lag_max_ms);
+    } else {
+        printf(", as fast as possible)\n");
     }
+    free(sockets);
+    free(records);
+    return 0;
+}
+
+// Zipf over the menu: item k is ordered 1/(k+1) as often as item 0, so a few
+// favourites make up most orders, as on a real menu.
+int pick_menu_item() {
+    static double cumulative[MENU_ITEMS];
+    if (cumulative[MENU_ITEMS - 1] == 0) {
+        double sum = 0;
+        for (int k = 0; k < MENU_ITEMS; k++) {
+            sum += 1.0 / (k + 1);
+            cumulative[k] = sum;
+        }
+    }
+    double u = (double)rand() / ((double)RAND_MAX + 1) * cumulative[MENU_ITEMS - 1];
+    int low = 0, high = MENU_ITEMS - 1;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (cumulative[middle] <= u) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
 
+int query_status(const char* target, int port, int order_id) {
+    int sock = connect_to_shop(target, port);
+    if (sock == -1) {
+        return 1;
+    }
+    struct timeval timeout = { .tv_sec = 5 };  // A shop that dropped the query never answers
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    OrderMessage query = { ORDER_STATUS, getpid(), order_id, 0, 0 };
+    StatusReply reply;
+    if (send_all(sock, &query, sizeof(query)) == -1 || recv(sock, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) {
+        perror("Status query failed");
+        close(sock);
+        return 1;
+    }
+    close(sock);
+    if (reply.state < 0 || reply.state >= STATUS_STATES || reply.state == STATUS_UNKNOWN) {
+        printf("Order %d: unknown\n", order_id);
+        return 1;
+    }
+    printf("Order %d: %s, placed %d ms ago", order_id, status_names[reply.state], reply.age_ms);
+    if (reply.ready_ms >= 0) {
+        printf(", ready after %d ms", reply.ready_ms);
+    }
+    if (reply.out_ms >= 0) {
+        printf(", out after %d ms", reply.out_ms);
+    }
+    if (reply.done_ms >= 0) {
+        printf(", %s after %d ms", reply.state == STATUS_CANCELLED ? "cancelled" : "delivered", reply.done_ms);
+    }
+    printf("\n");
+    return 0;
+}
+
+// Keeps STATUS_WINDOW queries in flight on each connection for the given
+// time, topping a connection up as its replies come back, and reports the
+// reply rate and what state the queried orders were in.
+int status_load(const char* target, int port, int seconds, int connections, int max_order_id) {
+    if (connections < 1 || max_order_id < 1 || strncmp(target, "shm:", 4) == 0) {
+        fprintf(stderr, "Status load needs a socket target, at least one connection and a max order id\n");
+        return 1;
+    }
+    struct pollfd* fds = malloc(connections * sizeof(struct pollfd));
+    int* in_flight = calloc(connections, sizeof(int));
+    int* partial = calloc(connections, sizeof(int));
+    StatusReply* replies = malloc(connections * STATUS_WINDOW * sizeof(StatusReply));
+    OrderMessage* queries = malloc(STATUS_WINDOW * sizeof(OrderMessage));
+    for (int i = 0; i < connections; i++) {
+        if ((fds[i].fd = connect_to_shop(target, port)) == -1) {
+            return 1;
+        }
+        fds[i].events = POLLIN;
+    }
+
+    long answered = 0, by_state[STATUS_STATES] = { 0 };
+    unsigned int seed = getpid();
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double elapsed = 0;
+    while (elapsed < seconds) {
+        for (int i = 0; i < connections; i++) {
+            int count = STATUS_WINDOW - in_flight[i];
+            for (int j = 0; j < count; j++) {
+                queries[j] = (OrderMessage){ ORDER_STATUS, getpid(), 1 + rand_r(&seed) % max_order_id, 0, 0 };
+            }
+            if (count > 0 && send_all(fds[i].fd, queries, count * sizeof(OrderMessage)) == -1) {
+                perror("Send failed");
+                return 1;
+            }
+            in_flight[i] += count;
+        }
+        if (poll(fds, connections, 1000) <= 0) {
+            fprintf(stderr, "Shop stopped answering status queries\n");
+            return 1;
+        }
+        for (int i = 0; i < connections; i++) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            char* buffer = (char*)&replies[i * STATUS_WINDOW];
+            ssize_t got = recv(fds[i].fd, buffer + partial[i], STATUS_WINDOW * sizeof(StatusReply) - partial[i], 0);
+            if (got <= 0) {
+                fprintf(stderr, "Shop closed the connection\n");
+                return 1;
+            }
+            int bytes = partial[i] + got;
+            int complete = bytes / sizeof(StatusReply);
+            for (int j = 0; j < complete; j++) {
+                StatusReply* reply = (StatusReply*)buffer + j;
+                by_state[reply->state >= 0 && reply->state < STATUS_STATES ? reply->state : STATUS_UNKNOWN]++;
+            }
+            partial[i] = bytes - complete * sizeof(StatusReply);
+            memmove(buffer, buffer + complete * sizeof(StatusReply), partial[i]);
+            in_flight[i] -= complete;
+            answered += complete;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    }
+    for (int i = 0; i < connections; i++) {
+        close(fds[i].fd);
+    }
+
+    printf("%ld status replies over %d connections in %.2f s: %.0f replies/s\n", answered, connections, elapsed, answered / elapsed);
+    for (int s = 0; s < STATUS_STATES; s++) {
+        if (by_state[s] > 0) {
+            printf("  %-16s %5.1f%%\n", status_names[s], 100.0 * by_state[s] / answered);
+        }
+    }
+    free(fds);
+    free(in_flight);
+    free(partial);
+    free(replies);
+    free(queries);
     return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,18 +10,240 @@
 #include <math.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <ucontext.h>
+#include <sys/resource.h>
+#include <linux/futex.h>
+#include <sys/wait.h>
 
 #define MAX_ORDERS 100
 #define MAX_OVEN_CAPACITY 6
 #define MAX_DELIVERY_CAPACITY 3
 #define MAX_CLIENTS 100
+#define LATENCY_SAMPLES 512
+#define CLIENT_ACTIVE_WINDOW 2
+#define SCALE_TICK_MS 500
+#define SCALE_HYSTERESIS_TICKS 2
+#define POOL_SLOT_RESERVE 64
+#define BATCH_WINDOW_MS 2000
+#define HANDOFF_BATCH 64
+#define HANDOFF_MAGIC 0x50494445
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_VERSION 2  // Bump whenever JournalRecord changes
+#define JOURNAL_INITIAL_CAPACITY 256
+#define JOURNAL_BENCH_SECONDS 3
+
+#define CONNECTION_BUFFER 4096
+#define EPOLL_BATCH 64
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+#define URING_TAG_ACCEPT 1
+#define URING_TAG_UPGRADE 2
+#define URING_TAG_IGNORE 3
+#define URING_TAG_ACCEPT_UNIX 4
+#define URING_TAG_WRITABLE 1    // Low bit of a connection tag: its POLLOUT came back
+#define EPOLL_TAG_DOORBELL 1
+#define SHM_RING_SLOTS 1024
+#define SHM_HELLO -1
+#define ORDER_CANCEL -2
+#define ORDER_STATUS -3
+#define ORDER_INDEX_BUCKETS 4096
+#define METRIC_SHARDS 128
+#define HISTOGRAM_BUCKETS 240
+#define FIBER_STACK_SIZE (64 * 1024)
+#define FIBER_WAIT_BUCKETS 64
+#define FIBER_LOCK_RECHECK_NS 1000000
+#define FIBER_LOCK_RECHECK_MAX_NS 64000000
+#define PLACEMENT_PROBE_US 2000
+#define TRACE_MAGIC "PIDETRC2"
+#define WAITER_SPIN_MIN 16
+#define WAITER_SPIN_START 256
+#define WAITER_SPIN_MAX 8192
+#define FLEET_CLASSES 16
+#define FLEET_MAX_CAPACITY 8
+#define DISPATCH_TICK_MS 100
+#define DISPATCH_HORIZON_MS 3000
+#define DISPATCH_MAX_ORDERS 64
+#define DISPATCH_MAX_MOTOS 64
+#define DISPATCH_BENCH_GRID 20
+#define PREP_BATCH_MAX 16
+#define MENU_ITEMS 256
+#define PREP_CACHE_SHARDS 16
+#define PREP_CACHE_ENTRIES 64
+#define KITCHEN_QUEUE_SLOTS 64
+#define KITCHEN_BAKE_MS 200.0        // The cook's oven nap
+#define KITCHEN_IDLE_UTILISATION 0.5  // Below this busy share a stage may give a cook away
+#define STATUS_SLOTS 65536       // Power of two
+#define STATUS_REPLY_BUFFER (256 * (int)sizeof(StatusReply))
+#define STATUS_BENCH_ORDERS 4096  // One per index bucket, so mutex_index lookups don't walk chains
+#define STATUS_BENCH_READERS 4
+#define STATUS_BENCH_UPDATE_US 100
+#define PREP_LANES 2      // 128-bit vectors: native on every x86-64 and arm64 build, no -mavx needed
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+// Preparation inputs: an xorshift64 stream per menu item
+#define PREP_SEED(item) ((uint64_t)(item) * 0x9E3779B97F4A7C15ULL + 0x2545F4914F6CDD1DULL)
+#define PREP_NEXT(s) ((s) ^= (s) << 13, (s) ^= (s) >> 7, (s) ^= (s) << 17)
+
+// Build with -DLOCK_PROFILE (make profile) to time every acquisition of the
+// shop's mutexes and print a contention report at shutdown.
+#ifdef LOCK_PROFILE
+#define PROFILE_LOCKS 256
+#define PROFILE_SITES 256
+#define PROFILE_BUCKETS 40
+#define PROFILE_TOP_SITES 10
+#define LOCK(m) profiled_lock(m, #m, __func__, __LINE__)
+#define UNLOCK(m) profiled_unlock(m)
+#define COND_WAIT(c, m) profiled_cond_wait(c, m, NULL)
+#define COND_TIMEDWAIT(c, m, t) profiled_cond_wait(c, m, t)
+#else
+#define LOCK(m) fiber_mutex_lock(m)
+#define UNLOCK(m) fiber_mutex_unlock(m)
+#define COND_WAIT(c, m) fiber_cond_wait(c, m, NULL)
+#define COND_TIMEDWAIT(c, m, t) fiber_cond_wait(c, m, t)
+#endif
+#define COND_SIGNAL(c) fiber_cond_signal(c, false)
+#define COND_BROADCAST(c) fiber_cond_signal(c, true)
+
+enum { COUNTER_PLACED, COUNTER_REJECTED, COUNTER_COOKED, COUNTER_DELIVERED, COUNTER_INGEST_SYSCALLS,
+       COUNTER_CANCEL_REQUESTS, COUNTER_CANCELLED_QUEUED, COUNTER_CANCELLED_KITCHEN, COUNTER_CANCELLED_READY, COUNTER_CANCEL_LATE,
+       COUNTER_CANCELLED_UNBAKED, COUNTER_CANCEL_WASTED_US, COUNTER_PREP_HITS, COUNTER_PREP_MISSES, COUNTER_PREP_MISS_US,
+       COUNTER_STATUS_QUERIES, COUNTER_STATUS_DROPPED, COUNTER_PREP_SHARED, COUNTER_COUNT };
+enum { ORDER_JOURNALED, ORDER_QUEUED, ORDER_COOKING, ORDER_READY, ORDER_OUT, ORDER_CANCELLED };
+enum { CANCEL_QUEUED, CANCEL_KITCHEN, CANCEL_READY, CANCEL_LATE };  // Same order as the counters
+enum { KITCHEN_INTAKE, KITCHEN_PREPARE, KITCHEN_OVEN, KITCHEN_DISPATCH, KITCHEN_STAGES };
+enum { CONN_LISTENER, CONN_UPGRADE, CONN_CLIENT };
+enum { SHM_PLACED, SHM_REJECTED, SHM_DELIVERED, SHM_CANCELLED, SHM_CANCEL_LATE };
+enum { STATUS_UNKNOWN, STATUS_QUEUED, STATUS_COOKING, STATUS_READY, STATUS_OUT, STATUS_DELIVERED, STATUS_CANCELLED };
+enum { STAGE_QUEUE_WAIT, STAGE_PREPARE, STAGE_OVEN_WAIT, STAGE_BAKE, STAGE_BATCH_WAIT, STAGE_DRIVE, STAGE_COUNT };
+
+enum { ROLE_COOK, ROLE_COURIER, ROLE_INGEST, ROLE_JOURNAL, ROLE_COUNT };
+enum { FIBER_RUNNABLE, FIBER_RUNNING, FIBER_YIELDING, FIBER_PARKING, FIBER_PARKED, FIBER_DONE };
+
+enum { JOURNAL_PLACED, JOURNAL_COOKED, JOURNAL_OUT_FOR_DELIVERY, JOURNAL_DELIVERED, JOURNAL_CANCELLED };
+
+// One order on the wire. HungryVeryMuch sends exactly this, in host order.
+typedef struct __attribute__((packed)) {
+    int32_t number_of_clients;
+    int32_t pid;
+    int32_t x, y;
+    int32_t item;           // Menu item, 0 to MENU_ITEMS - 1
+} OrderMessage;
+
+// One accepted order in a --record trace, after an 8-byte TRACE_MAGIC
+// header. HungryVeryMuch replays the same layout.
+typedef struct __attribute__((packed)) {
+    uint32_t delta_us;      // Since the previous record, or since recording began
+    int32_t pid;
+    int32_t number_of_clients;
+    int32_t x, y;
+    int32_t item;
+} TraceRecord;
+
+// Answer to an ORDER_STATUS frame (order id in x), sent back on the same
+// socket, and to an ORDER_CANCEL from a socket client. HungryVeryMuch reads
+// the same layout.
+typedef struct __attribute__((packed)) {
+    int32_t order_id;
+    int32_t state;          // STATUS_*, STATUS_UNKNOWN if never seen or long gone
+    int32_t age_ms;         // Since the order was placed
+    int32_t ready_ms;       // Placement to each milestone, -1 until reached
+    int32_t out_ms;
+    int32_t done_ms;        // Delivered or cancelled
+} StatusReply;
+
+// Shared-memory transport: an order ring (client to shop) and a status ring
+// (shop to client) in a memfd the client creates. HungryVeryMuch has the
+// same layout.
+typedef struct {
+    int32_t order_id;
+    int32_t state;
+    uint32_t slot;          // Order ring position a placed/rejected answer is for
+} ShmStatus;
+
+typedef struct {
+    _Atomic uint32_t head __attribute__((aligned(64)));
+    _Atomic uint32_t tail __attribute__((aligned(64)));
+} ShmRing;
+
+typedef struct {
+    ShmRing order_ring;
+    ShmRing status_ring;
+    OrderMessage orders[SHM_RING_SLOTS];
+    ShmStatus status[SHM_RING_SLOTS];
+} ShmRegion;
+
+typedef struct {
+    ShmRegion* region;
+    int to_server, to_client;  // eventfd doorbells
+    pthread_mutex_t status_mutex;
+} ShmChannel;
+
+typedef struct {
+    int fd;
+    int kind;
+    _Atomic int refs;
+    ShmChannel* shm;
+    int used;
+    char buffer[CONNECTION_BUFFER];
+    char* replies;          // Status replies not yet sent, allocated on the first query
+    int reply_used;
+    bool flush_armed;       // Waiting for the socket to take the rest of replies
+} Connection;
+
+typedef struct {
+    int fd;
+    void* ring;
+    size_t ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    _Atomic unsigned *sq_head, *sq_tail;
+    unsigned sq_mask, sq_entries;
+    unsigned* sq_array;
+    unsigned to_submit;
+    _Atomic unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    struct io_uring_buf_ring* buf_ring;
+    unsigned short buf_tail;
+    char* buffers;
+} Uring;
 
 typedef struct Order {
-    int client_socket;
+    Connection* conn;
     int order_id;
     int x, y;
+    int item;
     pid_t client_pid;
+    struct timespec placed_at;
+    struct timespec ready_at;
+    struct timespec staged_at;  // Entered its current kitchen stage
+    _Atomic int state;
     struct Order* next;
+    struct Order* prev;
+    struct Order* index_next;
 } Order;
 
 typedef struct {
@@ -32,80 +255,649 @@ typedef struct {
 
 typedef struct {
     int id;
-    bool available;
+    bool available;       // Slot is not owned by a running thread
+    bool busy;            // Thread is holding an order
+    bool spawned;         // A thread has run in this slot at some point
     pthread_cond_t cond;
     int orders_processed; // Keep track of orders processed
+    _Atomic int stage;    // Kitchen stage under --kitchen=staged, moved by the controller
 } Worker;
 
+typedef struct {
+    const char* role;
+    Worker* workers;      // One slot per possible thread, max entries
+    int min, max;
+    int capacity;         // Allocated slots, the ceiling for a reloaded max
+    int active;           // Threads currently alive, guarded by mutex_workers
+    int target;           // Threads the scaler wants alive
+    int pressure_ticks;
+    int idle_ticks;
+    time_t last_change;
+    double thread_seconds;
+    int spawn_hint;       // Slot after the last one handed out
+    void *(*routine)(void *);
+} WorkerPool;
+
+// Bounded hand-off into a kitchen stage
+typedef struct {
+    Order* slots[KITCHEN_QUEUE_SLOTS];
+    int head, count;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} StageQueue;
+
+typedef struct {
+    StageQueue input;       // Intake reads the fair queue instead
+    int threads;            // Cooks assigned, changed only by the controller
+    _Atomic long busy_us;   // Service time, excluding waits for work or space
+    _Atomic long orders;
+    long last_busy_us;      // Controller's previous sample
+} KitchenStage;
+
+typedef struct {
+    double orders_per_second;
+    int threads[KITCHEN_STAGES];
+} KitchenBenchResult;
+
+typedef struct {
+    _Atomic uint32_t sequence;  // Odd while a writer is in the slot
+    _Atomic int32_t order_id;
+    _Atomic int32_t state;
+    _Atomic int32_t ready_ms, out_ms, done_ms;
+    _Atomic int64_t placed_ms;  // CLOCK_MONOTONIC
+} __attribute__((aligned(32))) StatusSlot;
+
+typedef struct {
+    Order* orders;
+    bool locked;            // Look up through mutex_index instead of the status table
+    _Atomic bool running;
+    _Atomic long lookups;
+    pthread_mutex_t mutex;
+    long updates;
+    double update_ns_total, update_ns_max;
+} StatusBench;
+
+typedef struct Fiber {
+    ucontext_t context;
+    void *(*routine)(void *);
+    void* arg;
+    char* stack;
+    _Atomic int state;
+    bool wake_pending;      // Guarded by fibers.mutex, like everything below
+    int timer_slot;         // Index in fibers.timers, -1 when not sleeping
+    struct timespec wake_at;
+    struct Fiber* next;     // Run queue or free list
+} Fiber;
+
+// Eventcount for the cook and courier queues, see waiter_wait()
+typedef struct {
+    _Atomic uint32_t epoch;    // Futex word, bumped by every notify that finds a waiter
+    _Atomic int waiting;       // Announced consumers, spinning or parked
+    _Atomic int parked;        // Of those, asleep on the futex
+    _Atomic int spin_limit;    // Grows when spinning catches a notify, shrinks when not
+    int spin_max;
+    _Atomic bool shutdown;
+} Waiter;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    Waiter waiter;
+    bool use_condvar;
+    bool stopping;
+    int items, taken;
+    struct timespec posted_at;
+    double* latencies;
+} WaiterBench;
+
+// Where one role's threads may run and how they are scheduled
+typedef struct {
+    const char* role;
+    bool pinned;
+    cpu_set_t cpus;
+    int policy;           // -1 leaves the inherited policy alone
+    int priority;
+    bool nice_set;
+    int nice;
+    _Atomic bool warned;
+} RolePlacement;
+
+// One kind of moto in a --fleet
+typedef struct {
+    int count;
+    int speed;            // 0 follows the configured speed
+    int capacity;
+} FleetClass;
+
+// Per courier slot, guarded by mutex_delivery
+typedef struct {
+    int speed, capacity;
+    bool at_shop;                 // Parked, waiting for the dispatcher to hand over a route
+    struct timespec returns_at;   // Planned return while out on a route
+    int route_count;
+    Order* route[FLEET_MAX_CAPACITY];  // Already OUT, in driving order
+} Moto;
+
+// The dispatcher's view of a ready order and of a moto. The benchmark
+// simulation plans with the same structs.
+typedef struct {
+    int x, y;
+    double ready_ms;
+} DispatchOrder;
+
+typedef struct {
+    int speed, capacity;
+    double free_ms;                  // Back at the shop, relative to the planning clock
+    int count;
+    int stops[FLEET_MAX_CAPACITY];   // Indices into the orders, in driving order
+} DispatchMoto;
+
+typedef struct {
+    double a[30][40];
+    double b[40][40];
+    double inverse[30][40];
+} MatrixScratch;
+
+// Element [i][k] lane m belongs to matrix m of a group of PREP_LANES, so one
+// vector operation advances every matrix in the group.
+typedef double PrepLane __attribute__((vector_size(PREP_LANES * sizeof(double))));
+
+typedef struct {
+    PrepLane a[30][40];
+    PrepLane b[40][40];
+    PrepLane product[30][40];
+    double result[30][40];  // One lane copied out for the cache
+} PrepScratch;
+
+// A cached preparation, on its shard's LRU list
+typedef struct PrepEntry {
+    int item;
+    struct PrepEntry* newer;
+    struct PrepEntry* older;
+    double result[30][40];
+} PrepEntry;
+
+// Items land on shard item % PREP_CACHE_SHARDS and index slot item / PREP_CACHE_SHARDS
+typedef struct {
+    pthread_mutex_t mutex;
+    PrepEntry* newest;
+    PrepEntry* oldest;
+    int count;
+    PrepEntry* slots[MENU_ITEMS / PREP_CACHE_SHARDS];
+} __attribute__((aligned(64))) PrepCacheShard;
+
+typedef struct FiberWaiter {
+    Fiber* fiber;
+    void* key;              // The mutex or condition variable waited on
+    struct FiberWaiter* next;
+    struct FiberWaiter* prev;
+    bool linked;
+} FiberWaiter;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_work;  // Idle carriers, on CLOCK_MONOTONIC
+    int carriers;
+    int carriers_running;
+    bool stopping;          // Carriers exit once the last fiber is done
+    int live;
+    long switches;
+    Fiber* run_front;
+    Fiber* run_rear;
+    Fiber* free_list;
+    Fiber** timers;
+    int timer_count, timer_capacity;
+    FiberWaiter* waiters[FIBER_WAIT_BUCKETS];
+    _Atomic int waiting;
+} FiberScheduler;
+
 typedef struct {
     pid_t pid;
     int numberOfClients;
     bool announced;
     int orders_to_serve;
+    int weight;
+    int deficit;            // DRR credit, guarded by order_queue.mutex
+    OrderQueue pending;     // Per-client sub-queue, guarded by order_queue.mutex
+    time_t last_seen;
+    int delivered;
+    double latencies[LATENCY_SAMPLES]; // Ring of recent placed->delivered times (ms)
+    int latency_count;
 } ClientInfo;
 
+typedef struct {
+    pid_t pid;
+    int weight;
+} WeightOverride;
+
+typedef struct {
+    unsigned int magic;
+    int current_order_id;
+    int order_count;
+    int total_orders;
+    bool has_unix_socket;  // The Unix listener follows the TCP one
+} HandoffHeader;
+
+typedef struct {
+    int order_id;
+    int x, y;
+    int item;
+    pid_t client_pid;
+    int number_of_clients;
+    int ready;              // Already cooked, goes straight to delivery
+    int has_socket;         // Recovered orders have lost their connection
+    double age_ms;          // Time since placement, keeps latency honest
+} HandoffOrder;
+
+typedef struct {
+    int count;
+    HandoffOrder orders[HANDOFF_BATCH];
+} HandoffBatch;
+
+typedef struct __attribute__((packed)) {
+    unsigned int checksum;  // FNV-1a of the rest, catches torn tail writes
+    unsigned char type;
+    int order_id;
+    int client_pid;
+    int x, y;
+    int number_of_clients;
+    int item;
+    long long timestamp_ms;
+} JournalRecord;
+
+typedef struct __attribute__((packed)) {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int record_size;
+} JournalHeader;
+
+typedef struct {
+    JournalRecord record;
+    Order* order;           // Placed order to release once durable
+    ClientInfo* client;
+    struct timespec appended_at;
+} JournalEntry;
+
+typedef struct {
+    int fd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_pending;
+    pthread_cond_t cond_durable;
+    pthread_t writer;
+    JournalEntry* pending;
+    int count, capacity;
+    long appended_lsn, durable_lsn;
+    long records_written, syncs;
+    double commit_ms_total, commit_ms_max;
+    bool stopping;
+} Journal;
+
+typedef struct {
+    _Atomic long counters[COUNTER_COUNT];
+    _Atomic long buckets[STAGE_COUNT][HISTOGRAM_BUCKETS];
+    _Atomic long sum_us[STAGE_COUNT];
+} __attribute__((aligned(64))) MetricShard;
+
+#ifdef LOCK_PROFILE
+typedef struct {
+    _Atomic(pthread_mutex_t*) mutex;
+    const char* name;
+    _Atomic long acquisitions;
+    _Atomic long contended;
+    _Atomic long wait_ns;
+    _Atomic long hold_ns;
+    _Atomic long wait_buckets[PROFILE_BUCKETS];  // log2 of nanoseconds
+    _Atomic long hold_buckets[PROFILE_BUCKETS];
+    long acquired_ns;
+} LockProfile;
+
+typedef struct {
+    _Atomic(LockProfile*) lock;
+    const char* function;
+    int line;
+    _Atomic long contended;
+    _Atomic long wait_ns;
+} CallSiteProfile;
+#endif
+
+typedef struct ShopConfig {
+    int speed;
+    int cook_min, cook_max;
+    int courier_min, courier_max;
+    int oven_capacity;
+    int batch_window_ms;
+    struct ShopConfig* retired_next;
+} ShopConfig;
+
 pthread_mutex_t mutex_orders;
 pthread_mutex_t mutex_oven;
 pthread_mutex_t mutex_delivery;
 pthread_mutex_t mutex_workers;
 pthread_mutex_t mutex_clients;
 
-pthread_cond_t cond_orders;
+Waiter orders_waiter;
 pthread_cond_t cond_oven;
-pthread_cond_t cond_delivery;
+Waiter delivery_waiter;
 
 OrderQueue order_queue;
 OrderQueue delivery_queue;
 
 ClientInfo clients[MAX_CLIENTS];
 int client_count = 0;
+int drr_cursor = 0;
+
+WeightOverride weight_overrides[MAX_CLIENTS];
+int weight_override_count = 0;
+int default_weight = 1;
 
 int current_order_id = 0;
 int oven_count = 0;
 
 int total_orders = 0;
-int delivered_orders = 0;
+
+MetricShard metric_shards[METRIC_SHARDS];
+_Atomic int next_metric_shard = 0;
+__thread MetricShard* my_metric_shard = NULL;
+FiberScheduler fibers = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+__thread Fiber* running_fiber = NULL;
+__thread ucontext_t* carrier_context = NULL;
+int fiber_carriers = 0;
+RolePlacement placements[ROLE_COUNT] = {
+    { .role = "cook", .policy = -1 }, { .role = "courier", .policy = -1 },
+    { .role = "ingest", .policy = -1 }, { .role = "journal", .policy = -1 } };
+int placement_bench_seconds = 0;
+int waiter_bench_handoffs = 0;
+_Atomic bool placement_bench_running = true;
+FleetClass fleet_classes[FLEET_CLASSES];
+int fleet_class_count = 0;
+Moto* motos;
+bool dispatch_fleet = false;  // --dispatch=fleet: motos wait for a planned route instead of taking the shelf's head
+int dispatch_bench_orders = 0;
+long dispatch_ticks = 0, dispatch_routes = 0, dispatch_stops = 0;
+int prep_batch = 1;         // Orders a cook prepares per kernel call
+int prep_bench_orders = 0;
+int prep_cache_entries = PREP_CACHE_ENTRIES;  // --prep-cache, 0 turns memoisation off
+PrepCacheShard prep_cache[PREP_CACHE_SHARDS];
+bool kitchen_staged = false;  // --kitchen=staged: cooks specialise in one stage each
+int kitchen_bench_orders = 0;
+KitchenStage kitchen[KITCHEN_STAGES];
+const char* kitchen_stage_names[KITCHEN_STAGES] = { "intake", "prepare", "oven", "dispatch" };
+_Atomic int kitchen_in_flight = 0;  // Taken from the fair queue, not yet ready or discarded
+StatusSlot status_table[STATUS_SLOTS];
+int status_bench_seconds = 0;
+
+#ifdef LOCK_PROFILE
+LockProfile lock_profiles[PROFILE_LOCKS];
+CallSiteProfile call_site_profiles[PROFILE_SITES];
+pthread_mutex_t lock_profiles_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+int metrics_port = 0;
+const char* backend_name = "epoll";
+pthread_t ingest_thread;
+const char* counter_names[COUNTER_COUNT] = { "orders_placed", "orders_rejected", "orders_cooked", "orders_delivered", "ingest_syscalls",
+                                             "cancel_requests", "orders_cancelled_queued", "orders_cancelled_kitchen", "orders_cancelled_ready", "cancels_too_late",
+                                             "orders_cancelled_unbaked", "cancelled_cook_wasted_us", "prep_cache_hits", "prep_cache_misses", "prep_miss_cpu_us",
+                                             "status_queries", "status_replies_dropped", "prep_batch_shared" };
+Order* order_index[ORDER_INDEX_BUCKETS];
+pthread_mutex_t mutex_index = PTHREAD_MUTEX_INITIALIZER;
+const char* stage_names[STAGE_COUNT] = { "queue_wait", "prepare", "oven_wait", "bake", "batch_wait", "drive" };
 
 Worker* cooks;
 Worker* couriers;
 int cook_thread_pool_size;
 int delivery_thread_pool_size;
+int speed;
+int origin_x = 0, origin_y = 0;  // Where couriers start; a sharded shop sits inside its area
+
+_Atomic(ShopConfig*) shop_config = NULL;
+ShopConfig* retired_configs = NULL;
+char* config_path = NULL;
+volatile sig_atomic_t reload_requested = 0;
+
+WorkerPool cook_pool = { .role = "Cook", .min = -1, .max = -1 };
+WorkerPool courier_pool = { .role = "Moto", .min = -1, .max = -1 };
+int scale_depth = 2;        // Queued orders per active worker before growing
+int scale_wait_ms = 3000;   // Oldest queued order age before growing
+int scale_cooldown = 2;     // Seconds between two resizes of one pool
+int scale_idle = 5;         // Seconds of idleness before shrinking
+struct timespec shop_started_at;
 FILE *log_file;
 
 bool running = true;
+bool accepting = true;
+char* upgrade_socket_path = NULL;
+char* unix_socket_path = NULL;
+char* takeover_path = NULL;
+char* journal_path = NULL;
+FILE* trace_file = NULL;
+struct timespec trace_started;
+uint64_t trace_written_us;  // Sum of deltas so far, guarded by mutex_orders
+int journal_bench_rate = 0;
+Journal journal = { .fd = -1 };
 
 void enqueue(OrderQueue* queue, Order* order);
 Order* dequeue(OrderQueue* queue);
+void queue_remove(OrderQueue* queue, Order* order);
+void enqueue_fair(ClientInfo* client, Order* order);
+Order* dequeue_fair();
+bool admit_order(ClientInfo* client);
+int client_weight(pid_t pid);
+void parse_options(int argc, char *argv[]);
+double elapsed_ms(struct timespec* from, struct timespec* to);
+int compare_doubles(const void* a, const void* b);
+void report_fairness();
 
 void *cook_thread(void *arg);
 void *delivery_thread(void *arg);
+void *scaler_thread(void *arg);
+void init_pool(WorkerPool* pool, int initial);
+bool spawn_worker(WorkerPool* pool);
+Fiber* fiber_self();
+MatrixScratch* carrier_scratch();
+void fiber_switch_out(Fiber* self, int state);
+void fiber_start(int carriers);
+void fiber_stop();
+bool fiber_spawn(void *(*routine)(void *), void* arg);
+void fiber_entry();
+void fiber_push(Fiber* fiber);
+void fiber_wake(Fiber* fiber);
+void* carrier_thread(void* arg);
+void fiber_park(Fiber* self, const struct timespec* wake_at);
+void timer_swap(int a, int b);
+void timer_sift(int slot);
+void timer_push(Fiber* fiber);
+void timer_remove(Fiber* fiber);
+void fiber_wait_begin(FiberWaiter* waiter);
+void fiber_wait_end(FiberWaiter* waiter);
+void fiber_waiter_unlink(FiberWaiter* waiter);
+void fiber_wake_waiters(void* key, bool all);
+void fiber_mutex_lock(pthread_mutex_t* mutex);
+void fiber_mutex_unlock(pthread_mutex_t* mutex);
+int fiber_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline);
+void fiber_cond_signal(pthread_cond_t* cond, bool all);
+void nap_us(long us);
+void worker_exit();
+void report_fibers();
+void apply_placement(int role);
+RolePlacement* placement_for(const char* spec, const char** rest);
+bool parse_cpu_list(const char* list, cpu_set_t* cpus);
+bool irq_cpus(const char* device, cpu_set_t* cpus);
+void parse_placement(const char* option);
+void* placement_burner(void* arg);
+void* placement_sleeper(void* arg);
+void* placement_prober(void* arg);
+void placement_benchmark(int seconds);
+void trace_open(const char* path);
+void waiter_init(Waiter* waiter);
+uint32_t waiter_prepare(Waiter* waiter);
+void waiter_wait(Waiter* waiter, uint32_t key);
+void waiter_notify(Waiter* waiter, bool all);
+void waiter_shutdown(Waiter* waiter);
+void* waiter_bench_consumer(void* arg);
+void waiter_bench_run(WaiterBench* bench, int consumers, int handoffs, int gap_us);
+void waiter_benchmark(int handoffs);
+void trace_record(OrderMessage* message, struct timespec* arrived_at);
+void parse_fleet(const char* spec);
+void moto_init(Moto* moto, int slot);
+int moto_speed(const Moto* moto);
+bool fleet_routes();
+double route_walk(const DispatchMoto* moto, const DispatchOrder* orders, int extra, int at, double* trip_ms, double* arrivals);
+void dispatch_plan(DispatchOrder* orders, int order_count, DispatchMoto* plan, int moto_count);
+void dispatch_tick();
+void* dispatcher_thread(void* arg);
+void report_dispatch();
+void dispatch_simulate(DispatchOrder* orders, int count, const DispatchMoto* fleet, int moto_count, bool central, double* latencies, double* span_ms);
+void dispatch_benchmark(int count);
+bool worker_should_retire(WorkerPool* pool, Worker* worker);
+void scale_pool(WorkerPool* pool, int depth, double oldest_wait_ms, double dt);
+void report_scaling();
+const ShopConfig* current_config();
+void publish_config(ShopConfig* config);
+bool load_config(const char* path, ShopConfig* config);
+void reload_config();
+void handle_sighup(int sig);
+void *config_watcher_thread(void *arg);
+void set_pool_bounds(WorkerPool* pool, int min, int max);
+void apply_pool_bounds(WorkerPool* pool, int min, int max);
 void handle_sigint(int sig);
-int calculate_pseudo_inverse();
+void print_summary();
+ClientInfo* register_client(pid_t pid, int number_of_clients);
+void client_order_done(ClientInfo* client);
+int send_with_fds(int sock, void* data, size_t len, int* fds, int fd_count);
+int recv_with_fds(int sock, void* data, size_t len, int* fds, int max_fds);
+int open_upgrade_socket(const char* path);
+bool handoff_to_successor(int server_socket, int unix_socket, int upgrade_socket);
+int takeover_from_predecessor(const char* path, int* unix_socket);
+void drain_in_flight_orders();
+void wait_for_workers();
+unsigned int journal_checksum(const JournalRecord* record);
+bool journal_check_header(int fd, const char* path);
+void journal_open(const char* path);
+void journal_append(int type, Order* order, ClientInfo* release_to);
+void journal_flush();
+void *journal_writer_thread(void *arg);
+void journal_recover(const char* path);
+void report_journal();
+void journal_benchmark(const char* path, int rate);
+MetricShard* metric_shard();
+void metric_add(int counter, long value);
+long metric_total(int counter);
+int histogram_bucket(long us);
+long histogram_upper_bound(int bucket);
+void metric_observe(int stage, struct timespec* from, struct timespec* to);
+void buffer_printf(char** buffer, size_t* length, size_t* capacity, const char* format, ...);
+char* render_metrics(size_t* length);
+void *metrics_thread(void *arg);
+Connection* connection_create(int fd, int kind);
+void connection_retain(Connection* conn);
+void connection_release(Connection* conn);
+int place_order(Connection* conn, OrderMessage* message);
+bool read_orders(Connection* conn, int epoll_fd);
+void ingest_loop(int server_socket, int unix_socket, int upgrade_socket);
+int open_unix_listener(const char* path);
+bool shm_attach(Connection* conn, int* fds);
+void shm_detach(ShmChannel* shm);
+bool shm_push_status(Connection* conn, int order_id, int state, uint32_t slot);
+void shm_ring_client(Connection* conn);
+void drain_shm_orders(Connection* conn);
+void index_insert(Order* order);
+Order* index_lookup(int order_id);
+void index_unlink(Order* order);
+void index_remove(Order* order);
+int cancel_order(int order_id, pid_t pid);
+void retire_cancelled(Order* order, const char* where);
+int handle_frame(Connection* conn, OrderMessage* message, int* state);
+double stage_mean_us(int stage);
+void report_cancellations();
+void consume_orders(Connection* conn, const char* data, int length);
+void consume_order(Connection* conn, OrderMessage* message);
+bool uring_setup(Uring* ring);
+void uring_teardown(Uring* ring);
+struct io_uring_sqe* uring_get_sqe(Uring* ring);
+int uring_enter(Uring* ring, unsigned wait_for, struct __kernel_timespec* timeout);
+void uring_recycle_buffer(Uring* ring, int bid);
+void uring_publish_buffers(Uring* ring);
+void uring_prep_recv(Uring* ring, Connection* conn);
+void uring_prep_accept(Uring* ring, int fd, unsigned long long tag);
+void uring_prep_poll(Uring* ring, int fd, int events, unsigned long long tag);
+void uring_arm_flush(Uring* ring, Connection* conn);
+void uring_prep_close(Uring* ring, int fd);
+bool uring_ingest_loop(int* server_socket, int unix_socket, int upgrade_socket);
+#ifdef LOCK_PROFILE
+long profile_now_ns();
+int log2_bucket(long ns);
+LockProfile* lock_profile(pthread_mutex_t* mutex, const char* name);
+void record_call_site(LockProfile* profile, const char* function, int line, long wait_ns);
+void profiled_lock(pthread_mutex_t* mutex, const char* name, const char* function, int line);
+void end_hold(pthread_mutex_t* mutex);
+void profiled_unlock(pthread_mutex_t* mutex);
+int profiled_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline);
+double bucket_percentile_us(_Atomic long* buckets, double fraction);
+int compare_call_sites(const void* a, const void* b);
+void report_lock_profile();
+#endif
+int calculate_pseudo_inverse(int item);
+PrepScratch* prep_scratch();
+int prepare_batch(const int* items, int count);
+int prepare_orders(Order** batch, int count);
+bool prep_cache_lookup(int item);
+void prep_cache_put(int item, double (*result)[40]);
+void prep_cache_unlink(PrepCacheShard* shard, PrepEntry* entry);
+void prep_cache_push(PrepCacheShard* shard, PrepEntry* entry);
+void prep_cache_clear();
+double prep_saved_seconds();
+void report_prep_cache();
+void prep_benchmark(int orders);
+void* kitchen_thread(void* arg);
+void kitchen_intake(Worker* cook);
+void kitchen_prepare(Worker* cook);
+void kitchen_oven(Worker* cook);
+void kitchen_dispatch(Worker* cook);
+void kitchen_discard(Order* order, const char* where, long wasted_us);
+void kitchen_account(int stage, struct timespec* from, struct timespec* to, int orders);
+void stage_put(int stage, Order* order);
+int stage_take(int stage, Worker* cook, Order** orders, int max);
+void kitchen_init(int budget);
+void kitchen_shutdown();
+void* kitchen_controller_thread(void* arg);
+void kitchen_move(int from, int to);
+void report_kitchen();
+void kitchen_bench_run(bool staged, int budget, int orders, int result_fd);
+void kitchen_benchmark(int orders);
+void status_publish(Order* order, int state);
+bool status_lookup(int order_id, StatusReply* reply);
+void status_answer(Connection* conn, int order_id);
+void cancel_answer(Connection* conn, int order_id, int result);
+void status_queue(Connection* conn, StatusReply* reply);
+void status_flush(Connection* conn);
+void status_arm(Connection* conn, int epoll_fd);
+void* status_bench_reader(void* arg);
+void* status_bench_writer(void* arg);
+void status_bench_run(StatusBench* bench, bool locked, int readers, int seconds);
+void status_benchmark(int seconds);
 void cleanup_queue(OrderQueue* queue);
 void cleanup_resources();
 void thank_most_orders(Worker* workers, int size, const char* role);
 
-int numberOfClients;
-
 int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s [portnumber] [CookthreadPoolSize] [DeliveryPoolSize] [k]\n", argv[0]);
+    if (argc < 5) {
+        fprintf(stderr, "Usage: %s [portnumber] [CookthreadPoolSize] [DeliveryPoolSize] [k] [--default-weight=W] [--weight=PID:W] [--cook-min=N] [--cook-max=N] [--courier-min=N] [--courier-max=N] [--scale-depth=N] [--scale-wait=MS] [--scale-cooldown=S] [--scale-idle=S] [--config=FILE] [--upgrade-socket=PATH] [--takeover=PATH] [--unix-socket=PATH] [--origin=X,Y] [--journal=FILE] [--journal-bench=RATE] [--metrics-port=N] [--backend=epoll|io_uring] [--fibers=N] [--cpus=ROLE:LIST|ROLE:irq:DEV] [--sched=ROLE:POLICY[:PRIO]] [--nice=ROLE:N] [--placement-bench=S] [--record=FILE] [--waiter-bench=N] [--fleet=N:SPEED:CAP,...] [--dispatch=queue|fleet] [--dispatch-bench=N] [--prep-batch=B] [--prep-bench=N] [--prep-cache=N] [--kitchen=monolithic|staged] [--kitchen-bench=N] [--status-bench=S]...\n", argv[0]);
         exit(1);
     }
+    parse_options(argc, argv);
 
     int port = atoi(argv[1]);
     cook_thread_pool_size = atoi(argv[2]);
     delivery_thread_pool_size = atoi(argv[3]);
-    int speed = atoi(argv[4]);
+    speed = atoi(argv[4]);
 
     int server_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-
-    pthread_t cook_threads[cook_thread_pool_size];
-    pthread_t delivery_threads[delivery_thread_pool_size];
+    int unix_socket = -1;
+    struct sockaddr_in server_addr;
 
     signal(SIGINT, handle_sigint);
+    signal(SIGHUP, handle_sighup);
 
     pthread_mutex_init(&mutex_orders, NULL);
     pthread_mutex_init(&mutex_oven, NULL);
@@ -113,9 +905,12 @@ int main(int argc, char *argv[]) {
     pthread_mutex_init(&mutex_workers, NULL);
     pthread_mutex_init(&mutex_clients, NULL);
 
-    pthread_cond_init(&cond_orders, NULL);
+    waiter_init(&orders_waiter);
+    for (int i = 0; i < PREP_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&prep_cache[i].mutex, NULL);
+    }
     pthread_cond_init(&cond_oven, NULL);
-    pthread_cond_init(&cond_delivery, NULL);
+    waiter_init(&delivery_waiter);
 
     order_queue.front = order_queue.rear = NULL;
     order_queue.size = 0;
@@ -124,324 +919,488 @@ int main(int argc, char *argv[]) {
     delivery_queue.size = 0;
     pthread_mutex_init(&delivery_queue.mutex, NULL);  // Initialize queue mutex
 
-    cooks = malloc(cook_thread_pool_size * sizeof(Worker));
-    for (int i = 0; i < cook_thread_pool_size; i++) {
-        cooks[i].id = i + 1;
-        cooks[i].available = true;
-        cooks[i].orders_processed = 0; // Initialize orders processed
-        pthread_cond_init(&cooks[i].cond, NULL);
+    cook_pool.routine = kitchen_staged ? kitchen_thread : cook_thread;
+    courier_pool.routine = delivery_thread;
+    init_pool(&cook_pool, cook_thread_pool_size);
+    init_pool(&courier_pool, delivery_thread_pool_size);
+    cooks = cook_pool.workers;
+    couriers = courier_pool.workers;
+    if (kitchen_staged) {
+        if (cook_pool.min != cook_pool.max || cook_pool.target < KITCHEN_STAGES) {
+            fprintf(stderr, "--kitchen=staged needs a fixed pool of at least %d cooks\n", KITCHEN_STAGES);
+            exit(1);
+        }
+        kitchen_init(cook_pool.target);
     }
-
-    couriers = malloc(delivery_thread_pool_size * sizeof(Worker));
-    for (int i = 0; i < delivery_thread_pool_size; i++) {
-        couriers[i].id = i + 1;
-        couriers[i].available = true;
-        couriers[i].orders_processed = 0; // Initialize orders processed
-        pthread_cond_init(&couriers[i].cond, NULL);
+    motos = malloc(courier_pool.capacity * sizeof(Moto));
+    for (int i = 0; i < courier_pool.capacity; i++) {
+        moto_init(&motos[i], i);
     }
 
-    log_file = fopen("pideshop.log", "a");
-    if (log_file == NULL) {
-        perror("Log file opening failed");
+    ShopConfig* config = malloc(sizeof(ShopConfig));
+    config->speed = speed;
+    config->cook_min = cook_pool.min;
+    config->cook_max = cook_pool.max;
+    config->courier_min = courier_pool.min;
+    config->courier_max = courier_pool.max;
+    config->oven_capacity = MAX_OVEN_CAPACITY;
+    config->batch_window_ms = BATCH_WINDOW_MS;
+    config->retired_next = NULL;
+    if (config_path != NULL && !load_config(config_path, config)) {
         exit(1);
     }
-
-    if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("Socket creation failed");
-        exit(1);
+    publish_config(config);
+    if (!kitchen_staged) {  // The staged kitchen keeps the cooks it started with
+        set_pool_bounds(&cook_pool, config->cook_min, config->cook_max);
     }
+    set_pool_bounds(&courier_pool, config->courier_min, config->courier_max);  // Workers start once the shop is ready
 
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-        perror("setsockopt failed");
-        exit(1);
+    if (waiter_bench_handoffs > 0) {
+        waiter_benchmark(waiter_bench_handoffs);
     }
-
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        perror("Socket bind failed");
-        exit(1);
+    if (dispatch_bench_orders > 0) {
+        dispatch_benchmark(dispatch_bench_orders);
+    }
+    if (prep_bench_orders > 0) {
+        prep_benchmark(prep_bench_orders);
+    }
+    if (kitchen_bench_orders > 0) {
+        kitchen_benchmark(kitchen_bench_orders);
+    }
+    if (status_bench_seconds > 0) {
+        status_benchmark(status_bench_seconds);
+    }
+    if (placement_bench_seconds > 0) {
+        placement_benchmark(placement_bench_seconds);
+    }
+    if (journal_bench_rate > 0) {
+        journal_benchmark(journal_path != NULL ? journal_path : "pideshop.journal", journal_bench_rate);
     }
 
-    if (listen(server_socket, 10) == -1) {
-        perror("Listen failed");
+    log_file = fopen("pideshop.log", "a");
+    if (log_file == NULL) {
+        perror("Log file opening failed");
         exit(1);
     }
 
-    printf("PideShop active waiting for connections...\n");
+    if (takeover_path != NULL) {
+        server_socket = takeover_from_predecessor(takeover_path, &unix_socket);
+    } else {
+        if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+            perror("Socket creation failed");
+            exit(1);
+        }
+
+        int opt = 1;
+        if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt failed");
+            exit(1);
+        }
+
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+            perror("Socket bind failed");
+            exit(1);
+        }
 
-    for (int i = 0; i < cook_thread_pool_size; i++) {
-        pthread_create(&cook_threads[i], NULL, cook_thread, NULL);
+        if (listen(server_socket, 10) == -1) {
+            perror("Listen failed");
+            exit(1);
+        }
     }
-    for (int i = 0; i < delivery_thread_pool_size; i++) {
-        pthread_create(&delivery_threads[i], NULL, delivery_thread, (void *)(intptr_t)speed);
+    int upgrade_socket = upgrade_socket_path != NULL ? open_upgrade_socket(upgrade_socket_path) : -1;
+    if (unix_socket == -1 && unix_socket_path != NULL) {
+        unix_socket = open_unix_listener(unix_socket_path);
     }
 
-    while (running) {
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_socket == -1) {
-            if (running) {
-                perror("Accept failed");
-            }
-            continue;
+    if (journal_path != NULL) {
+        if (takeover_path == NULL) {
+            journal_recover(journal_path);
         }
+        journal_open(journal_path);
+    }
 
-        pid_t client_pid;
-
-        recv(client_socket, &numberOfClients, sizeof(int), 0);
-        recv(client_socket, &client_pid, sizeof(pid_t), 0);
+    printf("PideShop active waiting for connections...\n");
 
-        pthread_mutex_lock(&mutex_clients);
-        bool found = false;
-        for (int i = 0; i < client_count; i++) {
-            if (clients[i].pid == client_pid) {
-                found = true;
-                break;
-            }
-        }
-        if (!found && client_count < MAX_CLIENTS) {
-            clients[client_count].pid = client_pid;
-            clients[client_count].numberOfClients = numberOfClients;
-            clients[client_count].announced = false;
-            clients[client_count].orders_to_serve = 0;
-            client_count++;
-        }
-        pthread_mutex_unlock(&mutex_clients);
+    clock_gettime(CLOCK_MONOTONIC, &shop_started_at);
+    if (fiber_carriers > 0) {
+        fiber_start(fiber_carriers);  // Not before the benchmarks: some of them fork
+    }
+    LOCK(&mutex_workers);
+    while (cook_pool.active < cook_pool.target && spawn_worker(&cook_pool)) {
+    }
+    while (courier_pool.active < courier_pool.target && spawn_worker(&courier_pool)) {
+    }
+    UNLOCK(&mutex_workers);
 
-        pthread_mutex_lock(&mutex_orders);
-        if (order_queue.size < MAX_ORDERS) {
-            Order* new_order = (Order*)malloc(sizeof(Order));
-            new_order->client_socket = client_socket;
-            new_order->order_id = ++current_order_id;
-            recv(client_socket, &new_order->x, sizeof(int), 0);
-            recv(client_socket, &new_order->y, sizeof(int), 0);
-            new_order->client_pid = client_pid;
-            new_order->next = NULL;
+    pthread_t scaler;
+    if (cook_pool.min < cook_pool.max || courier_pool.min < courier_pool.max || config_path != NULL) {
+        pthread_create(&scaler, NULL, scaler_thread, NULL);
+        pthread_detach(scaler);
+    }
+    pthread_t metrics;
+    if (metrics_port > 0) {
+        pthread_create(&metrics, NULL, metrics_thread, NULL);
+        pthread_detach(metrics);
+    }
+    pthread_t controller;
+    if (kitchen_staged) {
+        pthread_create(&controller, NULL, kitchen_controller_thread, NULL);
+        pthread_detach(controller);
+    }
+    pthread_t dispatcher;
+    if (dispatch_fleet) {
+        pthread_create(&dispatcher, NULL, dispatcher_thread, NULL);
+        pthread_detach(dispatcher);
+    }
+    pthread_t watcher;
+    if (config_path != NULL) {
+        pthread_create(&watcher, NULL, config_watcher_thread, NULL);
+        pthread_detach(watcher);
+    }
 
-            pthread_mutex_lock(&order_queue.mutex);
-            enqueue(&order_queue, new_order);
-            pthread_mutex_unlock(&order_queue.mutex);
+    ingest_thread = pthread_self();
+    apply_placement(ROLE_INGEST);
+    if (strcmp(backend_name, "io_uring") == 0 && !uring_ingest_loop(&server_socket, unix_socket, upgrade_socket)) {
+        printf("io_uring unavailable, falling back to epoll\n");
+        backend_name = "epoll";
+    }
+    if (strcmp(backend_name, "epoll") == 0) {
+        ingest_loop(server_socket, unix_socket, upgrade_socket);
+    }
 
-            pthread_mutex_lock(&mutex_clients);
-            for (int i = 0; i < client_count; i++) {
-                if (clients[i].pid == client_pid && !clients[i].announced) {
-                    printf("%d new customers... Serving\n", clients[i].numberOfClients);
-                    fprintf(log_file, "%d new customers... Serving\n", clients[i].numberOfClients);
-                    fflush(log_file);
-                    clients[i].announced = true;
-                }
-                if (clients[i].pid == client_pid) {
-                    clients[i].orders_to_serve++;
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&mutex_clients);
-            printf("Order %d placed from location (%d, %d) by client PID %d\n", new_order->order_id, new_order->x, new_order->y, new_order->client_pid);
-            fprintf(log_file, "Order %d placed from location (%d, %d) by client PID %d\n", new_order->order_id, new_order->x, new_order->y, new_order->client_pid);
-            fflush(log_file);
-            total_orders++;
-            pthread_cond_signal(&cond_orders);
-        } else {
-            close(client_socket);
+    if (server_socket != -1) {
+        close(server_socket);
+    }
+    if (unix_socket != -1) {
+        close(unix_socket);
+        if (accepting) {
+            unlink(unix_socket_path);
         }
-        pthread_mutex_unlock(&mutex_orders);
     }
-
-    for (int i = 0; i < cook_thread_pool_size; i++) {
-        pthread_cancel(cook_threads[i]);
-        pthread_join(cook_threads[i], NULL);
+    if (upgrade_socket != -1) {
+        close(upgrade_socket);
+    }
+    if (!accepting) {
+        drain_in_flight_orders();
+        printf("\nOld PideShop retiring after upgrade...\n");
+        fprintf(log_file, "\nOld PideShop retiring after upgrade...\n");
+        print_summary();
     }
-    for (int i = 0; i < delivery_thread_pool_size; i++) {
-        pthread_cancel(delivery_threads[i]);
-        pthread_join(delivery_threads[i], NULL);
+    running = false;
+    waiter_shutdown(&orders_waiter);
+    waiter_shutdown(&delivery_waiter);
+    if (kitchen_staged) {
+        kitchen_shutdown();
     }
+    wait_for_workers();
 
-    close(server_socket);
     fclose(log_file);
     cleanup_resources();  // Cleanup resources here
     return 0;
 }
 
 void *cook_thread(void *arg) {
-    Worker* cook = NULL;
+    Worker* cook = (Worker*)arg;
+    if (fiber_self() == NULL) {
+        apply_placement(ROLE_COOK);
+    }
 
     while (1) {
-        pthread_mutex_lock(&mutex_workers);
-        for (int i = 0; i < cook_thread_pool_size; i++) {
-            if (cooks[i].available) {
-                cook = &cooks[i];
-                cook->available = false;
-                break;
+        LOCK(&mutex_orders);
+        while (order_queue.size == 0) {
+            if (worker_should_retire(&cook_pool, cook)) {
+                UNLOCK(&mutex_orders);
+                worker_exit();
             }
+            // Announced under the lock, so an order placed once we let go wakes us
+            uint32_t key = waiter_prepare(&orders_waiter);
+            UNLOCK(&mutex_orders);
+            waiter_wait(&orders_waiter, key);
+            LOCK(&mutex_orders);
+            if (!running && worker_should_retire(&cook_pool, cook)) {
+                UNLOCK(&mutex_orders);
+                worker_exit();
+            }
+        }
+        cook->busy = true;
+        Order* batch[PREP_BATCH_MAX];
+        int count = 0;
+        LOCK(&order_queue.mutex);
+        while (count < prep_batch && order_queue.size > 0) {
+            batch[count++] = dequeue_fair();
         }
-        pthread_mutex_unlock(&mutex_workers);
+        UNLOCK(&order_queue.mutex);
+        UNLOCK(&mutex_orders);
 
-        pthread_mutex_lock(&mutex_orders);
-        while (order_queue.size == 0) {
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += 1;
-            pthread_cond_timedwait(&cond_orders, &mutex_orders, &ts);
-            if (!running) {
-                pthread_mutex_unlock(&mutex_orders);
-                pthread_exit(NULL);
-            }
-        }
-        pthread_mutex_lock(&order_queue.mutex);
-        Order* order = dequeue(&order_queue);
-        pthread_mutex_unlock(&order_queue.mutex);
-        pthread_mutex_unlock(&mutex_orders);
-
-        int prepare_time = calculate_pseudo_inverse();
-        printf("Cook %d is cooking order %d...\n", cook->id, order->order_id);
-        fprintf(log_file, "Cook %d is cooking order %d...\n", cook->id, order->order_id);
+        struct timespec started_at, prepared_at, oven_at, baked_at;
+        clock_gettime(CLOCK_MONOTONIC, &started_at);
+        for (int i = 0; i < count; i++) {
+            metric_observe(STAGE_QUEUE_WAIT, &batch[i]->placed_at, &started_at);
+        }
+
+        int prepare_time = prepare_orders(batch, count);
+        for (int i = 0; i < count; i++) {
+            printf("Cook %d is cooking order %d...\n", cook->id, batch[i]->order_id);
+            fprintf(log_file, "Cook %d is cooking order %d...\n", cook->id, batch[i]->order_id);
+        }
         fflush(log_file);
-        usleep(prepare_time / 2000); // Half time of prepare using usleep
-        printf("Cook %d completed cooking for order %d, taken out of the oven...\n", cook->id, order->order_id);
-        fprintf(log_file, "Cook %d completed cooking for order %d, taken out of the oven...\n", cook->id, order->order_id);
+        nap_us(prepare_time / 2000); // Half time of prepare using usleep
+        for (int i = 0; i < count; i++) {
+            printf("Cook %d completed cooking for order %d, taken out of the oven...\n", cook->id, batch[i]->order_id);
+            fprintf(log_file, "Cook %d completed cooking for order %d, taken out of the oven...\n", cook->id, batch[i]->order_id);
+        }
         fflush(log_file);
 
-        cook->orders_processed++; // Increment orders processed by the cook
-
-        pthread_mutex_lock(&mutex_oven);
-        while (oven_count >= MAX_OVEN_CAPACITY) {
-            printf("Oven is full, waiting...\n");
-            fprintf(log_file, "Oven is full, waiting...\n");
-            fflush(log_file);
-            pthread_cond_wait(&cond_oven, &mutex_oven);
+        cook->orders_processed += count; // Increment orders processed by the cook
+        clock_gettime(CLOCK_MONOTONIC, &prepared_at);
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            Order* order = batch[i];
+            metric_observe(STAGE_PREPARE, &started_at, &prepared_at);
+            if (atomic_load(&order->state) == ORDER_CANCELLED) {
+                // Cancelled while being prepared: keep it out of the oven
+                metric_add(COUNTER_CANCELLED_UNBAKED, 1);
+                metric_add(COUNTER_CANCEL_WASTED_US, (long)(elapsed_ms(&started_at, &prepared_at) * 1000 / count));
+                index_remove(order);
+                retire_cancelled(order, "before the oven");
+                continue;
+            }
+            batch[kept++] = order;
         }
 
-        oven_count++;
-        pthread_mutex_unlock(&mutex_oven);
+        // The batch goes in as oven slots free up, as many at a time as fit
+        for (int baked = 0; baked < kept;) {
+            LOCK(&mutex_oven);
+            while (oven_count >= current_config()->oven_capacity) {
+                printf("Oven is full, waiting...\n");
+                fprintf(log_file, "Oven is full, waiting...\n");
+                fflush(log_file);
+                COND_WAIT(&cond_oven, &mutex_oven);
+            }
+            int slots = current_config()->oven_capacity - oven_count;
+            slots = slots < kept - baked ? slots : kept - baked;
+            oven_count += slots;
+            UNLOCK(&mutex_oven);
+            clock_gettime(CLOCK_MONOTONIC, &oven_at);
 
-        usleep(200000); // Simulate oven time with shorter sleep
+            nap_us(200000); // Simulate oven time with shorter sleep
+            clock_gettime(CLOCK_MONOTONIC, &baked_at);
+            for (int i = baked; i < baked + slots; i++) {
+                metric_observe(STAGE_OVEN_WAIT, &prepared_at, &oven_at);
+                metric_observe(STAGE_BAKE, &oven_at, &baked_at);
+                batch[i]->ready_at = baked_at;
+            }
+            metric_add(COUNTER_COOKED, slots);
 
-        pthread_mutex_lock(&mutex_oven);
-        oven_count--;
-        pthread_cond_signal(&cond_oven);
-        pthread_mutex_unlock(&mutex_oven);
+            LOCK(&mutex_oven);
+            oven_count -= slots;
+            if (slots > 1) {
+                COND_BROADCAST(&cond_oven);
+            } else {
+                COND_SIGNAL(&cond_oven);
+            }
+            UNLOCK(&mutex_oven);
 
-        printf("Order %d is ready for delivery.\n", order->order_id);
-        fprintf(log_file, "Order %d is ready for delivery.\n", order->order_id);
-        fflush(log_file);
+            // Only the move to READY under the delivery lock makes it cancellable
+            // by unlinking; a cancel that got in first means it goes in the bin.
+            bool ready[PREP_BATCH_MAX];
+            LOCK(&mutex_delivery);
+            LOCK(&delivery_queue.mutex);
+            for (int i = baked; i < baked + slots; i++) {
+                int state = ORDER_COOKING;
+                ready[i] = atomic_compare_exchange_strong(&batch[i]->state, &state, ORDER_READY);
+                if (ready[i]) {
+                    enqueue(&delivery_queue, batch[i]);
+                    status_publish(batch[i], STATUS_READY);
+                }
+            }
+            UNLOCK(&delivery_queue.mutex);
+            waiter_notify(&delivery_waiter, slots > 1);
+            UNLOCK(&mutex_delivery);
 
-        pthread_mutex_lock(&mutex_delivery);
-        pthread_mutex_lock(&delivery_queue.mutex);
-        enqueue(&delivery_queue, order);
-        pthread_mutex_unlock(&delivery_queue.mutex);
-        pthread_cond_signal(&cond_delivery);
-        pthread_mutex_unlock(&mutex_delivery);
+            for (int i = baked; i < baked + slots; i++) {
+                Order* order = batch[i];
+                if (ready[i]) {
+                    if (journal.fd != -1) {
+                        journal_append(JOURNAL_COOKED, order, NULL);
+                    }
+                    printf("Order %d is ready for delivery.\n", order->order_id);
+                    fprintf(log_file, "Order %d is ready for delivery.\n", order->order_id);
+                    fflush(log_file);
+                } else {
+                    metric_add(COUNTER_CANCEL_WASTED_US, (long)(elapsed_ms(&started_at, &baked_at) * 1000 / count));
+                    index_remove(order);
+                    retire_cancelled(order, "out of the oven");
+                }
+            }
+            baked += slots;
+        }
 
-        pthread_mutex_lock(&mutex_workers);
-        cook->available = true;
-        pthread_cond_signal(&cook->cond);
-        pthread_mutex_unlock(&mutex_workers);
+        LOCK(&mutex_workers);
+        cook->busy = false;
+        COND_SIGNAL(&cook->cond);
+        UNLOCK(&mutex_workers);
     }
     return NULL;
 }
 
 void *delivery_thread(void *arg) {
-    int speed = (intptr_t)arg;
-    Worker* courier = NULL;
+    Worker* courier = (Worker*)arg;
+    Moto* moto = &motos[courier->id - 1];
+    if (fiber_self() == NULL) {
+        apply_placement(ROLE_COURIER);
+    }
 
     while (1) {
-        pthread_mutex_lock(&mutex_workers);
-        for (int i = 0; i < delivery_thread_pool_size; i++) {
-            if (couriers[i].available) {
-                courier = &couriers[i];
-                courier->available = false;
-                break;
+        LOCK(&mutex_delivery);
+        while (dispatch_fleet ? moto->route_count == 0 : delivery_queue.size == 0) {
+            if (worker_should_retire(&courier_pool, courier)) {
+                moto->at_shop = false;
+                UNLOCK(&mutex_delivery);
+                worker_exit();
             }
-        }
-        pthread_mutex_unlock(&mutex_workers);
-
-        pthread_mutex_lock(&mutex_delivery);
-        while (delivery_queue.size == 0) {
-            pthread_cond_wait(&cond_delivery, &mutex_delivery);
-            if (!running) {
-                pthread_mutex_unlock(&mutex_delivery);
-                pthread_exit(NULL);
+            moto->at_shop = true;
+            uint32_t key = waiter_prepare(&delivery_waiter);
+            UNLOCK(&mutex_delivery);
+            waiter_wait(&delivery_waiter, key);
+            LOCK(&mutex_delivery);
+            if (!running && worker_should_retire(&courier_pool, courier)) {
+                moto->at_shop = false;
+                UNLOCK(&mutex_delivery);
+                worker_exit();
             }
         }
+        moto->at_shop = false;
 
-        Order* orders[MAX_DELIVERY_CAPACITY];
+        courier->busy = true;
+        Order* orders[FLEET_MAX_CAPACITY];
         int order_count = 0;
 
         printf("Moto %d is waiting for orders...\n", courier->id);
         fprintf(log_file, "Moto %d is waiting for orders...\n", courier->id);
         fflush(log_file);
 
-        pthread_mutex_lock(&delivery_queue.mutex);
-        while (order_count < MAX_DELIVERY_CAPACITY && delivery_queue.size > 0) {
-            orders[order_count++] = dequeue(&delivery_queue);
-            pthread_mutex_unlock(&delivery_queue.mutex);
-            sleep(2); // Wait for 2 seconds to see if more orders arrive
-            pthread_mutex_lock(&delivery_queue.mutex);
+        if (dispatch_fleet) {
+            order_count = moto->route_count;
+            memcpy(orders, moto->route, order_count * sizeof(Order*));
+            moto->route_count = 0;
+        } else {
+            LOCK(&delivery_queue.mutex);
+            while (order_count < moto->capacity && delivery_queue.size > 0) {
+                orders[order_count] = dequeue(&delivery_queue);
+                atomic_store(&orders[order_count]->state, ORDER_OUT);
+                status_publish(orders[order_count++], STATUS_OUT);
+                UNLOCK(&delivery_queue.mutex);
+                nap_us(current_config()->batch_window_ms * 1000); // Wait to see if more orders arrive
+                LOCK(&delivery_queue.mutex);
+            }
+            UNLOCK(&delivery_queue.mutex);
+        }
+        UNLOCK(&mutex_delivery);
+        if (order_count == 0) {  // Cancelled off the shelf before we got to it
+            LOCK(&mutex_workers);
+            courier->busy = false;
+            COND_SIGNAL(&courier->cond);
+            UNLOCK(&mutex_workers);
+            continue;
         }
-        pthread_mutex_unlock(&delivery_queue.mutex);
-        pthread_mutex_unlock(&mutex_delivery);
 
+        struct timespec departed_at;
+        clock_gettime(CLOCK_MONOTONIC, &departed_at);
+        for (int i = 0; i < order_count; i++) {
+            metric_observe(STAGE_BATCH_WAIT, &orders[i]->ready_at, &departed_at);
+            if (journal.fd != -1) {
+                journal_append(JOURNAL_OUT_FOR_DELIVERY, orders[i], NULL);
+            }
+        }
         printf("Moto %d is on the way with %d orders...\n", courier->id, order_count);
         fprintf(log_file, "Moto %d is on the way with %d orders...\n", courier->id, order_count);
         fflush(log_file);
 
+        int x = origin_x, y = origin_y;
         for (int i = 0; i < order_count; i++) {
             Order* order = orders[i];
             int client_pid = order->client_pid; // Client PID'yi burada alıyoruz
             printf("Delivering order %d to location (%d, %d)...\n", order->order_id, order->x, order->y);
             fprintf(log_file, "Delivering order %d to location (%d, %d)...\n", order->order_id, order->x, order->y);
             fflush(log_file);
-            int distance = abs(order->x) + abs(order->y);
-            int delivery_time = distance / speed;
-            //printf("Delivery Time :  %d\n", delivery_time);
-            sleep(delivery_time); // Simulate delivery time
+            if (fleet_routes()) {
+                // Drive from the previous stop, at this moto's own speed
+                nap_us((abs(order->x - x) + abs(order->y - y)) * 1000000L / moto_speed(moto));
+                x = order->x;
+                y = order->y;
+            } else {
+                int distance = abs(order->x - origin_x) + abs(order->y - origin_y);
+                int delivery_time = distance / current_config()->speed;
+                //printf("Delivery Time :  %d\n", delivery_time);
+                nap_us(delivery_time * 1000000L); // Simulate delivery time
+            }
+            struct timespec delivered_at;
+            clock_gettime(CLOCK_MONOTONIC, &delivered_at);
+            metric_observe(STAGE_DRIVE, &departed_at, &delivered_at);
+            if (journal.fd != -1) {
+                journal_append(JOURNAL_DELIVERED, order, NULL);
+            }
             printf("Order %d delivered by Moto %d.\n", order->order_id, courier->id);
             fprintf(log_file, "Order %d delivered by Moto %d.\n", order->order_id, courier->id);
             fflush(log_file);
-            delivered_orders++;
-            close(order->client_socket);
+            metric_add(COUNTER_DELIVERED, 1);
+            status_publish(order, STATUS_DELIVERED);
+            if (order->conn != NULL && order->conn->shm != NULL && shm_push_status(order->conn, order->order_id, SHM_DELIVERED, 0)) {
+                shm_ring_client(order->conn);
+            }
+            connection_release(order->conn);
 
-            pthread_mutex_lock(&mutex_clients);
+            LOCK(&mutex_clients);
             for (int j = 0; j < client_count; j++) {
                 if (clients[j].pid == client_pid) {
-                    clients[j].orders_to_serve--;
-                    if (clients[j].orders_to_serve == 0) {
-                        printf("Done serving client PID %d\n", client_pid);
-                        fprintf(log_file, "Done serving client PID %d\n", client_pid);
-                        fflush(log_file);
-                    }
+                    clients[j].delivered++;
+                    clients[j].latencies[clients[j].latency_count % LATENCY_SAMPLES] = elapsed_ms(&order->placed_at, &delivered_at);
+                    clients[j].latency_count++;
+                    client_order_done(&clients[j]);
                     break;
                 }
             }
-            pthread_mutex_unlock(&mutex_clients);
+            UNLOCK(&mutex_clients);
+            index_remove(order);
             free(order);
         }
 
         courier->orders_processed += order_count; // Increment orders processed by the courier
+        if (fleet_routes()) {
+            nap_us((abs(origin_x - x) + abs(origin_y - y)) * 1000000L / moto_speed(moto));  // Back to the shop
+        }
 
-        pthread_mutex_lock(&mutex_workers);
-        courier->available = true;
-        pthread_cond_signal(&courier->cond);
-        pthread_mutex_unlock(&mutex_workers);
+        LOCK(&mutex_workers);
+        courier->busy = false;
+        COND_SIGNAL(&courier->cond);
+        UNLOCK(&mutex_workers);
     }
     return NULL;
 }
 
-int calculate_pseudo_inverse() {
+// Every menu item has a fixed preparation: its matrices come from an
+// xorshift stream seeded by the item, so equal items give equal results.
+int calculate_pseudo_inverse(int item) {
     clock_t start, end;
     start = clock();
     int i, j, k;
-    double a[30][40], b[40][30], inverse[30][40];
+    uint64_t seed = PREP_SEED(item);
+    // A fiber borrows its carrier's matrices, since nothing here yields, and
+    // its own stack stays a few pages deep
+    MatrixScratch* scratch = fiber_self() != NULL ? carrier_scratch() : alloca(sizeof(MatrixScratch));
+    double (*a)[40] = scratch->a, (*b)[40] = scratch->b, (*inverse)[40] = scratch->inverse;
     for (i = 0; i < 30; i++) {
         for (j = 0; j < 40; j++) {
-            a[i][j] = rand() % 10;
+            a[i][j] = PREP_NEXT(seed) % 10;
         }
     }
     for (i = 0; i < 40; i++) {
-        for (j = 0; j < 30; j++) {
-            b[i][j] = rand() % 10;
+        for (j = 0; j < 40; j++) {
+            b[i][j] = PREP_NEXT(seed) % 10;
         }
     }
 
@@ -453,87 +1412,4830 @@ int calculate_pseudo_inverse() {
             }
         }
     }
+    if (prep_cache_entries > 0) {
+        prep_cache_put(item, inverse);
+    }
     end = clock();
     return end - start;
 }
 
-void handle_sigint(int sig) {
-    printf("\nShutting down PideShop...\n");
-    running = false;
-    printf("Total orders: %d, Delivered: %d\n", total_orders, delivered_orders);
-    fprintf(log_file, "\nShutting down PideShop...\n");
-    fprintf(log_file, "Total orders: %d, Delivered: %d\n", total_orders, delivered_orders);
-    fflush(log_file);
+// Like carrier_scratch(): the kernel never yields, so fibers on one carrier
+// can share its buffer.
+__attribute__((noipa)) PrepScratch* prep_scratch() {
+    static __thread PrepScratch* scratch = NULL;
+    if (scratch == NULL) {
+        scratch = aligned_alloc(64, sizeof(PrepScratch));
+    }
+    return scratch;
+}
 
-    thank_most_orders(cooks, cook_thread_pool_size, "Cook");
-    thank_most_orders(couriers, delivery_thread_pool_size, "Moto");
+// The same product as calculate_pseudo_inverse() for count items at once,
+// PREP_LANES matrices per vector. Each lane draws from its own item's stream
+// in the same order, so results match the per-order kernel exactly.
+int prepare_batch(const int* items, int count) {
+    clock_t start = clock();
+    PrepScratch* scratch = prep_scratch();
+    for (int group = 0; group < count; group += PREP_LANES) {
+        int lanes = count - group < PREP_LANES ? count - group : PREP_LANES;
+        uint64_t seeds[PREP_LANES];
+        for (int m = 0; m < lanes; m++) {
+            seeds[m] = PREP_SEED(items[group + m]);
+        }
+        for (int i = 0; i < 30; i++) {
+            for (int k = 0; k < 40; k++) {
+                for (int m = 0; m < PREP_LANES; m++) {
+                    scratch->a[i][k][m] = m < lanes ? PREP_NEXT(seeds[m]) % 10 : 0;
+                }
+            }
+        }
+        for (int k = 0; k < 40; k++) {
+            for (int j = 0; j < 40; j++) {
+                for (int m = 0; m < PREP_LANES; m++) {
+                    scratch->b[k][j][m] = m < lanes ? PREP_NEXT(seeds[m]) % 10 : 0;
+                }
+            }
+        }
 
-    pthread_cond_broadcast(&cond_orders);
-    pthread_cond_broadcast(&cond_delivery);
+        // Row by row, so b is streamed in order and every access is a whole
+        // vector; unrolled by hand since the Makefile builds without -O
+        for (int i = 0; i < 30; i++) {
+            PrepLane* row = scratch->product[i];
+            for (int j = 0; j < 40; j++) {
+                row[j] = (PrepLane){ 0 };
+            }
+            for (int k = 0; k < 40; k++) {
+                PrepLane a_ik = scratch->a[i][k];
+                PrepLane* out = row;
+                PrepLane* b_kj = scratch->b[k];
+                for (int j = 0; j < 40; j += 4, out += 4, b_kj += 4) {
+                    out[0] += a_ik * b_kj[0];
+                    out[1] += a_ik * b_kj[1];
+                    out[2] += a_ik * b_kj[2];
+                    out[3] += a_ik * b_kj[3];
+                }
+            }
+        }
 
-    cleanup_resources();  // Call cleanup_resources() function
-    exit(0);
+        for (int m = 0; prep_cache_entries > 0 && m < lanes; m++) {
+            for (int i = 0; i < 30; i++) {
+                for (int j = 0; j < 40; j++) {
+                    scratch->result[i][j] = scratch->product[i][j][m];
+                }
+            }
+            prep_cache_put(items[group + m], scratch->result);
+        }
+    }
+    return clock() - start;
 }
 
-void thank_most_orders(Worker* workers, int size, const char* role) {
-    int max_orders = 0;
-    for (int i = 0; i < size; i++) {
-        if (workers[i].orders_processed > max_orders) {
-            max_orders = workers[i].orders_processed;
+// Serves what it can from the cache and prepares the rest; an item that
+// shows up twice in one batch is prepared once. Returns clock ticks, like
+// calculate_pseudo_inverse().
+int prepare_orders(Order** batch, int count) {
+    clock_t start = clock();
+    int misses[PREP_BATCH_MAX], miss_count = 0;
+    for (int i = 0; i < count; i++) {
+        bool pending = false;
+        for (int m = 0; m < miss_count; m++) {
+            pending = pending || misses[m] == batch[i]->item;
+        }
+        if (pending) {
+            metric_add(COUNTER_PREP_SHARED, 1);  // Not a cache hit: it works with --prep-cache=0 too
+        } else if (prep_cache_lookup(batch[i]->item)) {
+            metric_add(COUNTER_PREP_HITS, 1);
+        } else {
+            misses[miss_count++] = batch[i]->item;
         }
     }
-
-    for (int i = 0; i < size; i++) {
-        if (workers[i].orders_processed == max_orders) {
-            printf("Thanks %s %d (Orders: %d)\n", role, workers[i].id, workers[i].orders_processed);
-            fprintf(log_file, "Thanks %s %d (Orders: %d)\n", role, workers[i].id, workers[i].orders_processed);
+    if (miss_count > 0) {
+        struct timespec cpu_start, cpu_end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+        if (prep_batch > 1) {
+            prepare_batch(misses, miss_count);
+        } else {
+            calculate_pseudo_inverse(misses[0]);
         }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+        metric_add(COUNTER_PREP_MISSES, miss_count);
+        metric_add(COUNTER_PREP_MISS_US, (long)(elapsed_ms(&cpu_start, &cpu_end) * 1000));
     }
-    fflush(log_file);
+    return clock() - start;
 }
 
-void enqueue(OrderQueue* queue, Order* order) {
-    if (queue->rear == NULL) {
-        queue->front = queue->rear = order;
+bool prep_cache_lookup(int item) {
+    if (prep_cache_entries == 0) {
+        return false;
+    }
+    PrepCacheShard* shard = &prep_cache[item % PREP_CACHE_SHARDS];
+    LOCK(&shard->mutex);
+    PrepEntry* entry = shard->slots[item / PREP_CACHE_SHARDS];
+    if (entry != NULL && entry != shard->newest) {
+        prep_cache_unlink(shard, entry);
+        prep_cache_push(shard, entry);
+    }
+    UNLOCK(&shard->mutex);
+    return entry != NULL;
+}
+
+// Each shard holds its share of --prep-cache entries and evicts its own
+// least recently used one. result points into the carrier's scratch, so it
+// is copied out before LOCK() can park the fiber and let another one on the
+// same carrier overwrite it.
+void prep_cache_put(int item, double (*result)[40]) {
+    PrepCacheShard* shard = &prep_cache[item % PREP_CACHE_SHARDS];
+    int capacity = prep_cache_entries / PREP_CACHE_SHARDS > 0 ? prep_cache_entries / PREP_CACHE_SHARDS : 1;
+    PrepEntry* entry = malloc(sizeof(PrepEntry));
+    entry->item = item;
+    memcpy(entry->result, result, sizeof(entry->result));
+    PrepEntry* evicted = NULL;
+    LOCK(&shard->mutex);
+    if (shard->slots[item / PREP_CACHE_SHARDS] != NULL) {
+        evicted = shard->slots[item / PREP_CACHE_SHARDS];
+        prep_cache_unlink(shard, evicted);
+    } else if (shard->count < capacity) {
+        shard->count++;
     } else {
-        queue->rear->next = order;
-        queue->rear = order;
+        evicted = shard->oldest;
+        prep_cache_unlink(shard, evicted);
+        shard->slots[evicted->item / PREP_CACHE_SHARDS] = NULL;
     }
-    queue->size++;
+    shard->slots[item / PREP_CACHE_SHARDS] = entry;
+    prep_cache_push(shard, entry);
+    UNLOCK(&shard->mutex);
+    free(evicted);
 }
 
-Order* dequeue(OrderQueue* queue) {
-    if (queue->front == NULL) {
-        return NULL;
+// Caller holds shard->mutex
+void prep_cache_unlink(PrepCacheShard* shard, PrepEntry* entry) {
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        shard->newest = entry->older;
     }
-    Order* temp = queue->front;
-    queue->front = queue->front->next;
-    if (queue->front == NULL) {
-        queue->rear = NULL;
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        shard->oldest = entry->newer;
     }
-    queue->size--;
-    return temp;
+}
+
+// Caller holds shard->mutex
+void prep_cache_push(PrepCacheShard* shard, PrepEntry* entry) {
+    entry->newer = NULL;
+    entry->older = shard->newest;
+    if (shard->newest != NULL) {
+        shard->newest->newer = entry;
+    } else {
+        shard->oldest = entry;
+    }
+    shard->newest = entry;
+}
+
+void prep_cache_clear() {
+    for (int s = 0; s < PREP_CACHE_SHARDS; s++) {
+        PrepCacheShard* shard = &prep_cache[s];
+        LOCK(&shard->mutex);
+        while (shard->oldest != NULL) {
+            PrepEntry* entry = shard->oldest;
+            prep_cache_unlink(shard, entry);
+            shard->slots[entry->item / PREP_CACHE_SHARDS] = NULL;
+            free(entry);
+        }
+        shard->count = 0;
+        UNLOCK(&shard->mutex);
+    }
+}
+
+// A hit is priced at what a miss costs on average
+double prep_saved_seconds() {
+    long misses = metric_total(COUNTER_PREP_MISSES);
+    return misses > 0 ? metric_total(COUNTER_PREP_HITS) * (double)metric_total(COUNTER_PREP_MISS_US) / misses / 1e6 : 0;
+}
+
+void report_prep_cache() {
+    long hits = metric_total(COUNTER_PREP_HITS), misses = metric_total(COUNTER_PREP_MISSES);
+    if (hits + misses == 0) {
+        return;
+    }
+    long shared = metric_total(COUNTER_PREP_SHARED);
+    printf("Preparation cache: %ld hits, %ld misses (%.1f%% hit rate), ~%.3f cook-seconds saved, %ld shared within a batch\n", hits, misses, 100.0 * hits / (hits + misses), prep_saved_seconds(), shared);
+    fprintf(log_file, "Preparation cache: %ld hits, %ld misses (%.1f%% hit rate), ~%.3f cook-seconds saved, %ld shared within a batch\n", hits, misses, 100.0 * hits / (hits + misses), prep_saved_seconds(), shared);
+    fflush(log_file);
+}
+
+// CPU time per order, measured on this thread: the kernels alone with the
+// cache off, then a Zipf-distributed menu stream through the cache at a few
+// sizes.
+void prep_benchmark(int orders) {
+    int sizes[] = { 1, 2, 4, 8, 16 };
+    int items[PREP_BATCH_MAX];
+    struct timespec start, end;
+    int cache_entries = prep_cache_entries;
+    prep_cache_entries = 0;
+    printf("Preparation benchmark, %d orders:\n", orders);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    for (int i = 0; i < orders; i++) {
+        calculate_pseudo_inverse(i % MENU_ITEMS);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    double single_us = elapsed_ms(&start, &end) * 1000 / orders;
+    printf("  per order    : %6.1f us CPU per order\n", single_us);
+    for (int s = 0; s < 5; s++) {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        for (int done = 0; done < orders; done += sizes[s]) {
+            int count = orders - done < sizes[s] ? orders - done : sizes[s];
+            for (int i = 0; i < count; i++) {
+                items[i] = (done + i) % MENU_ITEMS;
+            }
+            prepare_batch(items, count);
+        }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        double us = elapsed_ms(&start, &end) * 1000 / orders;
+        printf("  batch of %2d  : %6.1f us CPU per order (%.2fx)\n", sizes[s], us, single_us / us);
+    }
+
+    double cumulative[MENU_ITEMS], sum = 0;
+    for (int k = 0; k < MENU_ITEMS; k++) {
+        sum += 1.0 / (k + 1);
+        cumulative[k] = sum;
+    }
+    Order* stream = malloc(orders * sizeof(Order));
+    unsigned int seed = 42;
+    for (int i = 0; i < orders; i++) {
+        double u = rand_r(&seed) / ((double)RAND_MAX + 1) * sum;
+        int item = 0;
+        while (cumulative[item] <= u) {
+            item++;
+        }
+        stream[i].item = item;
+    }
+    int cache_sizes[] = { 0, 16, 64, 256 };
+    for (int c = 0; c < 4; c++) {
+        prep_cache_entries = cache_sizes[c];
+        prep_cache_clear();
+        long hits = metric_total(COUNTER_PREP_HITS);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        for (int i = 0; i < orders; i++) {
+            Order* order = &stream[i];
+            prepare_orders(&order, 1);
+        }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        printf("  Zipf menu, cache %3d: %6.1f us CPU per order, %.1f%% hits\n", cache_sizes[c],
+               elapsed_ms(&start, &end) * 1000 / orders, 100.0 * (metric_total(COUNTER_PREP_HITS) - hits) / orders);
+    }
+    prep_cache_entries = cache_entries;
+    free(stream);
+    exit(0);
+}
+
+// --kitchen=staged: a cook serves one stage at a time and switches when the
+// controller moves it.
+void* kitchen_thread(void* arg) {
+    Worker* cook = (Worker*)arg;
+    if (fiber_self() == NULL) {
+        apply_placement(ROLE_COOK);
+    }
+
+    while (running) {
+        int stage = atomic_load(&cook->stage);
+        if (stage == KITCHEN_INTAKE) {
+            kitchen_intake(cook);
+        } else if (stage == KITCHEN_PREPARE) {
+            kitchen_prepare(cook);
+        } else if (stage == KITCHEN_OVEN) {
+            kitchen_oven(cook);
+        } else {
+            kitchen_dispatch(cook);
+        }
+    }
+    worker_should_retire(&cook_pool, cook);
+    worker_exit();
+    return NULL;
+}
+
+// Moves one order from the fair queue into the kitchen. It blocks on a full
+// prepare queue, which leaves the backlog in the fair queue where it is
+// still shared out by weight and cheap to cancel.
+void kitchen_intake(Worker* cook) {
+    LOCK(&mutex_orders);
+    while (order_queue.size == 0) {
+        if (!running || atomic_load(&cook->stage) != KITCHEN_INTAKE) {
+            UNLOCK(&mutex_orders);
+            return;
+        }
+        uint32_t key = waiter_prepare(&orders_waiter);
+        UNLOCK(&mutex_orders);
+        waiter_wait(&orders_waiter, key);
+        LOCK(&mutex_orders);
+    }
+    struct timespec started_at, done_at;
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+    LOCK(&order_queue.mutex);
+    Order* order = dequeue_fair();
+    UNLOCK(&order_queue.mutex);
+    UNLOCK(&mutex_orders);
+    atomic_fetch_add(&kitchen_in_flight, 1);
+
+    metric_observe(STAGE_QUEUE_WAIT, &order->placed_at, &started_at);
+    order->staged_at = started_at;
+    clock_gettime(CLOCK_MONOTONIC, &done_at);
+    kitchen_account(KITCHEN_INTAKE, &started_at, &done_at, 1);
+    stage_put(KITCHEN_PREPARE, order);
+}
+
+void kitchen_prepare(Worker* cook) {
+    Order* batch[PREP_BATCH_MAX];
+    int taken = stage_take(KITCHEN_PREPARE, cook, batch, prep_batch);
+    if (taken == 0) {
+        return;
+    }
+    struct timespec started_at, prepared_at;
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+    int count = 0;
+    for (int i = 0; i < taken; i++) {
+        if (atomic_load(&batch[i]->state) == ORDER_CANCELLED) {
+            // Cancelled in the hand-off: it never reaches a cook
+            kitchen_discard(batch[i], "before cooking", 0);
+            continue;
+        }
+        batch[count++] = batch[i];
+    }
+    if (count == 0) {
+        return;
+    }
+
+    int prepare_time = prepare_orders(batch, count);
+    for (int i = 0; i < count; i++) {
+        printf("Cook %d is cooking order %d...\n", cook->id, batch[i]->order_id);
+        fprintf(log_file, "Cook %d is cooking order %d...\n", cook->id, batch[i]->order_id);
+    }
+    fflush(log_file);
+    nap_us(prepare_time / 2000); // Half time of prepare using usleep
+    cook->orders_processed += count;
+    clock_gettime(CLOCK_MONOTONIC, &prepared_at);
+    kitchen_account(KITCHEN_PREPARE, &started_at, &prepared_at, count);
+
+    for (int i = 0; i < count; i++) {
+        Order* order = batch[i];
+        metric_observe(STAGE_PREPARE, &order->staged_at, &prepared_at);
+        if (atomic_load(&order->state) == ORDER_CANCELLED) {
+            metric_add(COUNTER_CANCELLED_UNBAKED, 1);
+            kitchen_discard(order, "before the oven", (long)(elapsed_ms(&started_at, &prepared_at) * 1000 / count));
+            continue;
+        }
+        order->staged_at = prepared_at;
+        stage_put(KITCHEN_OVEN, order);
+    }
+}
+
+// An oven cook tends many slots at once: it loads waiting orders into free
+// slots as they turn up and takes each one out 200 ms after it went in, so a
+// single thread keeps the whole oven busy. It only leaves the stage with an
+// empty hand.
+void kitchen_oven(Worker* cook) {
+    StageQueue* queue = &kitchen[KITCHEN_OVEN].input;
+    Order* baking[KITCHEN_QUEUE_SLOTS];
+    int count = 0;
+    while (count > 0 || (running && atomic_load(&cook->stage) == KITCHEN_OVEN)) {
+        LOCK(&mutex_oven);
+        int slots = current_config()->oven_capacity - oven_count;
+        slots = slots < KITCHEN_QUEUE_SLOTS - count ? slots : KITCHEN_QUEUE_SLOTS - count;
+        slots = slots > 0 && running && atomic_load(&cook->stage) == KITCHEN_OVEN ? slots : 0;
+        oven_count += slots;
+        UNLOCK(&mutex_oven);
+
+        int loaded = 0;
+        struct timespec now;
+        if (slots > 0) {
+            Order* taken[KITCHEN_QUEUE_SLOTS];
+            LOCK(&queue->mutex);
+            int available = queue->count < slots ? queue->count : slots;
+            for (int i = 0; i < available; i++) {
+                taken[i] = queue->slots[queue->head];
+                queue->head = (queue->head + 1) % KITCHEN_QUEUE_SLOTS;
+                queue->count--;
+            }
+            if (available > 0) {
+                COND_BROADCAST(&queue->not_full);
+            }
+            UNLOCK(&queue->mutex);
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            for (int i = 0; i < available; i++) {
+                if (atomic_load(&taken[i]->state) == ORDER_CANCELLED) {
+                    metric_add(COUNTER_CANCELLED_UNBAKED, 1);
+                    kitchen_discard(taken[i], "before the oven", (long)stage_mean_us(STAGE_PREPARE));
+                    continue;
+                }
+                metric_observe(STAGE_OVEN_WAIT, &taken[i]->staged_at, &now);
+                taken[i]->staged_at = now;
+                baking[count++] = taken[i];
+                loaded++;
+            }
+            if (loaded < slots) {
+                LOCK(&mutex_oven);
+                oven_count -= slots - loaded;
+                COND_BROADCAST(&cond_oven);
+                UNLOCK(&mutex_oven);
+            }
+        }
+
+        if (count == 0) {
+            // Empty-handed: wait for orders, or for a slot if the oven is full
+            LOCK(&queue->mutex);
+            bool waiting = queue->count > 0;
+            while (queue->count == 0 && running && atomic_load(&cook->stage) == KITCHEN_OVEN) {
+                COND_WAIT(&queue->not_empty, &queue->mutex);
+            }
+            UNLOCK(&queue->mutex);
+            if (waiting) {
+                LOCK(&mutex_oven);
+                while (oven_count >= current_config()->oven_capacity && running) {
+                    printf("Oven is full, waiting...\n");
+                    fprintf(log_file, "Oven is full, waiting...\n");
+                    fflush(log_file);
+                    COND_WAIT(&cond_oven, &mutex_oven);
+                }
+                UNLOCK(&mutex_oven);
+            }
+            continue;
+        }
+
+        // Sleep until the first order is done, or until more can go in
+        struct timespec done_at = baking[0]->staged_at;
+        for (int i = 1; i < count; i++) {
+            if (elapsed_ms(&baking[i]->staged_at, &done_at) > 0) {
+                done_at = baking[i]->staged_at;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double remaining_ms = KITCHEN_BAKE_MS - elapsed_ms(&done_at, &now);
+        if (remaining_ms > 0) {
+            if (slots > loaded) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                long ns = deadline.tv_nsec + (long)(remaining_ms * 1e6);
+                deadline.tv_sec += ns / 1000000000;
+                deadline.tv_nsec = ns % 1000000000;
+                LOCK(&queue->mutex);
+                if (queue->count == 0) {
+                    COND_TIMEDWAIT(&queue->not_empty, &queue->mutex, &deadline);
+                }
+                UNLOCK(&queue->mutex);
+            } else {
+                nap_us((long)(remaining_ms * 1000));  // Oven full or nothing waiting: just bake
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int done = 0;
+        for (int i = 0; i < count;) {
+            Order* order = baking[i];
+            if (elapsed_ms(&order->staged_at, &now) < KITCHEN_BAKE_MS) {
+                i++;
+                continue;
+            }
+            baking[i] = baking[--count];
+            metric_observe(STAGE_BAKE, &order->staged_at, &now);
+            kitchen_account(KITCHEN_OVEN, &order->staged_at, &now, 1);
+            order->ready_at = now;
+            order->staged_at = now;
+            printf("Cook %d completed cooking for order %d, taken out of the oven...\n", cook->id, order->order_id);
+            fprintf(log_file, "Cook %d completed cooking for order %d, taken out of the oven...\n", cook->id, order->order_id);
+            stage_put(KITCHEN_DISPATCH, order);
+            done++;
+        }
+        if (done > 0) {
+            fflush(log_file);
+            metric_add(COUNTER_COOKED, done);
+            LOCK(&mutex_oven);
+            oven_count -= done;
+            if (done > 1) {
+                COND_BROADCAST(&cond_oven);
+            } else {
+                COND_SIGNAL(&cond_oven);
+            }
+            UNLOCK(&mutex_oven);
+        }
+    }
+}
+
+void kitchen_dispatch(Worker* cook) {
+    Order* batch[PREP_BATCH_MAX];
+    int count = stage_take(KITCHEN_DISPATCH, cook, batch, PREP_BATCH_MAX);
+    if (count == 0) {
+        return;
+    }
+    struct timespec started_at, done_at;
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+
+    // Only the move to READY under the delivery lock makes it cancellable
+    // by unlinking; a cancel that got in first means it goes in the bin.
+    bool ready[PREP_BATCH_MAX];
+    LOCK(&mutex_delivery);
+    LOCK(&delivery_queue.mutex);
+    for (int i = 0; i < count; i++) {
+        int state = ORDER_COOKING;
+        ready[i] = atomic_compare_exchange_strong(&batch[i]->state, &state, ORDER_READY);
+        if (ready[i]) {
+            enqueue(&delivery_queue, batch[i]);
+            status_publish(batch[i], STATUS_READY);
+        }
+    }
+    UNLOCK(&delivery_queue.mutex);
+    waiter_notify(&delivery_waiter, count > 1);
+    UNLOCK(&mutex_delivery);
+
+    for (int i = 0; i < count; i++) {
+        Order* order = batch[i];
+        if (ready[i]) {
+            atomic_fetch_sub(&kitchen_in_flight, 1);
+            if (journal.fd != -1) {
+                journal_append(JOURNAL_COOKED, order, NULL);
+            }
+            printf("Order %d is ready for delivery.\n", order->order_id);
+            fprintf(log_file, "Order %d is ready for delivery.\n", order->order_id);
+            fflush(log_file);
+        } else {
+            kitchen_discard(order, "out of the oven", (long)(stage_mean_us(STAGE_PREPARE) + stage_mean_us(STAGE_BAKE)));
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &done_at);
+    kitchen_account(KITCHEN_DISPATCH, &started_at, &done_at, count);
+}
+
+void kitchen_discard(Order* order, const char* where, long wasted_us) {
+    metric_add(COUNTER_CANCEL_WASTED_US, wasted_us);
+    atomic_fetch_sub(&kitchen_in_flight, 1);
+    index_remove(order);
+    retire_cancelled(order, where);
+}
+
+void kitchen_account(int stage, struct timespec* from, struct timespec* to, int orders) {
+    atomic_fetch_add(&kitchen[stage].busy_us, (long)(elapsed_ms(from, to) * 1000));
+    atomic_fetch_add(&kitchen[stage].orders, orders);
+}
+
+// Blocks while the stage's queue is full; once the shop stops nobody drains
+// it, so the order is dropped instead.
+void stage_put(int stage, Order* order) {
+    StageQueue* queue = &kitchen[stage].input;
+    LOCK(&queue->mutex);
+    while (queue->count == KITCHEN_QUEUE_SLOTS && running) {
+        COND_WAIT(&queue->not_full, &queue->mutex);
+    }
+    if (queue->count < KITCHEN_QUEUE_SLOTS) {
+        queue->slots[(queue->head + queue->count) % KITCHEN_QUEUE_SLOTS] = order;
+        queue->count++;
+        COND_SIGNAL(&queue->not_empty);
+    }
+    UNLOCK(&queue->mutex);
+}
+
+// Waits for up to max orders; returns 0 if the shop stops or the controller
+// moves this cook to another stage while it waits.
+int stage_take(int stage, Worker* cook, Order** orders, int max) {
+    StageQueue* queue = &kitchen[stage].input;
+    int count = 0;
+    LOCK(&queue->mutex);
+    while (queue->count == 0 && running && atomic_load(&cook->stage) == stage) {
+        COND_WAIT(&queue->not_empty, &queue->mutex);
+    }
+    if (running && atomic_load(&cook->stage) == stage) {
+        while (count < max && queue->count > 0) {
+            orders[count++] = queue->slots[queue->head];
+            queue->head = (queue->head + 1) % KITCHEN_QUEUE_SLOTS;
+            queue->count--;
+        }
+    }
+    if (count > 1) {
+        COND_BROADCAST(&queue->not_full);
+    } else if (count == 1) {
+        COND_SIGNAL(&queue->not_full);
+    }
+    UNLOCK(&queue->mutex);
+    return count;
+}
+
+// One cook per stage to start with, the rest split between prepare and oven
+// for the controller to move.
+void kitchen_init(int budget) {
+    for (int s = 0; s < KITCHEN_STAGES; s++) {
+        kitchen[s].input.head = kitchen[s].input.count = 0;
+        pthread_mutex_init(&kitchen[s].input.mutex, NULL);
+        pthread_cond_init(&kitchen[s].input.not_empty, NULL);
+        pthread_cond_init(&kitchen[s].input.not_full, NULL);
+        kitchen[s].threads = 0;
+    }
+    for (int i = 0; i < budget; i++) {
+        int stage = i < KITCHEN_STAGES ? i : (i % 2 == 0 ? KITCHEN_OVEN : KITCHEN_PREPARE);
+        atomic_store(&cook_pool.workers[i].stage, stage);
+        kitchen[stage].threads++;
+    }
+}
+
+void kitchen_shutdown() {
+    for (int s = 0; s < KITCHEN_STAGES; s++) {
+        LOCK(&kitchen[s].input.mutex);
+        COND_BROADCAST(&kitchen[s].input.not_empty);
+        COND_BROADCAST(&kitchen[s].input.not_full);
+        UNLOCK(&kitchen[s].input.mutex);
+    }
+}
+
+// Every tick the stage with the deepest backlog per cook takes a cook from
+// an idle stage. The oven only counts as backlogged while it has free
+// slots: past that more cooks would just queue for it.
+void* kitchen_controller_thread(void* arg) {
+    struct timespec last, now;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    int last_receiver = -1, pressure_ticks = 0;
+
+    while (running) {
+        usleep(SCALE_TICK_MS * 1000);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double dt = elapsed_ms(&last, &now) / 1000.0;
+        last = now;
+
+        int depth[KITCHEN_STAGES];
+        double utilisation[KITCHEN_STAGES];
+        depth[KITCHEN_INTAKE] = order_queue.size;
+        for (int s = 0; s < KITCHEN_STAGES; s++) {
+            if (s != KITCHEN_INTAKE) {
+                LOCK(&kitchen[s].input.mutex);
+                depth[s] = kitchen[s].input.count;
+                UNLOCK(&kitchen[s].input.mutex);
+            }
+            long busy_us = atomic_load(&kitchen[s].busy_us);
+            utilisation[s] = (busy_us - kitchen[s].last_busy_us) / (kitchen[s].threads * dt * 1e6);
+            kitchen[s].last_busy_us = busy_us;
+        }
+        LOCK(&mutex_oven);
+        bool oven_full = oven_count >= current_config()->oven_capacity;
+        UNLOCK(&mutex_oven);
+
+        int receiver = -1, donor = -1;
+        for (int s = 0; s < KITCHEN_STAGES; s++) {
+            if (depth[s] > kitchen[s].threads && !(s == KITCHEN_OVEN && oven_full) &&
+                (receiver == -1 || depth[s] * kitchen[receiver].threads > depth[receiver] * kitchen[s].threads)) {
+                receiver = s;
+            }
+        }
+        for (int s = 0; s < KITCHEN_STAGES; s++) {
+            if (s != receiver && kitchen[s].threads > 1 && depth[s] == 0 && utilisation[s] < KITCHEN_IDLE_UTILISATION &&
+                (donor == -1 || utilisation[s] < utilisation[donor])) {
+                donor = s;
+            }
+        }
+        pressure_ticks = receiver != -1 && receiver == last_receiver ? pressure_ticks + 1 : 1;
+        last_receiver = receiver;
+        if (receiver != -1 && donor != -1 && pressure_ticks >= SCALE_HYSTERESIS_TICKS) {
+            kitchen_move(donor, receiver);
+            pressure_ticks = 0;
+        }
+    }
+    return NULL;
+}
+
+void kitchen_move(int from, int to) {
+    LOCK(&mutex_workers);
+    for (int i = 0; i < cook_pool.capacity; i++) {
+        if (!cook_pool.workers[i].available && atomic_load(&cook_pool.workers[i].stage) == from) {
+            atomic_store(&cook_pool.workers[i].stage, to);
+            break;
+        }
+    }
+    UNLOCK(&mutex_workers);
+    kitchen[from].threads--;
+    kitchen[to].threads++;
+
+    // Wake it if it is waiting for work in its old stage
+    if (from == KITCHEN_INTAKE) {
+        waiter_notify(&orders_waiter, true);
+    } else {
+        LOCK(&kitchen[from].input.mutex);
+        COND_BROADCAST(&kitchen[from].input.not_empty);
+        UNLOCK(&kitchen[from].input.mutex);
+    }
+    printf("Kitchen moved a cook from %s to %s (intake %d, prepare %d, oven %d, dispatch %d)\n", kitchen_stage_names[from], kitchen_stage_names[to],
+           kitchen[KITCHEN_INTAKE].threads, kitchen[KITCHEN_PREPARE].threads, kitchen[KITCHEN_OVEN].threads, kitchen[KITCHEN_DISPATCH].threads);
+    if (log_file != NULL) {
+        fprintf(log_file, "Kitchen moved a cook from %s to %s (intake %d, prepare %d, oven %d, dispatch %d)\n", kitchen_stage_names[from], kitchen_stage_names[to],
+                kitchen[KITCHEN_INTAKE].threads, kitchen[KITCHEN_PREPARE].threads, kitchen[KITCHEN_OVEN].threads, kitchen[KITCHEN_DISPATCH].threads);
+        fflush(log_file);
+    }
+}
+
+void report_kitchen() {
+    if (!kitchen_staged) {
+        return;
+    }
+    for (int s = 0; s < KITCHEN_STAGES; s++) {
+        long orders = atomic_load(&kitchen[s].orders);
+        double service_ms = orders > 0 ? atomic_load(&kitchen[s].busy_us) / 1000.0 / orders : 0;
+        printf("Kitchen %-8s: %d cooks, %ld orders, %.2f ms service per order\n", kitchen_stage_names[s], kitchen[s].threads, orders, service_ms);
+        fprintf(log_file, "Kitchen %-8s: %d cooks, %ld orders, %.2f ms service per order\n", kitchen_stage_names[s], kitchen[s].threads, orders, service_ms);
+    }
+    fflush(log_file);
+}
+
+// Runs in a forked child with no couriers: places the orders for one client
+// up front and times the kitchen until the last one is out of the oven.
+void kitchen_bench_run(bool staged, int budget, int orders, int result_fd) {
+    int devnull = open("/dev/null", O_WRONLY);
+    fflush(stdout);
+    dup2(devnull, STDOUT_FILENO);
+    log_file = fopen("/dev/null", "w");
+
+    kitchen_staged = staged;
+    cook_pool.min = cook_pool.max = budget;
+    init_pool(&cook_pool, budget);
+    cooks = cook_pool.workers;
+    cook_pool.routine = staged ? kitchen_thread : cook_thread;
+    if (fiber_carriers > 0) {
+        fiber_start(fiber_carriers);  // Threads don't survive the fork, so the child starts its own
+    }
+    ClientInfo* client = register_client(getpid(), 1);
+    for (int i = 0; i < orders; i++) {
+        Order* order = calloc(1, sizeof(Order));
+        order->order_id = i + 1;
+        order->item = i % MENU_ITEMS;
+        clock_gettime(CLOCK_MONOTONIC, &order->placed_at);
+        LOCK(&order_queue.mutex);
+        enqueue_fair(client, order);
+        UNLOCK(&order_queue.mutex);
+    }
+    pthread_t controller;
+    if (staged) {
+        kitchen_init(budget);
+        pthread_create(&controller, NULL, kitchen_controller_thread, NULL);
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    LOCK(&mutex_workers);
+    while (cook_pool.active < cook_pool.target && spawn_worker(&cook_pool)) {
+    }
+    UNLOCK(&mutex_workers);
+    while (metric_total(COUNTER_COOKED) < orders) {
+        usleep(1000);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    KitchenBenchResult result = { .orders_per_second = orders * 1000.0 / elapsed_ms(&start, &now) };
+    for (int s = 0; s < KITCHEN_STAGES; s++) {
+        result.threads[s] = kitchen[s].threads;
+    }
+    write(result_fd, &result, sizeof(result));
+    _exit(0);
+}
+
+// Same cook budget for both kitchens. Baking dominates: a monolithic cook
+// holds its oven slot and its thread for the whole bake, so with fewer cooks
+// than slots part of the oven stays cold.
+void kitchen_benchmark(int orders) {
+    int budgets[] = { 4, 6, 8 };
+    printf("Kitchen benchmark, %d orders, oven capacity %d, prep batch %d:\n", orders, current_config()->oven_capacity, prep_batch);
+    for (int b = 0; b < 3; b++) {
+        KitchenBenchResult results[2];
+        for (int staged = 0; staged < 2; staged++) {
+            int fds[2];
+            if (pipe(fds) == -1) {
+                perror("pipe");
+                exit(1);
+            }
+            fflush(stdout);
+            pid_t child = fork();
+            if (child == 0) {
+                close(fds[0]);
+                kitchen_bench_run(staged, budgets[b], orders, fds[1]);
+            }
+            close(fds[1]);
+            if (child == -1 || read(fds[0], &results[staged], sizeof(KitchenBenchResult)) != sizeof(KitchenBenchResult)) {
+                fprintf(stderr, "Kitchen benchmark run failed\n");
+                exit(1);
+            }
+            close(fds[0]);
+            waitpid(child, NULL, 0);
+        }
+        printf("  %d cooks: monolithic %5.1f orders/s, staged %5.1f orders/s (%.2fx), settled at intake %d / prepare %d / oven %d / dispatch %d\n",
+               budgets[b], results[0].orders_per_second, results[1].orders_per_second, results[1].orders_per_second / results[0].orders_per_second,
+               results[1].threads[KITCHEN_INTAKE], results[1].threads[KITCHEN_PREPARE], results[1].threads[KITCHEN_OVEN], results[1].threads[KITCHEN_DISPATCH]);
+    }
+    exit(0);
+}
+
+void* status_bench_reader(void* arg) {
+    StatusBench* bench = arg;
+    unsigned int seed = (unsigned int)(uintptr_t)&seed;
+    long lookups = 0;
+    StatusReply reply;
+    while (atomic_load(&bench->running)) {
+        int order_id = 1 + rand_r(&seed) % STATUS_BENCH_ORDERS;
+        if (bench->locked) {
+            LOCK(&mutex_index);
+            Order* order = index_lookup(order_id);
+            reply.state = order != NULL ? atomic_load(&order->state) : STATUS_UNKNOWN;
+            UNLOCK(&mutex_index);
+        } else {
+            status_lookup(order_id, &reply);
+        }
+        lookups++;
+    }
+    atomic_fetch_add(&bench->lookups, lookups);
+    return NULL;
+}
+
+// Stands in for a cook or courier: moves orders on at a steady pace and
+// times each status update, which is all the status table adds to its path.
+void* status_bench_writer(void* arg) {
+    StatusBench* bench = arg;
+    int states[] = { STATUS_COOKING, STATUS_READY, STATUS_OUT, STATUS_DELIVERED };
+    struct timespec before, after;
+    for (long n = 0; atomic_load(&bench->running); n++) {
+        Order* order = &bench->orders[n % STATUS_BENCH_ORDERS];
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        if (bench->locked) {
+            LOCK(&mutex_index);
+            atomic_store(&order->state, states[n % 4]);
+            UNLOCK(&mutex_index);
+        } else {
+            status_publish(order, states[n % 4]);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        double ns = elapsed_ms(&before, &after) * 1e6;
+        LOCK(&bench->mutex);
+        bench->updates++;
+        bench->update_ns_total += ns;
+        bench->update_ns_max = ns > bench->update_ns_max ? ns : bench->update_ns_max;
+        UNLOCK(&bench->mutex);
+        usleep(STATUS_BENCH_UPDATE_US);
+    }
+    return NULL;
+}
+
+void status_bench_run(StatusBench* bench, bool locked, int readers, int seconds) {
+    bench->locked = locked;
+    bench->lookups = 0;
+    bench->updates = 0;
+    bench->update_ns_total = bench->update_ns_max = 0;
+    atomic_store(&bench->running, true);
+    pthread_t threads[STATUS_BENCH_READERS + 1];
+    pthread_create(&threads[0], NULL, status_bench_writer, bench);
+    for (int i = 0; i < readers; i++) {
+        pthread_create(&threads[i + 1], NULL, status_bench_reader, bench);
+    }
+    sleep(seconds);
+    atomic_store(&bench->running, false);
+    for (int i = 0; i <= readers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("  %-14s %d readers: %9.0f lookups/s, status update %6.0f ns mean, %8.0f ns max\n", locked ? "mutex_index" : "status table", readers,
+           (double)bench->lookups / seconds, bench->updates > 0 ? bench->update_ns_total / bench->updates : 0, bench->update_ns_max);
+}
+
+// Lookups from reader threads against a writer moving orders through their
+// states, first through the status table, then the way a lookup would have
+// to go without it: index_lookup() under mutex_index, which every cancel
+// and order placement also takes.
+void status_benchmark(int seconds) {
+    StatusBench bench = { .orders = calloc(STATUS_BENCH_ORDERS, sizeof(Order)) };
+    pthread_mutex_init(&bench.mutex, NULL);
+    for (int i = 0; i < STATUS_BENCH_ORDERS; i++) {
+        bench.orders[i].order_id = i + 1;
+        clock_gettime(CLOCK_MONOTONIC, &bench.orders[i].placed_at);
+        atomic_init(&bench.orders[i].state, ORDER_QUEUED);
+        index_insert(&bench.orders[i]);
+    }
+    printf("Status benchmark, %d orders, one update every %d us, %d s per run:\n", STATUS_BENCH_ORDERS, STATUS_BENCH_UPDATE_US, seconds);
+    for (int readers = 0; readers <= STATUS_BENCH_READERS; readers += STATUS_BENCH_READERS / 2) {
+        status_bench_run(&bench, false, readers, seconds);
+        status_bench_run(&bench, true, readers, seconds);
+    }
+    exit(0);
+}
+
+void handle_sigint(int sig) {
+    printf("\nShutting down PideShop...\n");
+    running = false;
+    fprintf(log_file, "\nShutting down PideShop...\n");
+    print_summary();
+
+    waiter_shutdown(&orders_waiter);
+    waiter_shutdown(&delivery_waiter);
+
+    cleanup_resources();  // Call cleanup_resources() function
+    exit(0);
+}
+
+void print_summary() {
+    printf("Total orders: %d, Delivered: %ld\n", total_orders, metric_total(COUNTER_DELIVERED));
+    fprintf(log_file, "Total orders: %d, Delivered: %ld\n", total_orders, metric_total(COUNTER_DELIVERED));
+    fflush(log_file);
+
+    report_fairness();
+    report_scaling();
+    report_journal();
+    report_cancellations();
+    report_fibers();
+    report_dispatch();
+    report_prep_cache();
+    report_kitchen();
+    long placed = metric_total(COUNTER_PLACED);
+    if (placed > 0) {
+        struct timespec cpu = { 0, 0 };
+        clockid_t ingest_clock;
+        if (pthread_getcpuclockid(ingest_thread, &ingest_clock) == 0) {
+            clock_gettime(ingest_clock, &cpu);
+        }
+        double cpu_us = (cpu.tv_sec * 1e6 + cpu.tv_nsec / 1e3) / placed;
+        printf("Ingest (%s) syscalls per order: %.2f, CPU per order: %.1f us (%.0f orders/s per core)\n", backend_name, (double)metric_total(COUNTER_INGEST_SYSCALLS) / placed, cpu_us, 1e6 / cpu_us);
+        fprintf(log_file, "Ingest (%s) syscalls per order: %.2f, CPU per order: %.1f us (%.0f orders/s per core)\n", backend_name, (double)metric_total(COUNTER_INGEST_SYSCALLS) / placed, cpu_us, 1e6 / cpu_us);
+    }
+#ifdef LOCK_PROFILE
+    report_lock_profile();
+#endif
+    thank_most_orders(cooks, cook_pool.capacity, "Cook");
+    thank_most_orders(couriers, courier_pool.capacity, "Moto");
+}
+
+// Pool bounds default to the size given on the command line, which keeps the
+// pool static unless --*-min/--*-max open a range for the scaler.
+void init_pool(WorkerPool* pool, int initial) {
+    if (pool->min < 0) {
+        pool->min = initial;
+    }
+    if (pool->max < 0) {
+        pool->max = initial > pool->min ? initial : pool->min;
+    }
+    if (pool->min < 1 || pool->max < pool->min) {
+        fprintf(stderr, "Invalid %s pool bounds: min %d, max %d\n", pool->role, pool->min, pool->max);
+        exit(1);
+    }
+    pool->target = initial < pool->min ? pool->min : (initial > pool->max ? pool->max : initial);
+    pool->active = 0;
+    pool->spawn_hint = 0;
+    pool->capacity = pool->max > POOL_SLOT_RESERVE ? pool->max : POOL_SLOT_RESERVE;
+    pool->workers = malloc(pool->capacity * sizeof(Worker));
+    for (int i = 0; i < pool->capacity; i++) {
+        pool->workers[i].id = i + 1;
+        pool->workers[i].available = true;
+        pool->workers[i].busy = false;
+        pool->workers[i].spawned = false;
+        pool->workers[i].orders_processed = 0; // Initialize orders processed
+        pthread_cond_init(&pool->workers[i].cond, NULL);
+    }
+}
+
+// Caller holds mutex_workers.
+bool spawn_worker(WorkerPool* pool) {
+    // Start where the last search ended so filling 100k slots stays linear
+    for (int n = 0; n < pool->capacity; n++) {
+        int i = (pool->spawn_hint + n) % pool->capacity;
+        if (pool->workers[i].available) {
+            pool->spawn_hint = i + 1;
+            pthread_t thread;
+            pool->workers[i].available = false;
+            if (fiber_carriers > 0) {
+                if (!fiber_spawn(pool->routine, &pool->workers[i])) {
+                    pool->workers[i].available = true;
+                    return false;
+                }
+            } else if (pthread_create(&thread, NULL, pool->routine, &pool->workers[i]) != 0) {
+                pool->workers[i].available = true;
+                return false;
+            } else {
+                pthread_detach(thread);
+            }
+            pool->workers[i].spawned = true;
+            pool->active++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called by an idle worker between orders, so a retiring thread never
+// abandons an order it already took. Every worker retires on shutdown.
+bool worker_should_retire(WorkerPool* pool, Worker* worker) {
+    bool retire = false;
+    LOCK(&mutex_workers);
+    if (!running || pool->active > pool->target) {
+        pool->active--;
+        worker->available = true;
+        retire = true;
+    }
+    UNLOCK(&mutex_workers);
+    return retire;
+}
+
+void scale_pool(WorkerPool* pool, int depth, double oldest_wait_ms, double dt) {
+    time_t now = time(NULL);
+    bool grown = false, shrunk = false;
+    const ShopConfig* config = current_config();
+
+    LOCK(&mutex_workers);
+    int previous_target = pool->target;
+    if (pool == &cook_pool) {
+        apply_pool_bounds(pool, config->cook_min, config->cook_max);
+    } else {
+        apply_pool_bounds(pool, config->courier_min, config->courier_max);
+    }
+    grown = pool->target > previous_target;
+    shrunk = pool->target < previous_target;
+    pool->thread_seconds += pool->active * dt;
+    int busy = 0;
+    for (int i = 0; i < pool->capacity; i++) {
+        if (!pool->workers[i].available && pool->workers[i].busy) {
+            busy++;
+        }
+    }
+
+    if (depth > scale_depth * pool->target || oldest_wait_ms > scale_wait_ms) {
+        pool->pressure_ticks++;
+        pool->idle_ticks = 0;
+    } else if (depth == 0 && busy < pool->target) {
+        pool->idle_ticks++;
+        pool->pressure_ticks = 0;
+    } else {
+        pool->pressure_ticks = 0;
+        pool->idle_ticks = 0;
+    }
+
+    if (!grown && !shrunk && now - pool->last_change >= scale_cooldown) {
+        if (pool->pressure_ticks >= SCALE_HYSTERESIS_TICKS && pool->target < pool->max) {
+            pool->target++;
+            // A worker still on its way out after a shrink covers the new slot
+            grown = pool->active >= pool->target || spawn_worker(pool);
+            if (!grown) {
+                pool->target--;
+            }
+        } else if (pool->idle_ticks * SCALE_TICK_MS >= scale_idle * 1000 && pool->target > pool->min) {
+            pool->target--;
+            shrunk = true;
+        }
+        if (grown || shrunk) {
+            pool->last_change = now;
+            pool->pressure_ticks = 0;
+            pool->idle_ticks = 0;
+        }
+    }
+    int target = pool->target;
+    UNLOCK(&mutex_workers);
+
+    if (grown || shrunk) {
+        printf("%s pool %s to %d threads\n", pool->role, grown ? "grown" : "shrunk", target);
+        fprintf(log_file, "%s pool %s to %d threads\n", pool->role, grown ? "grown" : "shrunk", target);
+        fflush(log_file);
+    }
+    if (shrunk) {
+        waiter_notify(pool == &cook_pool ? &orders_waiter : &delivery_waiter, true);
+    }
+}
+
+void *scaler_thread(void *arg) {
+    struct timespec last, now;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    while (running) {
+        usleep(SCALE_TICK_MS * 1000);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double dt = elapsed_ms(&last, &now) / 1000.0;
+        last = now;
+
+        LOCK(&order_queue.mutex);
+        int cook_depth = order_queue.size;
+        double cook_wait = 0;
+        LOCK(&mutex_clients);
+        for (int i = 0; i < client_count; i++) {
+            if (clients[i].pending.front != NULL) {
+                double wait = elapsed_ms(&clients[i].pending.front->placed_at, &now);
+                cook_wait = wait > cook_wait ? wait : cook_wait;
+            }
+        }
+        UNLOCK(&mutex_clients);
+        UNLOCK(&order_queue.mutex);
+
+        LOCK(&delivery_queue.mutex);
+        int courier_depth = delivery_queue.size;
+        double courier_wait = delivery_queue.front != NULL ? elapsed_ms(&delivery_queue.front->ready_at, &now) : 0;
+        UNLOCK(&delivery_queue.mutex);
+
+        if (!kitchen_staged) {
+            scale_pool(&cook_pool, cook_depth, cook_wait, dt);  // The staged kitchen moves cooks between stages instead
+        }
+        scale_pool(&courier_pool, courier_depth, courier_wait, dt);
+    }
+    return NULL;
+}
+
+// Savings are measured against a static pool sized at max; the overall p99 is
+// printed next to them so runs can be compared at equal latency.
+void report_scaling() {
+    if (cook_pool.min == cook_pool.max && courier_pool.min == courier_pool.max && config_path == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = elapsed_ms(&shop_started_at, &now) / 1000.0;
+
+    static double all[MAX_CLIENTS * LATENCY_SAMPLES];
+    int n = 0;
+    for (int i = 0; i < client_count; i++) {
+        int samples = clients[i].latency_count < LATENCY_SAMPLES ? clients[i].latency_count : LATENCY_SAMPLES;
+        memcpy(all + n, clients[i].latencies, samples * sizeof(double));
+        n += samples;
+    }
+    double p99 = 0;
+    if (n > 0) {
+        qsort(all, n, sizeof(double), compare_doubles);
+        p99 = all[(int)ceil(n * 0.99) - 1];
+    }
+
+    WorkerPool* pools[] = { &cook_pool, &courier_pool };
+    for (int i = 0; i < 2; i++) {
+        double saved = pools[i]->max * elapsed - pools[i]->thread_seconds;
+        printf("%s pool: %.1f thread-seconds used, %.1f saved vs static %d (p99 %.1f ms)\n", pools[i]->role, pools[i]->thread_seconds, saved, pools[i]->max, p99);
+        fprintf(log_file, "%s pool: %.1f thread-seconds used, %.1f saved vs static %d (p99 %.1f ms)\n", pools[i]->role, pools[i]->thread_seconds, saved, pools[i]->max, p99);
+    }
+    fflush(log_file);
+}
+
+const ShopConfig* current_config() {
+    return atomic_load_explicit(&shop_config, memory_order_acquire);
+}
+
+// Readers never lock: a reload builds a fresh copy and publishes it with a
+// release store. Superseded copies stay on a retired list until shutdown,
+// since a cook or courier may still be reading one.
+void publish_config(ShopConfig* config) {
+    ShopConfig* old = atomic_exchange_explicit(&shop_config, config, memory_order_acq_rel);
+    if (old != NULL) {
+        old->retired_next = retired_configs;
+        retired_configs = old;
+    }
+}
+
+// Starts from the live values so a file only has to name what it changes.
+bool load_config(const char* path, ShopConfig* config) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Config file opening failed");
+        return false;
+    }
+    char line[256];
+    int line_number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char key[64];
+        int value;
+        char* comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        if (sscanf(line, " %63[a-z_] = %d", key, &value) != 2) {
+            if (strspn(line, " \t\r\n") != strlen(line)) {
+                fprintf(stderr, "%s:%d: expected key = value\n", path, line_number);
+                ok = false;
+            }
+            continue;
+        }
+        if (strcmp(key, "speed") == 0) {
+            config->speed = value;
+        } else if (strcmp(key, "cook_min") == 0) {
+            config->cook_min = value;
+        } else if (strcmp(key, "cook_max") == 0) {
+            config->cook_max = value;
+        } else if (strcmp(key, "courier_min") == 0) {
+            config->courier_min = value;
+        } else if (strcmp(key, "courier_max") == 0) {
+            config->courier_max = value;
+        } else if (strcmp(key, "oven_capacity") == 0) {
+            config->oven_capacity = value;
+        } else if (strcmp(key, "batch_window_ms") == 0) {
+            config->batch_window_ms = value;
+        } else {
+            fprintf(stderr, "%s:%d: unknown key %s\n", path, line_number, key);
+            ok = false;
+        }
+    }
+    fclose(file);
+
+    if (config->speed < 1 || config->oven_capacity < 1 || config->batch_window_ms < 0 ||
+        config->cook_min < 1 || config->cook_max < config->cook_min ||
+        config->courier_min < 1 || config->courier_max < config->courier_min) {
+        fprintf(stderr, "%s: invalid configuration values\n", path);
+        ok = false;
+    }
+    return ok;
+}
+
+void reload_config() {
+    ShopConfig* config = malloc(sizeof(ShopConfig));
+    *config = *current_config();
+    if (!load_config(config_path, config)) {
+        printf("Configuration reload rejected, keeping current values\n");
+        fprintf(log_file, "Configuration reload rejected, keeping current values\n");
+        fflush(log_file);
+        free(config);
+        return;
+    }
+    publish_config(config);
+    printf("Configuration reloaded: speed %d, cooks %d-%d, motos %d-%d, oven %d, batch window %d ms\n",
+           config->speed, config->cook_min, config->cook_max, config->courier_min, config->courier_max,
+           config->oven_capacity, config->batch_window_ms);
+    fprintf(log_file, "Configuration reloaded: speed %d, cooks %d-%d, motos %d-%d, oven %d, batch window %d ms\n",
+            config->speed, config->cook_min, config->cook_max, config->courier_min, config->courier_max,
+            config->oven_capacity, config->batch_window_ms);
+    fflush(log_file);
+
+    // Cooks waiting on a full oven may fit now
+    LOCK(&mutex_oven);
+    COND_BROADCAST(&cond_oven);
+    UNLOCK(&mutex_oven);
+}
+
+void handle_sighup(int sig) {
+    reload_requested = 1;
+}
+
+// Watches the directory rather than the file so editors that save by
+// renaming a temporary file over the original are picked up too.
+void *config_watcher_thread(void *arg) {
+    char dir[PATH_MAX], name[PATH_MAX];
+    strncpy(dir, config_path, PATH_MAX - 1);
+    dir[PATH_MAX - 1] = '\0';
+    char* slash = strrchr(dir, '/');
+    if (slash != NULL) {
+        strcpy(name, slash + 1);
+        *slash = '\0';
+        if (dir[0] == '\0') {
+            strcpy(dir, "/");
+        }
+    } else {
+        strcpy(name, dir);
+        strcpy(dir, ".");
+    }
+
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1 || inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        perror("inotify setup failed, reloading on SIGHUP only");
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (running) {
+        struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+        bool changed = false;
+        if (inotify_fd != -1 && poll(&pfd, 1, 500) > 0) {
+            ssize_t len;
+            while ((len = read(inotify_fd, events, sizeof(events))) > 0) {
+                for (char* p = events; p < events + len; ) {
+                    struct inotify_event* event = (struct inotify_event*)p;
+                    if (event->len > 0 && strcmp(event->name, name) == 0) {
+                        changed = true;
+                    }
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        } else if (inotify_fd == -1) {
+            usleep(500000);
+        }
+        if (reload_requested) {
+            reload_requested = 0;
+            changed = true;
+        }
+        if (changed) {
+            reload_config();
+        }
+    }
+    if (inotify_fd != -1) {
+        close(inotify_fd);
+    }
+    return NULL;
+}
+
+// Bounds above the allocated slots are clamped. Nothing is spawned here.
+void set_pool_bounds(WorkerPool* pool, int min, int max) {
+    if (max > pool->capacity) {
+        max = pool->capacity;
+    }
+    if (min > max) {
+        min = max;
+    }
+    pool->min = min;
+    pool->max = max;
+    if (pool->target > max) {
+        pool->target = max;
+    }
+    while (pool->target < min) {
+        pool->target++;
+    }
+}
+
+// Caller holds mutex_workers.
+void apply_pool_bounds(WorkerPool* pool, int min, int max) {
+    set_pool_bounds(pool, min, max);
+    while (pool->active < pool->target && spawn_worker(pool)) {
+    }
+}
+
+// Caller holds mutex_clients.
+ClientInfo* register_client(pid_t pid, int number_of_clients) {
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].pid == pid) {
+            return &clients[i];
+        }
+    }
+    if (client_count == MAX_CLIENTS) {
+        return NULL;
+    }
+    ClientInfo* client = &clients[client_count];
+    client->pid = pid;
+    client->numberOfClients = number_of_clients;
+    client->announced = false;
+    client->orders_to_serve = 0;
+    client->weight = client_weight(pid);
+    client->deficit = 0;
+    client->pending.front = client->pending.rear = NULL;
+    client->pending.size = 0;
+    pthread_mutex_init(&client->pending.mutex, NULL);
+    client->delivered = 0;
+    client->latency_count = 0;
+    client_count++;
+    return client;
+}
+
+// Caller holds mutex_clients. Called once per delivered or cancelled order.
+void client_order_done(ClientInfo* client) {
+    client->orders_to_serve--;
+    if (client->orders_to_serve == 0) {
+        printf("Done serving client PID %d\n", client->pid);
+        fprintf(log_file, "Done serving client PID %d\n", client->pid);
+        fflush(log_file);
+    }
+}
+
+int send_with_fds(int sock, void* data, size_t len, int* fds, int fd_count) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    struct iovec iov = { .iov_base = data, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (fd_count > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+int recv_with_fds(int sock, void* data, size_t len, int* fds, int max_fds) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    struct iovec iov = { .iov_base = data, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        return -1;
+    }
+    int fd_count = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (fd_count > max_fds) {
+                fd_count = max_fds;
+            }
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * fd_count);
+        }
+    }
+    return fd_count;
+}
+
+int open_upgrade_socket(const char* path) {
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("Upgrade socket creation failed");
+        exit(1);
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 1) == -1) {
+        perror("Upgrade socket bind failed");
+        exit(1);
+    }
+    return sock;
+}
+
+// Runs on the accept thread, so no order is half-read while queues are
+// frozen. The queued orders are detached under the locks and sent without
+// them, so cooks and couriers keep working; they are only freed once the
+// successor acknowledges them, and on any failure they are queued again.
+bool handoff_to_successor(int server_socket, int unix_socket, int upgrade_socket) {
+    int conn = accept4(upgrade_socket, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+        perror("Upgrade accept failed");
+        return false;
+    }
+    struct timeval timeout = { .tv_sec = 5 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (journal.fd != -1) {
+        journal_flush();  // Placed orders still waiting on a commit join the queue first
+    }
+
+    LOCK(&mutex_orders);
+    LOCK(&order_queue.mutex);
+    LOCK(&mutex_clients);
+    LOCK(&mutex_delivery);
+    LOCK(&delivery_queue.mutex);
+
+    int count = order_queue.size + delivery_queue.size;
+    Order** orders = malloc((count + 1) * sizeof(Order*));
+    ClientInfo** owners = malloc((count + 1) * sizeof(ClientInfo*));
+    int n = 0;
+    for (int i = 0; i < client_count; i++) {
+        for (Order* order = clients[i].pending.front; order != NULL; order = order->next) {
+            owners[n] = &clients[i];
+            orders[n++] = order;
+        }
+    }
+    int queued = n;
+    for (Order* order = delivery_queue.front; order != NULL; order = order->next) {
+        owners[n] = NULL;
+        for (int i = 0; i < client_count; i++) {
+            if (clients[i].pid == order->client_pid) {
+                owners[n] = &clients[i];
+            }
+        }
+        orders[n++] = order;
+    }
+    for (int i = 0; i < client_count; i++) {
+        clients[i].pending.front = clients[i].pending.rear = NULL;
+        clients[i].pending.size = 0;
+        clients[i].deficit = 0;
+    }
+    order_queue.size -= queued;
+    delivery_queue.front = delivery_queue.rear = NULL;
+    delivery_queue.size = 0;
+    LOCK(&mutex_index);  // A cancel during the handoff answers late
+    for (int i = 0; i < count; i++) {
+        index_unlink(orders[i]);
+    }
+    UNLOCK(&mutex_index);
+
+    UNLOCK(&delivery_queue.mutex);
+    UNLOCK(&mutex_delivery);
+    UNLOCK(&mutex_clients);
+    UNLOCK(&order_queue.mutex);
+    UNLOCK(&mutex_orders);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    HandoffHeader header = { HANDOFF_MAGIC, current_order_id, count, total_orders, unix_socket != -1 };
+    int listeners[2] = { server_socket, unix_socket };
+    bool ok = send_with_fds(conn, &header, sizeof(header), listeners, header.has_unix_socket ? 2 : 1) == 0;
+    for (int start = 0; ok && start < count; start += HANDOFF_BATCH) {
+        HandoffBatch batch;
+        int fds[HANDOFF_BATCH];
+        int fd_count = 0;
+        batch.count = count - start < HANDOFF_BATCH ? count - start : HANDOFF_BATCH;
+        for (int i = 0; i < batch.count; i++) {
+            Order* order = orders[start + i];
+            batch.orders[i].order_id = order->order_id;
+            batch.orders[i].x = order->x;
+            batch.orders[i].y = order->y;
+            batch.orders[i].item = order->item;
+            batch.orders[i].client_pid = order->client_pid;
+            batch.orders[i].number_of_clients = owners[start + i] != NULL ? owners[start + i]->numberOfClients : 0;
+            batch.orders[i].ready = start + i >= queued;
+            batch.orders[i].age_ms = elapsed_ms(&order->placed_at, &now);
+            batch.orders[i].has_socket = order->conn != NULL;
+            if (order->conn != NULL) {
+                fds[fd_count++] = order->conn->fd;
+            }
+        }
+        ok = send_with_fds(conn, &batch, offsetof(HandoffBatch, orders) + batch.count * sizeof(HandoffOrder), fds, fd_count) == 0;
+    }
+    char ack = 0;
+    ok = ok && recv(conn, &ack, 1, 0) == 1 && ack == 'K';
+
+    if (ok) {
+        LOCK(&mutex_clients);
+        for (int i = 0; i < count; i++) {
+            if (owners[i] != NULL) {
+                owners[i]->orders_to_serve--;
+            }
+        }
+        UNLOCK(&mutex_clients);
+        for (int i = 0; i < count; i++) {
+            connection_release(orders[i]->conn);
+            free(orders[i]);
+        }
+        accepting = false;
+    } else {
+        LOCK(&mutex_orders);
+        LOCK(&order_queue.mutex);
+        LOCK(&mutex_clients);
+        LOCK(&mutex_delivery);
+        LOCK(&delivery_queue.mutex);
+        for (int i = 0; i < count; i++) {
+            if (i < queued) {
+                enqueue_fair(owners[i], orders[i]);
+            } else {
+                enqueue(&delivery_queue, orders[i]);
+            }
+            index_insert(orders[i]);
+        }
+        UNLOCK(&delivery_queue.mutex);
+        UNLOCK(&mutex_delivery);
+        UNLOCK(&mutex_clients);
+        UNLOCK(&order_queue.mutex);
+        UNLOCK(&mutex_orders);
+        waiter_notify(&orders_waiter, true);
+        waiter_notify(&delivery_waiter, true);
+    }
+    free(orders);
+    free(owners);
+    close(conn);
+
+    if (ok) {
+        printf("Handed listener and %d queued orders to the new PideShop\n", count);
+        fprintf(log_file, "Handed listener and %d queued orders to the new PideShop\n", count);
+    } else {
+        printf("Upgrade handoff failed, keeping all orders\n");
+        fprintf(log_file, "Upgrade handoff failed, keeping all orders\n");
+    }
+    fflush(log_file);
+    return ok;
+}
+
+// Counterpart of handoff_to_successor: adopts the predecessor's listening
+// sockets and queued orders, keeping their ids and ages. The Unix listener
+// is kept only when it is bound to our own --unix-socket path.
+int takeover_from_predecessor(const char* path, int* unix_socket) {
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("Takeover connect failed");
+        exit(1);
+    }
+
+    HandoffHeader header;
+    int listeners[2] = { -1, -1 };
+    int listener_count = recv_with_fds(sock, &header, sizeof(header), listeners, 2);
+    if (listener_count < 1 || header.magic != HANDOFF_MAGIC || listener_count != (header.has_unix_socket ? 2 : 1)) {
+        fprintf(stderr, "Takeover failed: no listening socket received\n");
+        exit(1);
+    }
+    int server_socket = listeners[0];
+    *unix_socket = -1;
+    if (listener_count == 2) {
+        struct sockaddr_un bound = { 0 };
+        socklen_t bound_length = sizeof(bound);
+        if (unix_socket_path != NULL && getsockname(listeners[1], (struct sockaddr *)&bound, &bound_length) == 0 &&
+            strncmp(bound.sun_path, unix_socket_path, sizeof(bound.sun_path)) == 0) {
+            *unix_socket = listeners[1];
+        } else {
+            close(listeners[1]);
+        }
+    }
+    current_order_id = header.current_order_id;
+    total_orders = header.total_orders;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int received = 0;
+    while (received < header.order_count) {
+        HandoffBatch batch;
+        int fds[HANDOFF_BATCH];
+        int fd_count = recv_with_fds(sock, &batch, sizeof(batch), fds, HANDOFF_BATCH);
+        int expected = 0;
+        for (int i = 0; fd_count >= 0 && i < batch.count; i++) {
+            expected += batch.orders[i].has_socket;
+        }
+        if (fd_count < 0 || fd_count != expected) {
+            fprintf(stderr, "Takeover failed after %d of %d orders\n", received, header.order_count);
+            exit(1);
+        }
+        int next_fd = 0;
+        for (int i = 0; i < batch.count; i++) {
+            HandoffOrder* record = &batch.orders[i];
+            Order* order = malloc(sizeof(Order));
+            order->conn = record->has_socket ? connection_create(fds[next_fd++], CONN_CLIENT) : NULL;
+            order->order_id = record->order_id;
+            order->x = record->x;
+            order->y = record->y;
+            order->item = record->item;
+            order->client_pid = record->client_pid;
+            long age_ns = (long)(record->age_ms * 1000000.0);
+            order->placed_at.tv_sec = now.tv_sec - age_ns / 1000000000L;
+            order->placed_at.tv_nsec = now.tv_nsec - age_ns % 1000000000L;
+            if (order->placed_at.tv_nsec < 0) {
+                order->placed_at.tv_sec--;
+                order->placed_at.tv_nsec += 1000000000L;
+            }
+            order->ready_at = now;
+
+            LOCK(&mutex_clients);
+            ClientInfo* client = register_client(record->client_pid, record->number_of_clients);
+            if (client != NULL) {
+                client->announced = true;
+                client->orders_to_serve++;
+                client->last_seen = time(NULL);
+            }
+            UNLOCK(&mutex_clients);
+            // The state it is queued in, so the status table starts out right
+            atomic_init(&order->state, record->ready || client == NULL ? ORDER_READY : ORDER_QUEUED);
+            index_insert(order);
+
+            if (record->ready || client == NULL) {
+                LOCK(&mutex_delivery);
+                LOCK(&delivery_queue.mutex);
+                enqueue(&delivery_queue, order);
+                UNLOCK(&delivery_queue.mutex);
+                UNLOCK(&mutex_delivery);
+            } else {
+                LOCK(&order_queue.mutex);
+                enqueue_fair(client, order);
+                UNLOCK(&order_queue.mutex);
+            }
+        }
+        received += batch.count;
+    }
+    if (received > 0) {
+        waiter_notify(&orders_waiter, true);
+        waiter_notify(&delivery_waiter, true);
+    }
+
+    char ack = 'K';
+    send(sock, &ack, 1, MSG_NOSIGNAL);
+    close(sock);
+    printf("Took over listener and %d queued orders from the previous PideShop\n", received);
+    fprintf(log_file, "Took over listener and %d queued orders from the previous PideShop\n", received);
+    fflush(log_file);
+    return server_socket;
+}
+
+// After a handoff the old shop only finishes what cooks and couriers hold
+// and whatever its already-open connections still sent.
+void drain_in_flight_orders() {
+    while (true) {
+        LOCK(&mutex_workers);
+        int busy = 0;
+        for (int i = 0; i < cook_pool.capacity; i++) {
+            busy += !cooks[i].available && cooks[i].busy;
+        }
+        for (int i = 0; i < courier_pool.capacity; i++) {
+            busy += !couriers[i].available && couriers[i].busy;
+        }
+        UNLOCK(&mutex_workers);
+        LOCK(&delivery_queue.mutex);
+        busy += delivery_queue.size;
+        UNLOCK(&delivery_queue.mutex);
+        busy += atomic_load(&kitchen_in_flight);
+        busy += order_queue.size;  // Late orders from connections opened before the handoff
+        if (busy == 0) {
+            return;
+        }
+        usleep(100000);
+    }
+}
+
+// Workers are detached, so main waits for every one to give its slot back
+// before the log and the worker arrays go away.
+void wait_for_workers() {
+    while (true) {
+        LOCK(&mutex_workers);
+        int active = cook_pool.active + courier_pool.active;
+        UNLOCK(&mutex_workers);
+        if (active == 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    if (fiber_carriers > 0) {
+        fiber_stop();
+    }
+}
+
+unsigned int journal_checksum(const JournalRecord* record) {
+    const unsigned char* bytes = (const unsigned char*)record + sizeof(record->checksum);
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(JournalRecord) - sizeof(record->checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// False for an empty file. A journal written with another record layout
+// stops the shop before anything reads or rewrites it.
+bool journal_check_header(int fd, const char* path) {
+    JournalHeader header;
+    ssize_t got = pread(fd, &header, sizeof(header), 0);
+    if (got == 0) {
+        return false;
+    }
+    if (got != sizeof(header) || header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION || header.record_size != sizeof(JournalRecord)) {
+        fprintf(stderr, "Journal %s is not a version %d journal, refusing to start (move it aside to start empty)\n", path, JOURNAL_VERSION);
+        exit(1);
+    }
+    return true;
+}
+
+void journal_open(const char* path) {
+    journal.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal.fd == -1) {
+        perror("Journal opening failed");
+        exit(1);
+    }
+    if (!journal_check_header(journal.fd, path)) {
+        JournalHeader header = { JOURNAL_MAGIC, JOURNAL_VERSION, sizeof(JournalRecord) };
+        if (write(journal.fd, &header, sizeof(header)) != sizeof(header) || fdatasync(journal.fd) == -1) {
+            perror("Journal opening failed");
+            exit(1);
+        }
+    }
+    pthread_mutex_init(&journal.mutex, NULL);
+    pthread_cond_init(&journal.cond_pending, NULL);
+    pthread_cond_init(&journal.cond_durable, NULL);
+    journal.capacity = JOURNAL_INITIAL_CAPACITY;
+    journal.pending = malloc(journal.capacity * sizeof(JournalEntry));
+    journal.count = 0;
+    journal.appended_lsn = journal.durable_lsn = 0;
+    pthread_create(&journal.writer, NULL, journal_writer_thread, NULL);
+}
+
+// Never blocks on the disk. A placed order handed in with its client is only
+// put on the cook queue once its record is durable.
+void journal_append(int type, Order* order, ClientInfo* release_to) {
+    LOCK(&journal.mutex);
+    if (journal.count == journal.capacity) {
+        journal.capacity *= 2;
+        journal.pending = realloc(journal.pending, journal.capacity * sizeof(JournalEntry));
+    }
+    JournalEntry* entry = &journal.pending[journal.count++];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    entry->record.type = type;
+    entry->record.order_id = order->order_id;
+    entry->record.client_pid = order->client_pid;
+    entry->record.x = order->x;
+    entry->record.y = order->y;
+    entry->record.item = order->item;
+    entry->record.number_of_clients = release_to != NULL ? release_to->numberOfClients : 0;
+    entry->record.timestamp_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+    entry->record.checksum = journal_checksum(&entry->record);
+    entry->order = release_to != NULL ? order : NULL;
+    entry->client = release_to;
+    clock_gettime(CLOCK_MONOTONIC, &entry->appended_at);
+    journal.appended_lsn++;
+    COND_SIGNAL(&journal.cond_pending);
+    UNLOCK(&journal.mutex);
+}
+
+void journal_flush() {
+    LOCK(&journal.mutex);
+    long target = journal.appended_lsn;
+    while (journal.durable_lsn < target) {
+        COND_WAIT(&journal.cond_durable, &journal.mutex);
+    }
+    UNLOCK(&journal.mutex);
+}
+
+// Group commit: everything appended while the previous fdatasync was running
+// goes out in one write and one fdatasync.
+void *journal_writer_thread(void *arg) {
+    apply_placement(ROLE_JOURNAL);
+    int capacity = JOURNAL_INITIAL_CAPACITY;
+    JournalEntry* batch = malloc(capacity * sizeof(JournalEntry));
+    JournalRecord* records = malloc(capacity * sizeof(JournalRecord));
+
+    while (1) {
+        LOCK(&journal.mutex);
+        while (journal.count == 0 && !journal.stopping) {
+            COND_WAIT(&journal.cond_pending, &journal.mutex);
+        }
+        if (journal.count == 0) {
+            UNLOCK(&journal.mutex);
+            break;
+        }
+        int count = journal.count;
+        if (count > capacity) {
+            capacity = journal.capacity;
+            batch = realloc(batch, capacity * sizeof(JournalEntry));
+            records = realloc(records, capacity * sizeof(JournalRecord));
+        }
+        memcpy(batch, journal.pending, count * sizeof(JournalEntry));
+        journal.count = 0;
+        long lsn = journal.appended_lsn;
+        UNLOCK(&journal.mutex);
+
+        for (int i = 0; i < count; i++) {
+            records[i] = batch[i].record;
+        }
+        size_t length = count * sizeof(JournalRecord);
+        char* data = (char*)records;
+        while (length > 0) {
+            ssize_t written = write(journal.fd, data, length);
+            if (written == -1) {
+                perror("Journal write failed");
+                exit(1);
+            }
+            data += written;
+            length -= written;
+        }
+        if (fdatasync(journal.fd) == -1) {
+            perror("Journal fdatasync failed");
+            exit(1);
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        LOCK(&journal.mutex);
+        journal.durable_lsn = lsn;
+        journal.records_written += count;
+        journal.syncs++;
+        for (int i = 0; i < count; i++) {
+            double latency = elapsed_ms(&batch[i].appended_at, &now);
+            journal.commit_ms_total += latency;
+            journal.commit_ms_max = latency > journal.commit_ms_max ? latency : journal.commit_ms_max;
+        }
+        COND_BROADCAST(&journal.cond_durable);
+        UNLOCK(&journal.mutex);
+
+        bool released = false;
+        LOCK(&mutex_orders);
+        LOCK(&order_queue.mutex);
+        for (int i = 0; i < count; i++) {
+            int state = ORDER_JOURNALED;
+            if (batch[i].order != NULL && atomic_compare_exchange_strong(&batch[i].order->state, &state, ORDER_QUEUED)) {
+                enqueue_fair(batch[i].client, batch[i].order);
+                released = true;
+                batch[i].order = NULL;
+            }
+        }
+        UNLOCK(&order_queue.mutex);
+        if (released) {
+            waiter_notify(&orders_waiter, true);
+        }
+        UNLOCK(&mutex_orders);
+        for (int i = 0; i < count; i++) {
+            if (batch[i].order != NULL) {  // Cancelled while its record was being committed
+                index_remove(batch[i].order);
+                retire_cancelled(batch[i].order, "before cooking");
+            }
+        }
+    }
+    free(batch);
+    free(records);
+    return NULL;
+}
+
+// Replays the journal into the queues, then rewrites it with only the
+// records of orders still in the shop so it does not grow across restarts.
+void journal_recover(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    if (!journal_check_header(fd, path)) {
+        close(fd);
+        return;
+    }
+    int capacity = 1024, count = 0;
+    JournalRecord* records = malloc(capacity * sizeof(JournalRecord));
+    JournalRecord record;
+    lseek(fd, sizeof(JournalHeader), SEEK_SET);
+    while (read(fd, &record, sizeof(record)) == sizeof(record)) {
+        if (record.checksum != journal_checksum(&record)) {
+            fprintf(stderr, "Journal: stopping at corrupt record %d\n", count);
+            break;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(JournalRecord));
+        }
+        records[count++] = record;
+    }
+    close(fd);
+
+    int max_id = 0;
+    for (int i = 0; i < count; i++) {
+        max_id = records[i].order_id > max_id ? records[i].order_id : max_id;
+    }
+    // Last record per order decides its stage, the placed record its details
+    int* last = malloc((max_id + 1) * sizeof(int));
+    int* placed = malloc((max_id + 1) * sizeof(int));
+    for (int i = 0; i <= max_id; i++) {
+        last[i] = placed[i] = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        last[records[i].order_id] = i;
+        if (records[i].type == JOURNAL_PLACED) {
+            placed[records[i].order_id] = i;
+        }
+    }
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int out = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    JournalHeader header = { JOURNAL_MAGIC, JOURNAL_VERSION, sizeof(JournalRecord) };
+    if (out == -1 || write(out, &header, sizeof(header)) != sizeof(header)) {
+        perror("Journal compaction failed");
+        exit(1);
+    }
+
+    int recovered = 0, ready = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int id = 1; id <= max_id; id++) {
+        if (last[id] == -1 || placed[id] == -1 || records[last[id]].type == JOURNAL_DELIVERED || records[last[id]].type == JOURNAL_CANCELLED) {
+            continue;
+        }
+        JournalRecord* details = &records[placed[id]];
+        Order* order = malloc(sizeof(Order));
+        order->conn = NULL;  // The client's connection died with us
+        order->order_id = id;
+        order->x = details->x;
+        order->y = details->y;
+        order->item = details->item;
+        order->client_pid = details->client_pid;
+        order->placed_at = now;
+        order->ready_at = now;
+        order->next = NULL;
+
+        LOCK(&mutex_clients);
+        ClientInfo* client = register_client(details->client_pid, details->number_of_clients);
+        if (client != NULL) {
+            client->announced = true;
+            client->orders_to_serve++;
+        }
+        UNLOCK(&mutex_clients);
+
+        bool cooked = records[last[id]].type != JOURNAL_PLACED;
+        atomic_init(&order->state, cooked || client == NULL ? ORDER_READY : ORDER_QUEUED);
+        index_insert(order);
+        if (cooked || client == NULL) {
+            LOCK(&mutex_delivery);
+            LOCK(&delivery_queue.mutex);
+            enqueue(&delivery_queue, order);  // Still READY
+            UNLOCK(&delivery_queue.mutex);
+            UNLOCK(&mutex_delivery);
+            ready++;
+        } else {
+            LOCK(&order_queue.mutex);
+            enqueue_fair(client, order);
+            UNLOCK(&order_queue.mutex);
+        }
+        recovered++;
+
+        JournalRecord kept[2] = { *details, records[last[id]] };
+        if (write(out, kept, (cooked ? 2 : 1) * sizeof(JournalRecord)) == -1) {
+            perror("Journal compaction failed");
+            exit(1);
+        }
+    }
+    if (fdatasync(out) == -1 || rename(temp_path, path) == -1) {
+        perror("Journal compaction failed");
+        exit(1);
+    }
+    close(out);
+    // The rename only survives a crash once the directory entry is synced too
+    char* slash = strrchr(temp_path, '/');
+    const char* directory = slash == NULL ? "." : slash == temp_path ? "/" : temp_path;
+    if (slash != NULL && slash != temp_path) {
+        *slash = '\0';
+    }
+    int directory_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_fd == -1 || fsync(directory_fd) == -1) {
+        perror("Journal compaction failed");
+        exit(1);
+    }
+    close(directory_fd);
+    if (recovered > 0) {
+        waiter_notify(&orders_waiter, true);
+        waiter_notify(&delivery_waiter, true);
+    }
+
+    if (max_id > current_order_id) {
+        current_order_id = max_id;
+    }
+    total_orders += recovered;
+    printf("Recovered %d orders from the journal (%d ready for delivery)\n", recovered, ready);
+    fprintf(log_file, "Recovered %d orders from the journal (%d ready for delivery)\n", recovered, ready);
+    fflush(log_file);
+    free(records);
+    free(last);
+    free(placed);
+}
+
+void report_journal() {
+    if (journal.fd == -1) {
+        return;
+    }
+    LOCK(&journal.mutex);
+    double per_sync = journal.syncs > 0 ? (double)journal.records_written / journal.syncs : 0;
+    double mean = journal.records_written > 0 ? journal.commit_ms_total / journal.records_written : 0;
+    printf("Journal: %ld records, %ld fdatasyncs (%.1f records per sync), commit latency mean %.2f ms max %.2f ms\n",
+           journal.records_written, journal.syncs, per_sync, mean, journal.commit_ms_max);
+    fprintf(log_file, "Journal: %ld records, %ld fdatasyncs (%.1f records per sync), commit latency mean %.2f ms max %.2f ms\n",
+            journal.records_written, journal.syncs, per_sync, mean, journal.commit_ms_max);
+    fflush(log_file);
+    UNLOCK(&journal.mutex);
+}
+
+// Paced synthetic appends at a fixed rate for JOURNAL_BENCH_SECONDS against a
+// scratch file next to the journal; reports what group commit achieved.
+void journal_benchmark(const char* path, int rate) {
+    char bench_path[PATH_MAX];
+    snprintf(bench_path, sizeof(bench_path), "%s.bench", path);
+    unlink(bench_path);
+    log_file = fopen("/dev/null", "w");
+    journal_open(bench_path);
+
+    Order order = { .conn = NULL, .x = 1, .y = 1, .client_pid = getpid() };
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long total = (long)rate * JOURNAL_BENCH_SECONDS;
+    for (long i = 0; i < total; i++) {
+        struct timespec due = start;
+        long offset_ns = (long)(i * (1000000000.0 / rate));
+        due.tv_sec += offset_ns / 1000000000L;
+        due.tv_nsec += offset_ns % 1000000000L;
+        if (due.tv_nsec >= 1000000000L) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+        order.order_id = i + 1;
+        journal_append(JOURNAL_PLACED + i % 4, &order, NULL);
+    }
+    journal_flush();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    printf("Journal benchmark at %d orders/s: %.0f orders/s sustained over %.2f s\n", rate, total / (elapsed_ms(&start, &now) / 1000.0), elapsed_ms(&start, &now) / 1000.0);
+    report_journal();
+    LOCK(&journal.mutex);
+    journal.stopping = true;
+    COND_SIGNAL(&journal.cond_pending);
+    UNLOCK(&journal.mutex);
+    pthread_join(journal.writer, NULL);
+    close(journal.fd);
+    unlink(bench_path);
+    exit(0);
+}
+
+// Each thread writes to its own cache-line aligned shard. Shards are handed
+// out round-robin, so threads beyond METRIC_SHARDS share one, which the
+// relaxed atomic adds keep correct.
+MetricShard* metric_shard() {
+    if (my_metric_shard == NULL) {
+        my_metric_shard = &metric_shards[atomic_fetch_add(&next_metric_shard, 1) % METRIC_SHARDS];
+    }
+    return my_metric_shard;
+}
+
+void metric_add(int counter, long value) {
+    atomic_fetch_add_explicit(&metric_shard()->counters[counter], value, memory_order_relaxed);
+}
+
+long metric_total(int counter) {
+    long total = 0;
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        total += atomic_load_explicit(&metric_shards[i].counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+// HDR-style buckets: exact below 16 us, then 8 linear sub-buckets per power
+// of two, which keeps the relative error under 12.5%. The 240 buckets cover
+// powers 2^4 to 2^31, so up to 2^32 us (about 71 minutes); anything slower
+// is counted in the last bucket.
+int histogram_bucket(long us) {
+    if (us < 16) {
+        return us < 0 ? 0 : (int)us;
+    }
+    int exponent = 63 - __builtin_clzl(us);
+    int bucket = 16 + (exponent - 4) * 8 + (int)((us >> (exponent - 3)) & 7);
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+long histogram_upper_bound(int bucket) {
+    if (bucket < 16) {
+        return bucket;
+    }
+    int exponent = 4 + (bucket - 16) / 8;
+    long width = 1L << (exponent - 3);
+    return (8 + (bucket - 16) % 8) * width + width - 1;
+}
+
+void metric_observe(int stage, struct timespec* from, struct timespec* to) {
+    long us = (long)((to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000);
+    MetricShard* shard = metric_shard();
+    atomic_fetch_add_explicit(&shard->buckets[stage][histogram_bucket(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->sum_us[stage], us, memory_order_relaxed);
+}
+
+void buffer_printf(char** buffer, size_t* length, size_t* capacity, const char* format, ...) {
+    va_list args;
+    while (1) {
+        va_start(args, format);
+        int n = vsnprintf(*buffer + *length, *capacity - *length, format, args);
+        va_end(args);
+        if (n >= 0 && (size_t)n < *capacity - *length) {
+            *length += n;
+            return;
+        }
+        *capacity *= 2;
+        *buffer = realloc(*buffer, *capacity);
+    }
+}
+
+// Only relaxed loads of the shards and racy reads of plain ints for gauges:
+// a scrape never takes a lock that a cook or courier could be waiting on.
+char* render_metrics(size_t* length) {
+    size_t capacity = 65536;
+    char* out = malloc(capacity);
+    *length = 0;
+
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        buffer_printf(&out, length, &capacity, "# TYPE pideshop_%s_total counter\npideshop_%s_total %ld\n",
+                      counter_names[c], counter_names[c], metric_total(c));
+    }
+    long prep_hits = metric_total(COUNTER_PREP_HITS), prep_lookups = prep_hits + metric_total(COUNTER_PREP_MISSES);
+    buffer_printf(&out, length, &capacity, "# TYPE pideshop_prep_cache_hit_ratio gauge\npideshop_prep_cache_hit_ratio %.4f\n", prep_lookups > 0 ? (double)prep_hits / prep_lookups : 0);
+    buffer_printf(&out, length, &capacity, "# TYPE pideshop_prep_saved_cook_seconds gauge\npideshop_prep_saved_cook_seconds %.3f\n", prep_saved_seconds());
+    buffer_printf(&out, length, &capacity, "# TYPE pideshop_queue_depth gauge\n");
+    buffer_printf(&out, length, &capacity, "pideshop_queue_depth{queue=\"orders\"} %d\n", order_queue.size);
+    buffer_printf(&out, length, &capacity, "pideshop_queue_depth{queue=\"delivery\"} %d\n", delivery_queue.size);
+    buffer_printf(&out, length, &capacity, "# TYPE pideshop_oven_occupancy gauge\npideshop_oven_occupancy %d\n", oven_count);
+    buffer_printf(&out, length, &capacity, "# TYPE pideshop_workers gauge\n");
+    buffer_printf(&out, length, &capacity, "pideshop_workers{role=\"cook\"} %d\n", cook_pool.active);
+    buffer_printf(&out, length, &capacity, "pideshop_workers{role=\"moto\"} %d\n", courier_pool.active);
+    if (kitchen_staged) {
+        buffer_printf(&out, length, &capacity, "# TYPE pideshop_kitchen_queue_depth gauge\n");
+        for (int s = 0; s < KITCHEN_STAGES; s++) {
+            buffer_printf(&out, length, &capacity, "pideshop_kitchen_queue_depth{stage=\"%s\"} %d\n", kitchen_stage_names[s], s == KITCHEN_INTAKE ? order_queue.size : kitchen[s].input.count);
+        }
+        buffer_printf(&out, length, &capacity, "# TYPE pideshop_kitchen_cooks gauge\n");
+        for (int s = 0; s < KITCHEN_STAGES; s++) {
+            buffer_printf(&out, length, &capacity, "pideshop_kitchen_cooks{stage=\"%s\"} %d\n", kitchen_stage_names[s], kitchen[s].threads);
+        }
+        buffer_printf(&out, length, &capacity, "# TYPE pideshop_kitchen_service_seconds summary\n");
+        for (int s = 0; s < KITCHEN_STAGES; s++) {
+            buffer_printf(&out, length, &capacity, "pideshop_kitchen_service_seconds_sum{stage=\"%s\"} %.6f\n", kitchen_stage_names[s], atomic_load(&kitchen[s].busy_us) / 1e6);
+            buffer_printf(&out, length, &capacity, "pideshop_kitchen_service_seconds_count{stage=\"%s\"} %ld\n", kitchen_stage_names[s], atomic_load(&kitchen[s].orders));
+        }
+    }
+
+    buffer_printf(&out, length, &capacity, "# TYPE pideshop_stage_seconds histogram\n");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        long cumulative = 0, sum_us = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            for (int i = 0; i < METRIC_SHARDS; i++) {
+                cumulative += atomic_load_explicit(&metric_shards[i].buckets[s][b], memory_order_relaxed);
+            }
+            buffer_printf(&out, length, &capacity, "pideshop_stage_seconds_bucket{stage=\"%s\",le=\"%.6f\"} %ld\n",
+                          stage_names[s], (histogram_upper_bound(b) + 1) / 1e6, cumulative);
+        }
+        for (int i = 0; i < METRIC_SHARDS; i++) {
+            sum_us += atomic_load_explicit(&metric_shards[i].sum_us[s], memory_order_relaxed);
+        }
+        buffer_printf(&out, length, &capacity, "pideshop_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %ld\n", stage_names[s], cumulative);
+        buffer_printf(&out, length, &capacity, "pideshop_stage_seconds_sum{stage=\"%s\"} %.6f\n", stage_names[s], sum_us / 1e6);
+        buffer_printf(&out, length, &capacity, "pideshop_stage_seconds_count{stage=\"%s\"} %ld\n", stage_names[s], cumulative);
+    }
+    return out;
+}
+
+void *metrics_thread(void *arg) {
+    int server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(metrics_port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(server, 16) == -1) {
+        perror("Metrics endpoint failed");
+        close(server);
+        return NULL;
+    }
+
+    while (running) {
+        int conn = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            continue;
+        }
+        char request[1024];
+        struct timeval timeout = { .tv_sec = 1 };
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        recv(conn, request, sizeof(request), 0);
+
+        size_t length;
+        char* body = render_metrics(&length);
+        char header[160];
+        int header_length = snprintf(header, sizeof(header),
+                                     "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", length);
+        send(conn, header, header_length, MSG_NOSIGNAL);
+        for (size_t sent = 0; sent < length; ) {
+            ssize_t n = send(conn, body + sent, length - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
+        }
+        free(body);
+        close(conn);
+    }
+    close(server);
+    return NULL;
+}
+
+#ifdef LOCK_PROFILE
+long profile_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+int log2_bucket(long ns) {
+    int bucket = ns > 0 ? 63 - __builtin_clzl(ns) : 0;
+    return bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1;
+}
+
+// Locks are keyed by address; the first acquisition registers the name.
+LockProfile* lock_profile(pthread_mutex_t* mutex, const char* name) {
+    unsigned long slot = ((unsigned long)mutex >> 4) % PROFILE_LOCKS;
+    for (int probe = 0; probe < PROFILE_LOCKS; probe++, slot = (slot + 1) % PROFILE_LOCKS) {
+        LockProfile* profile = &lock_profiles[slot];
+        pthread_mutex_t* owner = atomic_load_explicit(&profile->mutex, memory_order_acquire);
+        if (owner == mutex) {
+            return profile;
+        }
+        if (owner == NULL) {
+            pthread_mutex_lock(&lock_profiles_mutex);
+            owner = atomic_load_explicit(&profile->mutex, memory_order_relaxed);
+            if (owner == NULL) {
+                profile->name = name[0] == '&' ? name + 1 : name;
+                atomic_store_explicit(&profile->mutex, mutex, memory_order_release);
+                owner = mutex;
+            }
+            pthread_mutex_unlock(&lock_profiles_mutex);
+            if (owner == mutex) {
+                return profile;
+            }
+        }
+    }
+    return NULL;
+}
+
+void record_call_site(LockProfile* profile, const char* function, int line, long wait_ns) {
+    unsigned long slot = ((unsigned long)function * 31 + line) % PROFILE_SITES;
+    for (int probe = 0; probe < PROFILE_SITES; probe++, slot = (slot + 1) % PROFILE_SITES) {
+        CallSiteProfile* site = &call_site_profiles[slot];
+        if (atomic_load_explicit(&site->lock, memory_order_acquire) == NULL) {
+            pthread_mutex_lock(&lock_profiles_mutex);
+            if (atomic_load_explicit(&site->lock, memory_order_relaxed) == NULL) {
+                site->function = function;
+                site->line = line;
+                atomic_store_explicit(&site->lock, profile, memory_order_release);
+            }
+            pthread_mutex_unlock(&lock_profiles_mutex);
+        }
+        if (atomic_load_explicit(&site->lock, memory_order_acquire) == profile && site->function == function && site->line == line) {
+            atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&site->wait_ns, wait_ns, memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+// An uncontended trylock costs no clock reads; only a failed trylock is
+// timed and blamed on the call site.
+void profiled_lock(pthread_mutex_t* mutex, const char* name, const char* function, int line) {
+    LockProfile* profile = lock_profile(mutex, name);
+    if (profile == NULL) {
+        fiber_mutex_lock(mutex);  // Registry full, leave this lock unprofiled
+        return;
+    }
+    if (pthread_mutex_trylock(mutex) == 0) {
+        atomic_fetch_add_explicit(&profile->wait_buckets[0], 1, memory_order_relaxed);
+    } else {
+        long start = profile_now_ns();
+        fiber_mutex_lock(mutex);
+        long wait_ns = profile_now_ns() - start;
+        atomic_fetch_add_explicit(&profile->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&profile->wait_ns, wait_ns, memory_order_relaxed);
+        atomic_fetch_add_explicit(&profile->wait_buckets[log2_bucket(wait_ns)], 1, memory_order_relaxed);
+        record_call_site(profile, function, line, wait_ns);
+    }
+    atomic_fetch_add_explicit(&profile->acquisitions, 1, memory_order_relaxed);
+    profile->acquired_ns = profile_now_ns();  // Only the holder writes this
+}
+
+void end_hold(pthread_mutex_t* mutex) {
+    LockProfile* profile = lock_profile(mutex, "?");
+    if (profile == NULL) {
+        return;
+    }
+    long hold_ns = profile_now_ns() - profile->acquired_ns;
+    atomic_fetch_add_explicit(&profile->hold_ns, hold_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&profile->hold_buckets[log2_bucket(hold_ns)], 1, memory_order_relaxed);
+}
+
+void profiled_unlock(pthread_mutex_t* mutex) {
+    end_hold(mutex);
+    fiber_mutex_unlock(mutex);
+}
+
+// Time asleep on the condition variable is neither wait nor hold time.
+int profiled_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline) {
+    end_hold(mutex);
+    int result = fiber_cond_wait(cond, mutex, deadline);
+    LockProfile* profile = lock_profile(mutex, "?");
+    if (profile != NULL) {
+        profile->acquired_ns = profile_now_ns();
+    }
+    return result;
+}
+
+double bucket_percentile_us(_Atomic long* buckets, double fraction) {
+    long count = 0, seen = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        count += atomic_load(&buckets[b]);
+    }
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        seen += atomic_load(&buckets[b]);
+        if (count > 0 && seen >= count * fraction) {
+            return (2L << b) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+int compare_call_sites(const void* a, const void* b) {
+    long x = atomic_load(&(*(CallSiteProfile* const*)a)->wait_ns);
+    long y = atomic_load(&(*(CallSiteProfile* const*)b)->wait_ns);
+    return (y > x) - (y < x);
+}
+
+void report_lock_profile() {
+    FILE* outputs[] = { stdout, log_file };
+    CallSiteProfile* sites[PROFILE_SITES];
+    int site_count = 0;
+    for (int i = 0; i < PROFILE_SITES; i++) {
+        if (atomic_load(&call_site_profiles[i].lock) != NULL) {
+            sites[site_count++] = &call_site_profiles[i];
+        }
+    }
+    qsort(sites, site_count, sizeof(CallSiteProfile*), compare_call_sites);
+
+    for (int o = 0; o < 2; o++) {
+        FILE* out = outputs[o];
+        fprintf(out, "\n%-28s %10s %9s %12s %10s %12s %10s\n", "Lock", "Acquired", "Contended", "Wait total", "Wait p99", "Hold mean", "Hold p99");
+        for (int i = 0; i < PROFILE_LOCKS; i++) {
+            LockProfile* profile = &lock_profiles[i];
+            long acquisitions = atomic_load(&profile->acquisitions);
+            if (atomic_load(&profile->mutex) == NULL || acquisitions == 0) {
+                continue;
+            }
+            long contended = atomic_load(&profile->contended);
+            fprintf(out, "%-28s %10ld %8.1f%% %10.1fms %8.1fus %10.1fus %8.1fus\n", profile->name, acquisitions,
+                    100.0 * contended / acquisitions, atomic_load(&profile->wait_ns) / 1e6,
+                    bucket_percentile_us(profile->wait_buckets, 0.99),
+                    atomic_load(&profile->hold_ns) / 1e3 / acquisitions,
+                    bucket_percentile_us(profile->hold_buckets, 0.99));
+        }
+        fprintf(out, "Top contending call sites:\n");
+        for (int i = 0; i < site_count && i < PROFILE_TOP_SITES; i++) {
+            fprintf(out, "  %-24s %s:%d  %ld waits, %.1f ms\n", sites[i]->lock->name, sites[i]->function, sites[i]->line,
+                    atomic_load(&sites[i]->contended), atomic_load(&sites[i]->wait_ns) / 1e6);
+        }
+    }
+    fflush(log_file);
+}
+#endif
+
+Connection* connection_create(int fd, int kind) {
+    Connection* conn = malloc(sizeof(Connection));
+    conn->fd = fd;
+    conn->kind = kind;
+    atomic_init(&conn->refs, 1);
+    conn->shm = NULL;
+    conn->used = 0;
+    conn->replies = NULL;
+    conn->reply_used = 0;
+    conn->flush_armed = false;
+    return conn;
+}
+
+void connection_retain(Connection* conn) {
+    atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+}
+
+// The reader holds one reference and every order placed on the connection
+// another, so the client sees the close only after its last delivery.
+void connection_release(Connection* conn) {
+    if (conn != NULL && atomic_fetch_sub_explicit(&conn->refs, 1, memory_order_acq_rel) == 1) {
+        if (conn->shm != NULL) {
+            shm_detach(conn->shm);
+        }
+        close(conn->fd);
+        free(conn->replies);
+        free(conn);
+    }
+}
+
+// Returns the new order's id, or 0 if admission turned it away.
+int place_order(Connection* conn, OrderMessage* message) {
+    LOCK(&mutex_clients);
+    ClientInfo* client = register_client(message->pid, message->number_of_clients);
+    if (client != NULL) {
+        client->last_seen = time(NULL);
+    }
+    UNLOCK(&mutex_clients);
+
+    LOCK(&mutex_orders);
+    LOCK(&order_queue.mutex);
+    bool admitted = client != NULL && message->item >= 0 && message->item < MENU_ITEMS && admit_order(client);
+    UNLOCK(&order_queue.mutex);
+    int order_id = 0;
+    if (admitted) {
+        Order* new_order = (Order*)malloc(sizeof(Order));
+        connection_retain(conn);
+        new_order->conn = conn;
+        new_order->order_id = order_id = ++current_order_id;
+        new_order->x = message->x;
+        new_order->y = message->y;
+        new_order->item = message->item;
+        new_order->client_pid = message->pid;
+        clock_gettime(CLOCK_MONOTONIC, &new_order->placed_at);
+        if (trace_file != NULL) {
+            trace_record(message, &new_order->placed_at);
+        }
+        new_order->next = NULL;
+        atomic_init(&new_order->state, ORDER_JOURNALED);
+        index_insert(new_order);
+
+        LOCK(&mutex_clients);
+        if (!client->announced) {
+            printf("%d new customers... Serving\n", client->numberOfClients);
+            fprintf(log_file, "%d new customers... Serving\n", client->numberOfClients);
+            fflush(log_file);
+            client->announced = true;
+        }
+        client->orders_to_serve++;
+        UNLOCK(&mutex_clients);
+
+        if (journal.fd != -1) {
+            journal_append(JOURNAL_PLACED, new_order, client);  // Queued once durable
+        } else {
+            LOCK(&order_queue.mutex);
+            enqueue_fair(client, new_order);
+            UNLOCK(&order_queue.mutex);
+        }
+        printf("Order %d placed from location (%d, %d) by client PID %d\n", new_order->order_id, new_order->x, new_order->y, new_order->client_pid);
+        fprintf(log_file, "Order %d placed from location (%d, %d) by client PID %d\n", new_order->order_id, new_order->x, new_order->y, new_order->client_pid);
+        fflush(log_file);
+        total_orders++;
+        metric_add(COUNTER_PLACED, 1);
+        waiter_notify(&orders_waiter, false);
+    } else {
+        metric_add(COUNTER_REJECTED, 1);
+    }
+    UNLOCK(&mutex_orders);
+    return order_id;
+}
+
+// Reads as many whole frames as fit in the connection buffer with one
+// recvmsg; a partial frame stays at the front of the buffer for next time.
+// On a Unix-domain connection the same recvmsg also picks up the memfd and
+// doorbells of a shared-memory client. Returns false once the peer has
+// closed its side.
+bool read_orders(Connection* conn, int epoll_fd) {
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec iov = { .iov_base = conn->buffer + conn->used, .iov_len = CONNECTION_BUFFER - conn->used };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+    metric_add(COUNTER_INGEST_SYSCALLS, 1);
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        if (conn->used > 0) {
+            fprintf(stderr, "Dropping %d bytes of a truncated order\n", conn->used);
+        }
+        return false;
+    }
+    struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        int fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int fds[3];
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (fd_count < 3 ? fd_count : 3));
+        if (fd_count == 3 && conn->shm == NULL) {
+            if (!shm_attach(conn, fds)) {
+                return false;  // Hang up rather than leave the client waiting on a ring
+            }
+            struct epoll_event event = { .events = EPOLLIN, .data.u64 = (uintptr_t)conn | EPOLL_TAG_DOORBELL };
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->shm->to_server, &event);
+        } else {
+            for (int i = 0; i < fd_count && i < 3; i++) {
+                close(fds[i]);
+            }
+        }
+    }
+    if (n > 0) {
+        conn->used += n;
+        int offset = 0;
+        while (conn->used - offset >= (int)sizeof(OrderMessage)) {
+            OrderMessage message;
+            memcpy(&message, conn->buffer + offset, sizeof(message));
+            int state;
+            handle_frame(conn, &message, &state);
+            offset += sizeof(OrderMessage);
+        }
+        memmove(conn->buffer, conn->buffer + offset, conn->used - offset);
+        conn->used -= offset;
+        status_flush(conn);
+    }
+    return true;
+}
+
+// Level-triggered epoll over the listeners, the upgrade socket, every open
+// order connection and the doorbells of shared-memory clients. Accepts are
+// drained until EAGAIN so a burst of clients costs one epoll_wait.
+void ingest_loop(int server_socket, int unix_socket, int upgrade_socket) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    Connection* listener = connection_create(server_socket, CONN_LISTENER);
+    Connection* unix_listener = connection_create(unix_socket, CONN_LISTENER);
+    Connection* upgrade = connection_create(upgrade_socket, CONN_UPGRADE);
+    fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = listener };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event);
+    if (unix_socket != -1) {
+        fcntl(unix_socket, F_SETFL, fcntl(unix_socket, F_GETFL) | O_NONBLOCK);
+        event.data.ptr = unix_listener;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, unix_socket, &event);
+    }
+    if (upgrade_socket != -1) {
+        event.data.ptr = upgrade;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, upgrade_socket, &event);
+    }
+    int open_connections = 0;
+
+    while (running && (accepting || open_connections > 0)) {
+        struct epoll_event events[EPOLL_BATCH];
+        int ready = epoll_wait(epoll_fd, events, EPOLL_BATCH, 500);
+        metric_add(COUNTER_INGEST_SYSCALLS, 1);
+        for (int i = 0; i < ready; i++) {
+            Connection* conn = (Connection*)(uintptr_t)(events[i].data.u64 & ~(uint64_t)EPOLL_TAG_DOORBELL);
+            if (events[i].data.u64 & EPOLL_TAG_DOORBELL) {
+                drain_shm_orders(conn);
+                status_arm(conn, epoll_fd);
+            } else if (conn->kind == CONN_UPGRADE) {
+                if (handoff_to_successor(server_socket, unix_socket, upgrade_socket)) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_socket, NULL);
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, upgrade_socket, NULL);
+                    if (unix_socket != -1) {
+                        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, unix_socket, NULL);
+                    }
+                }
+            } else if (conn->kind == CONN_LISTENER) {
+                if (!accepting) {
+                    continue;
+                }
+                int client_socket;
+                while ((client_socket = accept4(conn->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                    metric_add(COUNTER_INGEST_SYSCALLS, 2);
+                    Connection* client = connection_create(client_socket, CONN_CLIENT);
+                    struct epoll_event client_event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = client };
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &client_event);
+                    open_connections++;
+                }
+                metric_add(COUNTER_INGEST_SYSCALLS, 1);
+                if (errno != EAGAIN && errno != EWOULDBLOCK && running) {
+                    perror("Accept failed");
+                }
+            } else if (events[i].events == EPOLLOUT) {
+                status_flush(conn);
+                status_arm(conn, epoll_fd);
+            } else if (!read_orders(conn, epoll_fd)) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+                metric_add(COUNTER_INGEST_SYSCALLS, 1);
+                if (conn->shm != NULL) {
+                    drain_shm_orders(conn);  // Orders pushed right before the client hung up
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->shm->to_server, NULL);
+                }
+                connection_release(conn);
+                open_connections--;
+            } else {
+                status_arm(conn, epoll_fd);
+            }
+        }
+    }
+    free(listener);
+    free(unix_listener);
+    free(upgrade);
+    close(epoll_fd);
+}
+
+int open_unix_listener(const char* path) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("Unix socket creation failed");
+        exit(1);
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 64) == -1) {
+        perror("Unix socket bind failed");
+        exit(1);
+    }
+    return sock;
+}
+
+// The client creates the region and both eventfds and passes them over its
+// Unix-domain connection; from then on orders and status updates move
+// through the rings and only the doorbells touch the kernel. The region must
+// be sealed against resizing, or a client could truncate it and take the
+// shop down with SIGBUS.
+bool shm_attach(Connection* conn, int* fds) {
+    struct stat st;
+    int seals = fcntl(fds[0], F_GET_SEALS);
+    if (fstat(fds[0], &st) == -1 || st.st_size < (off_t)sizeof(ShmRegion) || seals == -1 ||
+        (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW)) {
+        fprintf(stderr, "Shared-memory client refused: needs a sealed region of %zu bytes\n", sizeof(ShmRegion));
+        for (int i = 0; i < 3; i++) {
+            close(fds[i]);
+        }
+        return false;
+    }
+    ShmRegion* region = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (region == MAP_FAILED) {
+        perror("Shared memory mapping failed");
+        close(fds[1]);
+        close(fds[2]);
+        return false;
+    }
+    ShmChannel* shm = malloc(sizeof(ShmChannel));
+    shm->region = region;
+    shm->to_server = fds[1];
+    shm->to_client = fds[2];
+    pthread_mutex_init(&shm->status_mutex, NULL);
+    fcntl(shm->to_server, F_SETFL, fcntl(shm->to_server, F_GETFL) | O_NONBLOCK);
+    conn->shm = shm;
+    return true;
+}
+
+void shm_detach(ShmChannel* shm) {
+    munmap(shm->region, sizeof(ShmRegion));
+    close(shm->to_server);
+    close(shm->to_client);
+    pthread_mutex_destroy(&shm->status_mutex);
+    free(shm);
+}
+
+// Couriers and the ingest loop both report status, so the producer side of
+// the status ring is serialized; the client is the only consumer. A nearly
+// full ring drops a delivery update rather than stall a courier on a slow
+// client, always leaving the last slot to the ingest loop's answers, which
+// are never dropped: it stops taking orders until there is room for them.
+bool shm_push_status(Connection* conn, int order_id, int state, uint32_t slot) {
+    ShmChannel* shm = conn->shm;
+    LOCK(&shm->status_mutex);
+    ShmRing* ring = &shm->region->status_ring;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t reserved = state == SHM_DELIVERED ? 1 : 0;
+    bool pushed = tail - atomic_load_explicit(&ring->head, memory_order_acquire) + reserved < SHM_RING_SLOTS;
+    if (pushed) {
+        shm->region->status[tail % SHM_RING_SLOTS].order_id = order_id;
+        shm->region->status[tail % SHM_RING_SLOTS].state = state;
+        shm->region->status[tail % SHM_RING_SLOTS].slot = slot;
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    }
+    UNLOCK(&shm->status_mutex);
+    return pushed;
+}
+
+void shm_ring_client(Connection* conn) {
+    uint64_t one = 1;
+    if (write(conn->shm->to_client, &one, sizeof(one)) == -1) {
+        perror("Doorbell write failed");
+    }
+}
+
+// One doorbell read covers every order the client pushed since the last
+// one, and one doorbell write answers all of them. Orders are left in their
+// ring while the status ring has no room for the answer; the client rings
+// again once it has caught up.
+void drain_shm_orders(Connection* conn) {
+    ShmChannel* shm = conn->shm;
+    uint64_t rings;
+    if (read(shm->to_server, &rings, sizeof(rings)) == -1 && errno != EAGAIN) {
+        perror("Doorbell read failed");
+    }
+    metric_add(COUNTER_INGEST_SYSCALLS, 1);
+    ShmRing* ring = &shm->region->order_ring;
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        return;
+    }
+    ShmRing* status_ring = &shm->region->status_ring;
+    for (; head != tail; head++) {
+        if (atomic_load_explicit(&status_ring->tail, memory_order_relaxed) - atomic_load_explicit(&status_ring->head, memory_order_acquire) >= SHM_RING_SLOTS) {
+            break;
+        }
+        OrderMessage message = shm->region->orders[head % SHM_RING_SLOTS];
+        int state;
+        int order_id = handle_frame(conn, &message, &state);
+        if (state != -1) {
+            shm_push_status(conn, order_id, state, head);
+        }
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    status_flush(conn);
+    shm_ring_client(conn);
+    metric_add(COUNTER_INGEST_SYSCALLS, 1);
+}
+
+// Consumes bytes handed over by the kernel in a provided buffer. Whole frames
+// are parsed in place; only a frame split across buffers is copied into the
+// connection's carry-over buffer.
+void consume_orders(Connection* conn, const char* data, int length) {
+    while (length > 0) {
+        if (conn->used > 0 || length < (int)sizeof(OrderMessage)) {
+            int take = (int)sizeof(OrderMessage) - conn->used;
+            if (take > length) {
+                take = length;
+            }
+            memcpy(conn->buffer + conn->used, data, take);
+            conn->used += take;
+            data += take;
+            length -= take;
+            if (conn->used == (int)sizeof(OrderMessage)) {
+                OrderMessage message;
+                memcpy(&message, conn->buffer, sizeof(message));
+                conn->used = 0;
+                consume_order(conn, &message);
+            }
+            continue;
+        }
+        OrderMessage message;
+        memcpy(&message, data, sizeof(message));
+        consume_order(conn, &message);
+        data += sizeof(OrderMessage);
+        length -= sizeof(OrderMessage);
+    }
+    status_flush(conn);
+}
+
+// Multishot receives carry no ancillary data, so a shared-memory client
+// never gets its descriptors across on this backend.
+void consume_order(Connection* conn, OrderMessage* message) {
+    if (message->number_of_clients == SHM_HELLO) {
+        fprintf(stderr, "Shared-memory client PID %d refused: needs --backend=epoll\n", message->pid);
+        return;
+    }
+    int state;
+    handle_frame(conn, message, &state);
+}
+
+bool uring_setup(Uring* ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd == -1) {
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring->fd);
+        return false;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+    char* base = ring->ring;
+    ring->sq_head = (_Atomic unsigned*)(base + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned*)(base + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(base + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned*)(base + params.sq_off.array);
+    ring->cq_head = (_Atomic unsigned*)(base + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned*)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+    ring->to_submit = 0;
+
+    // Receive buffers live in a provided-buffer ring: the kernel picks one
+    // only when data arrives, so idle connections pin no memory.
+    size_t buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (ring->buf_ring == MAP_FAILED || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        free(ring->buffers);
+        munmap(ring->sqes, ring->sqes_size);
+        munmap(ring->ring, ring->ring_size);
+        close(ring->fd);
+        return false;
+    }
+    ring->buf_tail = 0;
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        uring_recycle_buffer(ring, i);
+    }
+    uring_publish_buffers(ring);
+    return true;
+}
+
+void uring_teardown(Uring* ring) {
+    munmap(ring->buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(ring->buffers);
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring, ring->ring_size);
+    close(ring->fd);
+}
+
+struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+    unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) == ring->sq_entries) {
+        uring_enter(ring, 0, NULL);
+    }
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    ring->to_submit++;
+    return sqe;
+}
+
+// One io_uring_enter both submits everything queued since the last call and
+// waits for completions, so the steady state is one syscall per wakeup.
+int uring_enter(Uring* ring, unsigned wait_for, struct __kernel_timespec* timeout) {
+    struct io_uring_getevents_arg arg = { .sigmask = 0, .sigmask_sz = _NSIG / 8, .ts = (uintptr_t)timeout };
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_for,
+                            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    metric_add(COUNTER_INGEST_SYSCALLS, 1);
+    if (submitted > 0) {
+        ring->to_submit -= submitted;
+    }
+    return submitted;
+}
+
+void uring_recycle_buffer(Uring* ring, int bid) {
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+}
+
+void uring_publish_buffers(Uring* ring) {
+    atomic_store_explicit((_Atomic unsigned short*)&ring->buf_ring->tail, ring->buf_tail, memory_order_release);
+}
+
+void uring_prep_recv(Uring* ring, Connection* conn) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uintptr_t)conn;
+}
+
+void uring_prep_accept(Uring* ring, int fd, unsigned long long tag) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = tag;
+}
+
+void uring_prep_poll(Uring* ring, int fd, int events, unsigned long long tag) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = tag;
+}
+
+// The io_uring side of status_arm. The poll holds a reference until it
+// completes, so the connection outlives a client that hangs up meanwhile.
+void uring_arm_flush(Uring* ring, Connection* conn) {
+    if (conn->reply_used > 0 && !conn->flush_armed) {
+        conn->flush_armed = true;
+        connection_retain(conn);
+        uring_prep_poll(ring, conn->fd, POLLOUT, (uintptr_t)conn | URING_TAG_WRITABLE);
+    }
+}
+
+void uring_prep_close(Uring* ring, int fd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = URING_TAG_IGNORE;
+}
+
+// Same contract as ingest_loop, driven by completions instead of readiness.
+// Returns false without touching any socket when the kernel lacks a feature
+// we need, so the caller can fall back to epoll.
+bool uring_ingest_loop(int* server_socket, int unix_socket, int upgrade_socket) {
+    Uring ring;
+    if (!uring_setup(&ring)) {
+        return false;
+    }
+    uring_prep_accept(&ring, *server_socket, URING_TAG_ACCEPT);
+    int accepts_armed = 1;
+    if (unix_socket != -1) {
+        uring_prep_accept(&ring, unix_socket, URING_TAG_ACCEPT_UNIX);
+        accepts_armed++;
+    }
+    if (upgrade_socket != -1) {
+        uring_prep_poll(&ring, upgrade_socket, POLLIN, URING_TAG_UPGRADE);
+    }
+    int open_connections = 0;
+
+    // Keep going until the cancelled accepts have reported back: a client
+    // accepted just before the handoff is still ours to serve.
+    while (running && (accepting || accepts_armed > 0 || open_connections > 0)) {
+        struct __kernel_timespec timeout = { .tv_sec = 0, .tv_nsec = 500000000 };
+        uring_enter(&ring, 1, &timeout);
+
+        unsigned head = atomic_load_explicit(ring.cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(ring.cq_tail, memory_order_acquire);
+        bool recycled = false;
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & ring.cq_mask];
+            int result = cqe->res;
+            unsigned flags = cqe->flags;
+            unsigned long long tag = cqe->user_data;
+
+            if (tag == URING_TAG_ACCEPT || tag == URING_TAG_ACCEPT_UNIX) {
+                if (result >= 0) {
+                    uring_prep_recv(&ring, connection_create(result, CONN_CLIENT));
+                    open_connections++;
+                } else if (result != -ECANCELED) {
+                    fprintf(stderr, "Accept failed: %s\n", strerror(-result));
+                }
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    if (accepting) {
+                        uring_prep_accept(&ring, tag == URING_TAG_ACCEPT ? *server_socket : unix_socket, tag);
+                    } else {
+                        accepts_armed--;
+                    }
+                }
+            } else if (tag == URING_TAG_UPGRADE) {
+                // Disarm the multishot accepts before the (possibly slow)
+                // handoff, or they keep taking clients meant for the
+                // successor. Their final completions re-arm them if the
+                // handoff fails.
+                unsigned long long accept_tags[] = { URING_TAG_ACCEPT, URING_TAG_ACCEPT_UNIX };
+                for (int t = 0; t < 2; t++) {
+                    struct io_uring_sqe* cancel = uring_get_sqe(&ring);
+                    cancel->opcode = IORING_OP_ASYNC_CANCEL;
+                    cancel->addr = accept_tags[t];
+                    cancel->user_data = URING_TAG_IGNORE;
+                }
+                uring_enter(&ring, 0, NULL);
+                if (handoff_to_successor(*server_socket, unix_socket, upgrade_socket)) {
+                    uring_prep_close(&ring, *server_socket);
+                    *server_socket = -1;
+                } else {
+                    uring_prep_poll(&ring, upgrade_socket, POLLIN, URING_TAG_UPGRADE);
+                }
+            } else if (tag != URING_TAG_IGNORE && (tag & URING_TAG_WRITABLE)) {
+                Connection* conn = (Connection*)(uintptr_t)(tag & ~(unsigned long long)URING_TAG_WRITABLE);
+                conn->flush_armed = false;
+                if (result > 0) {
+                    status_flush(conn);
+                    uring_arm_flush(&ring, conn);
+                }
+                if (atomic_fetch_sub_explicit(&conn->refs, 1, memory_order_acq_rel) == 1) {
+                    uring_prep_close(&ring, conn->fd);
+                    free(conn->replies);
+                    free(conn);
+                }
+            } else if (tag != URING_TAG_IGNORE) {
+                Connection* conn = (Connection*)(uintptr_t)tag;
+                if (flags & IORING_CQE_F_BUFFER) {
+                    int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                    if (result > 0) {
+                        consume_orders(conn, ring.buffers + (size_t)bid * URING_BUFFER_SIZE, result);
+                        uring_arm_flush(&ring, conn);
+                    }
+                    uring_recycle_buffer(&ring, bid);
+                    recycled = true;
+                }
+                if (result == -ENOBUFS || (result > 0 && !(flags & IORING_CQE_F_MORE))) {
+                    uring_prep_recv(&ring, conn);
+                } else if (result <= 0) {
+                    if (conn->used > 0) {
+                        fprintf(stderr, "Dropping %d bytes of a truncated order\n", conn->used);
+                    }
+                    // Last reference: close through the ring with the next submit
+                    if (atomic_fetch_sub_explicit(&conn->refs, 1, memory_order_acq_rel) == 1) {
+                        uring_prep_close(&ring, conn->fd);
+                        free(conn->replies);
+                        free(conn);
+                    }
+                    open_connections--;
+                }
+            }
+        }
+        atomic_store_explicit(ring.cq_head, head, memory_order_release);
+        if (recycled) {
+            uring_publish_buffers(&ring);
+        }
+    }
+    uring_enter(&ring, 0, NULL);  // Flush closes still sitting in the ring
+    uring_teardown(&ring);
+    return true;
+}
+
+// The index and every order's state are only touched with mutex_index held
+// last, so any thread holding a queue lock may still consult it.
+void index_insert(Order* order) {
+    LOCK(&mutex_index);
+    Order** bucket = &order_index[order->order_id & (ORDER_INDEX_BUCKETS - 1)];
+    order->index_next = *bucket;
+    *bucket = order;
+    UNLOCK(&mutex_index);
+    status_publish(order, atomic_load(&order->state) == ORDER_READY ? STATUS_READY : STATUS_QUEUED);
+}
+
+// Caller holds mutex_index
+Order* index_lookup(int order_id) {
+    Order* order = order_index[order_id & (ORDER_INDEX_BUCKETS - 1)];
+    while (order != NULL && order->order_id != order_id) {
+        order = order->index_next;
+    }
+    return order;
+}
+
+// Caller holds mutex_index
+void index_unlink(Order* order) {
+    Order** link = &order_index[order->order_id & (ORDER_INDEX_BUCKETS - 1)];
+    while (*link != NULL && *link != order) {
+        link = &(*link)->index_next;
+    }
+    if (*link != NULL) {
+        *link = order->index_next;
+    }
+}
+
+void index_remove(Order* order) {
+    LOCK(&mutex_index);
+    index_unlink(order);
+    UNLOCK(&mutex_index);
+}
+
+// Status table: one seqlocked slot per order id modulo STATUS_SLOTS. Ids are
+// handed out in sequence, so a slot only changes hands once STATUS_SLOTS
+// newer orders exist and a lookup for the old id reports it unknown.
+// Writers (the stage moving the order on) take the slot by making its
+// sequence odd; readers never write, so a flood of queries costs the
+// kitchen nothing but cache traffic on the slots being read.
+void status_publish(Order* order, int state) {
+    StatusSlot* slot = &status_table[order->order_id & (STATUS_SLOTS - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t placed_ms = order->placed_at.tv_sec * 1000LL + order->placed_at.tv_nsec / 1000000;
+    int32_t after_ms = (int32_t)(now.tv_sec * 1000LL + now.tv_nsec / 1000000 - placed_ms);
+
+    uint32_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    while ((sequence & 1) || !atomic_compare_exchange_weak_explicit(&slot->sequence, &sequence, sequence + 1, memory_order_acquire, memory_order_relaxed)) {
+        CPU_RELAX();
+        sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_release);
+    if (atomic_load_explicit(&slot->order_id, memory_order_relaxed) != order->order_id) {
+        atomic_store_explicit(&slot->order_id, order->order_id, memory_order_relaxed);
+        atomic_store_explicit(&slot->placed_ms, placed_ms, memory_order_relaxed);
+        atomic_store_explicit(&slot->ready_ms, -1, memory_order_relaxed);
+        atomic_store_explicit(&slot->out_ms, -1, memory_order_relaxed);
+        atomic_store_explicit(&slot->done_ms, -1, memory_order_relaxed);
+    }
+    atomic_store_explicit(&slot->state, state, memory_order_relaxed);
+    if (state == STATUS_READY) {
+        atomic_store_explicit(&slot->ready_ms, after_ms, memory_order_relaxed);
+    } else if (state == STATUS_OUT) {
+        atomic_store_explicit(&slot->out_ms, after_ms, memory_order_relaxed);
+    } else if (state == STATUS_DELIVERED || state == STATUS_CANCELLED) {
+        atomic_store_explicit(&slot->done_ms, after_ms, memory_order_relaxed);
+    }
+    atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+}
+
+// Retries while a writer is in the slot; a writer holds it for a few
+// stores, so this rarely loops.
+bool status_lookup(int order_id, StatusReply* reply) {
+    StatusSlot* slot = &status_table[order_id & (STATUS_SLOTS - 1)];
+    uint32_t before, after;
+    int64_t placed_ms;
+    do {
+        before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        reply->order_id = atomic_load_explicit(&slot->order_id, memory_order_relaxed);
+        reply->state = atomic_load_explicit(&slot->state, memory_order_relaxed);
+        reply->ready_ms = atomic_load_explicit(&slot->ready_ms, memory_order_relaxed);
+        reply->out_ms = atomic_load_explicit(&slot->out_ms, memory_order_relaxed);
+        reply->done_ms = atomic_load_explicit(&slot->done_ms, memory_order_relaxed);
+        placed_ms = atomic_load_explicit(&slot->placed_ms, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+
+    if (before == 0 || reply->order_id != order_id) {
+        *reply = (StatusReply){ order_id, STATUS_UNKNOWN, 0, -1, -1, -1 };
+        return false;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    reply->age_ms = (int32_t)(now.tv_sec * 1000LL + now.tv_nsec / 1000000 - placed_ms);
+    return true;
+}
+
+void status_answer(Connection* conn, int order_id) {
+    metric_add(COUNTER_STATUS_QUERIES, 1);
+    StatusReply reply;
+    status_lookup(order_id, &reply);
+    status_queue(conn, &reply);
+}
+
+// A socket client hears back about a cancel in the same StatusReply frame:
+// CANCELLED if it went through, otherwise whatever the order is doing now.
+void cancel_answer(Connection* conn, int order_id, int result) {
+    StatusReply reply;
+    status_lookup(order_id, &reply);
+    if (result != CANCEL_LATE) {
+        reply.state = STATUS_CANCELLED;  // A cook may not have discarded it yet
+    }
+    status_queue(conn, &reply);
+}
+
+// Replies queue up per connection and go out in one send per read, so a
+// client pipelining queries costs one syscall per batch, not per query.
+void status_queue(Connection* conn, StatusReply* reply) {
+    if (conn->replies == NULL) {
+        conn->replies = malloc(STATUS_REPLY_BUFFER);
+    }
+    if (conn->reply_used + (int)sizeof(StatusReply) > STATUS_REPLY_BUFFER) {
+        status_flush(conn);
+    }
+    if (conn->reply_used + (int)sizeof(StatusReply) > STATUS_REPLY_BUFFER) {
+        metric_add(COUNTER_STATUS_DROPPED, 1);  // Client stopped reading: don't stall ingest on it
+        return;
+    }
+    memcpy(conn->replies + conn->reply_used, reply, sizeof(*reply));
+    conn->reply_used += sizeof(*reply);
+}
+
+// A short send keeps the unsent tail, partial reply included, for next time.
+void status_flush(Connection* conn) {
+    if (conn->reply_used == 0) {
+        return;
+    }
+    ssize_t sent = send(conn->fd, conn->replies, conn->reply_used, MSG_NOSIGNAL | MSG_DONTWAIT);
+    metric_add(COUNTER_INGEST_SYSCALLS, 1);
+    if (sent > 0) {
+        memmove(conn->replies, conn->replies + sent, conn->reply_used - sent);
+        conn->reply_used -= sent;
+    } else if (sent == -1 && errno != EAGAIN && errno != EINTR) {
+        conn->reply_used = 0;  // Peer is gone; the read side notices next
+    }
+}
+
+// Replies the socket would not take yet go out once it drains, rather than
+// whenever the client next sends something.
+void status_arm(Connection* conn, int epoll_fd) {
+    bool armed = conn->reply_used > 0;
+    if (armed != conn->flush_armed) {
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | (armed ? EPOLLOUT : 0), .data.ptr = conn };
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->flush_armed = armed;
+    }
+}
+
+// An order is in a queue exactly while its state says so, and state moves
+// in and out of QUEUED/READY only under that queue's lock. A cancel can
+// therefore unlink it in O(1) under the same lock. Orders a cook or the
+// journal writer holds are flipped to CANCELLED instead, and the holder
+// discards them at its next step. Only the client that placed an order may
+// cancel it; anyone else is told it is too late.
+int cancel_order(int order_id, pid_t pid) {
+    metric_add(COUNTER_CANCEL_REQUESTS, 1);
+    int result = -1;
+    while (result == -1) {
+        Order* removed = NULL;
+        LOCK(&order_queue.mutex);
+        LOCK(&mutex_clients);
+        LOCK(&mutex_index);
+        Order* order = index_lookup(order_id);
+        int state = order != NULL ? atomic_load(&order->state) : ORDER_CANCELLED;
+        if (order == NULL || order->client_pid != pid) {
+            result = CANCEL_LATE;
+        } else if (state == ORDER_QUEUED) {
+            for (int i = 0; i < client_count; i++) {
+                if (clients[i].pid == order->client_pid) {
+                    queue_remove(&clients[i].pending, order);
+                    if (clients[i].pending.size == 0) {
+                        clients[i].deficit = 0;
+                    }
+                    break;
+                }
+            }
+            order_queue.size--;
+            atomic_store(&order->state, ORDER_CANCELLED);
+            index_unlink(order);
+            removed = order;
+            result = CANCEL_QUEUED;
+        } else if ((state == ORDER_JOURNALED || state == ORDER_COOKING) && atomic_compare_exchange_strong(&order->state, &state, ORDER_CANCELLED)) {
+            result = state == ORDER_JOURNALED ? CANCEL_QUEUED : CANCEL_KITCHEN;
+        }
+        UNLOCK(&mutex_index);
+        UNLOCK(&mutex_clients);
+        UNLOCK(&order_queue.mutex);
+
+        if (result == -1) {
+            LOCK(&delivery_queue.mutex);
+            LOCK(&mutex_index);
+            order = index_lookup(order_id);
+            state = order != NULL && order->client_pid == pid ? atomic_load(&order->state) : ORDER_CANCELLED;
+            if (state == ORDER_READY) {
+                queue_remove(&delivery_queue, order);
+                atomic_store(&order->state, ORDER_CANCELLED);
+                index_unlink(order);
+                removed = order;
+                result = CANCEL_READY;
+            } else if (state == ORDER_COOKING && atomic_compare_exchange_strong(&order->state, &state, ORDER_CANCELLED)) {
+                result = CANCEL_KITCHEN;
+            } else if (state == ORDER_OUT || state == ORDER_CANCELLED) {
+                result = CANCEL_LATE;
+            }
+            // Otherwise it just left the journal for the queue: go again
+            UNLOCK(&mutex_index);
+            UNLOCK(&delivery_queue.mutex);
+        }
+        if (removed != NULL) {
+            retire_cancelled(removed, result == CANCEL_QUEUED ? "before cooking" : "before dispatch");
+        }
+    }
+    metric_add(COUNTER_CANCELLED_QUEUED + result, 1);
+    return result;
+}
+
+// Last step for a cancelled order that is out of every queue and the index
+void retire_cancelled(Order* order, const char* where) {
+    status_publish(order, STATUS_CANCELLED);
+    if (journal.fd != -1) {
+        journal_append(JOURNAL_CANCELLED, order, NULL);
+    }
+    printf("Order %d cancelled %s\n", order->order_id, where);
+    fprintf(log_file, "Order %d cancelled %s\n", order->order_id, where);
+    fflush(log_file);
+    connection_release(order->conn);
+    LOCK(&mutex_clients);
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].pid == order->client_pid) {
+            client_order_done(&clients[i]);
+            break;
+        }
+    }
+    UNLOCK(&mutex_clients);
+    free(order);
+}
+
+// Returns the order id the frame refers to and sets *state to what the
+// client should hear back; hello frames only carry descriptors.
+int handle_frame(Connection* conn, OrderMessage* message, int* state) {
+    if (message->number_of_clients == SHM_HELLO) {
+        *state = -1;
+        return 0;
+    }
+    if (message->number_of_clients == ORDER_CANCEL) {
+        int result = cancel_order(message->x, message->pid);
+        *state = result == CANCEL_LATE ? SHM_CANCEL_LATE : SHM_CANCELLED;
+        if (conn->shm == NULL) {
+            cancel_answer(conn, message->x, result);  // Shared-memory clients hear it on the status ring
+        }
+        return message->x;
+    }
+    if (message->number_of_clients == ORDER_STATUS) {
+        status_answer(conn, message->x);  // Answered on the socket, whatever the transport
+        *state = -1;
+        return message->x;
+    }
+    int order_id = place_order(conn, message);
+    *state = order_id > 0 ? SHM_PLACED : SHM_REJECTED;
+    return order_id;
+}
+
+double stage_mean_us(int stage) {
+    long count = 0, sum = 0;
+    for (int s = 0; s < METRIC_SHARDS; s++) {
+        sum += atomic_load_explicit(&metric_shards[s].sum_us[stage], memory_order_relaxed);
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            count += atomic_load_explicit(&metric_shards[s].buckets[stage][b], memory_order_relaxed);
+        }
+    }
+    return count > 0 ? (double)sum / count : 0;
+}
+
+// Saved work is estimated from the mean stage times of orders that did run
+// to completion; wasted work is what cooks actually spent on orders that
+// were cancelled under them.
+void report_cancellations() {
+    long requests = metric_total(COUNTER_CANCEL_REQUESTS);
+    if (requests == 0) {
+        return;
+    }
+    long queued = metric_total(COUNTER_CANCELLED_QUEUED);
+    long kitchen = metric_total(COUNTER_CANCELLED_KITCHEN);
+    long ready = metric_total(COUNTER_CANCELLED_READY);
+    long late = metric_total(COUNTER_CANCEL_LATE);
+    long unbaked = metric_total(COUNTER_CANCELLED_UNBAKED);
+    double saved_cook_s = (queued * (stage_mean_us(STAGE_PREPARE) + stage_mean_us(STAGE_BAKE)) + unbaked * stage_mean_us(STAGE_BAKE)) / 1e6;
+    double wasted_cook_s = metric_total(COUNTER_CANCEL_WASTED_US) / 1e6;
+    printf("Cancellations: %ld requested, %ld before cooking, %ld in the kitchen (%ld before the oven), %ld before dispatch, %ld too late\n", requests, queued, kitchen, unbaked, ready, late);
+    printf("Cancelled work: ~%.2f cook-seconds and %ld deliveries saved, %.2f cook-seconds wasted\n", saved_cook_s, queued + kitchen + ready, wasted_cook_s);
+    fprintf(log_file, "Cancellations: %ld requested, %ld before cooking, %ld in the kitchen (%ld before the oven), %ld before dispatch, %ld too late\n", requests, queued, kitchen, unbaked, ready, late);
+    fprintf(log_file, "Cancelled work: ~%.2f cook-seconds and %ld deliveries saved, %.2f cook-seconds wasted\n", saved_cook_s, queued + kitchen + ready, wasted_cook_s);
+}
+
+// Workers run as fibers on --fibers=N carrier threads when asked. A fiber is
+// a ucontext on a small lazily committed stack; LOCK, COND_* and nap_us()
+// notice they are on one and park the fiber instead of the carrier.
+// fiber_self() and the switch must not be inlined: a fiber can resume on a
+// different carrier, and a cached thread-local address would still point at
+// the old one.
+__attribute__((noipa)) Fiber* fiber_self() {
+    return running_fiber;
+}
+
+__attribute__((noipa)) void fiber_switch_out(Fiber* self, int state) {
+    atomic_store(&self->state, state);
+    swapcontext(&self->context, carrier_context);
+}
+
+__attribute__((noipa)) MatrixScratch* carrier_scratch() {
+    static __thread MatrixScratch* scratch = NULL;
+    if (scratch == NULL) {
+        scratch = malloc(sizeof(MatrixScratch));
+    }
+    return scratch;
+}
+
+void fiber_start(int carriers) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&fibers.cond_work, &attr);
+    pthread_condattr_destroy(&attr);
+    fibers.carriers = fibers.carriers_running = carriers;
+    for (int i = 0; i < carriers; i++) {
+        pthread_t carrier;
+        if (pthread_create(&carrier, NULL, carrier_thread, NULL) != 0) {
+            perror("Carrier thread creation failed");
+            exit(1);
+        }
+        pthread_detach(carrier);
+    }
+}
+
+// Waits for the carriers to run the last fibers to completion and exit
+void fiber_stop() {
+    pthread_mutex_lock(&fibers.mutex);
+    fibers.stopping = true;
+    pthread_cond_broadcast(&fibers.cond_work);
+    while (fibers.carriers_running > 0) {
+        pthread_mutex_unlock(&fibers.mutex);
+        usleep(1000);
+        pthread_mutex_lock(&fibers.mutex);
+    }
+    pthread_mutex_unlock(&fibers.mutex);
+}
+
+bool fiber_spawn(void *(*routine)(void *), void* arg) {
+    pthread_mutex_lock(&fibers.mutex);
+    Fiber* fiber = fibers.free_list;
+    if (fiber != NULL) {
+        fibers.free_list = fiber->next;
+    } else {
+        // No guard page: 100k guards would blow through vm.max_map_count
+        void* stack = mmap(NULL, FIBER_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED || (fiber = malloc(sizeof(Fiber))) == NULL) {
+            if (stack != MAP_FAILED) {
+                munmap(stack, FIBER_STACK_SIZE);
+            }
+            pthread_mutex_unlock(&fibers.mutex);
+            return false;
+        }
+        fiber->stack = stack;
+    }
+    getcontext(&fiber->context);
+    fiber->context.uc_stack.ss_sp = fiber->stack;
+    fiber->context.uc_stack.ss_size = FIBER_STACK_SIZE;
+    fiber->context.uc_link = NULL;
+    makecontext(&fiber->context, fiber_entry, 0);
+    fiber->routine = routine;
+    fiber->arg = arg;
+    fiber->wake_pending = false;
+    fiber->timer_slot = -1;
+    fibers.live++;
+    fiber_push(fiber);
+    pthread_mutex_unlock(&fibers.mutex);
+    return true;
+}
+
+void fiber_entry() {
+    Fiber* self = fiber_self();
+    self->routine(self->arg);
+    fiber_switch_out(self, FIBER_DONE);
+}
+
+// Caller holds fibers.mutex
+void fiber_push(Fiber* fiber) {
+    atomic_store(&fiber->state, FIBER_RUNNABLE);
+    fiber->next = NULL;
+    if (fibers.run_rear == NULL) {
+        fibers.run_front = fiber;
+    } else {
+        fibers.run_rear->next = fiber;
+    }
+    fibers.run_rear = fiber;
+    pthread_cond_signal(&fibers.cond_work);
+}
+
+// Caller holds fibers.mutex. A fiber that is still running or on its way
+// out keeps the wakeup for its next park, which then returns at once.
+void fiber_wake(Fiber* fiber) {
+    if (atomic_load(&fiber->state) == FIBER_PARKED) {
+        fiber_push(fiber);
+    } else {
+        fiber->wake_pending = true;
+    }
+}
+
+void* carrier_thread(void* arg) {
+    apply_placement(ROLE_COOK);  // Carriers mostly run cook fibers' CPU work
+    ucontext_t home;
+    carrier_context = &home;
+    pthread_mutex_lock(&fibers.mutex);
+    while (1) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        while (fibers.timer_count > 0 && elapsed_ms(&fibers.timers[0]->wake_at, &now) >= 0) {
+            Fiber* sleeper = fibers.timers[0];
+            timer_remove(sleeper);
+            fiber_wake(sleeper);
+        }
+        Fiber* fiber = fibers.run_front;
+        if (fiber == NULL) {
+            if (fibers.stopping && fibers.live == 0) {
+                fibers.carriers_running--;
+                pthread_cond_broadcast(&fibers.cond_work);
+                pthread_mutex_unlock(&fibers.mutex);
+                return NULL;
+            }
+            if (fibers.timer_count > 0) {
+                pthread_cond_timedwait(&fibers.cond_work, &fibers.mutex, &fibers.timers[0]->wake_at);
+            } else {
+                pthread_cond_wait(&fibers.cond_work, &fibers.mutex);
+            }
+            continue;
+        }
+        fibers.run_front = fiber->next;
+        if (fibers.run_front == NULL) {
+            fibers.run_rear = NULL;
+        }
+        atomic_store(&fiber->state, FIBER_RUNNING);
+        fibers.switches++;
+        pthread_mutex_unlock(&fibers.mutex);
+
+        running_fiber = fiber;
+        swapcontext(&home, &fiber->context);
+        running_fiber = NULL;
+
+        pthread_mutex_lock(&fibers.mutex);
+        switch (atomic_load(&fiber->state)) {
+        case FIBER_YIELDING:
+            fiber_push(fiber);
+            break;
+        case FIBER_PARKING:
+            atomic_store(&fiber->state, FIBER_PARKED);
+            if (fiber->wake_pending) {
+                fiber->wake_pending = false;
+                fiber_push(fiber);
+            }
+            break;
+        case FIBER_DONE:  // Its stack is free now that we are off it
+            fiber->next = fibers.free_list;
+            fibers.free_list = fiber;
+            fibers.live--;
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Parks until woken, or until wake_at (CLOCK_MONOTONIC) if given. Wakeups
+// may be spurious, so callers loop on their own condition.
+void fiber_park(Fiber* self, const struct timespec* wake_at) {
+    if (wake_at != NULL) {
+        pthread_mutex_lock(&fibers.mutex);
+        self->wake_at = *wake_at;
+        timer_push(self);
+        pthread_mutex_unlock(&fibers.mutex);
+    }
+    fiber_switch_out(self, FIBER_PARKING);
+    if (wake_at != NULL) {
+        pthread_mutex_lock(&fibers.mutex);
+        if (self->timer_slot != -1) {
+            timer_remove(self);
+        }
+        pthread_mutex_unlock(&fibers.mutex);
+    }
+}
+
+// Timers live in a binary min-heap on wake_at; each fiber remembers its slot
+// so an early wakeup can take it out.
+void timer_swap(int a, int b) {
+    Fiber* t = fibers.timers[a];
+    fibers.timers[a] = fibers.timers[b];
+    fibers.timers[b] = t;
+    fibers.timers[a]->timer_slot = a;
+    fibers.timers[b]->timer_slot = b;
+}
+
+void timer_sift(int slot) {
+    while (slot > 0 && elapsed_ms(&fibers.timers[slot]->wake_at, &fibers.timers[(slot - 1) / 2]->wake_at) > 0) {
+        timer_swap(slot, (slot - 1) / 2);
+        slot = (slot - 1) / 2;
+    }
+    while (1) {
+        int least = slot;
+        for (int child = 2 * slot + 1; child <= 2 * slot + 2 && child < fibers.timer_count; child++) {
+            if (elapsed_ms(&fibers.timers[child]->wake_at, &fibers.timers[least]->wake_at) > 0) {
+                least = child;
+            }
+        }
+        if (least == slot) {
+            return;
+        }
+        timer_swap(slot, least);
+        slot = least;
+    }
+}
+
+void timer_push(Fiber* fiber) {
+    if (fibers.timer_count == fibers.timer_capacity) {
+        fibers.timer_capacity = fibers.timer_capacity > 0 ? fibers.timer_capacity * 2 : 1024;
+        fibers.timers = realloc(fibers.timers, fibers.timer_capacity * sizeof(Fiber*));
+    }
+    fiber->timer_slot = fibers.timer_count;
+    fibers.timers[fibers.timer_count++] = fiber;
+    timer_sift(fiber->timer_slot);
+}
+
+void timer_remove(Fiber* fiber) {
+    int slot = fiber->timer_slot;
+    fibers.timer_count--;
+    if (slot != fibers.timer_count) {
+        timer_swap(slot, fibers.timer_count);
+        timer_sift(slot);
+    }
+    fiber->timer_slot = -1;
+}
+
+// Fibers block on a mutex or condition variable by waiting in a bucket keyed
+// by its address. Every shop UNLOCK and COND_SIGNAL also wakes fibers there,
+// whoever the caller is, so plain threads and fibers can share them.
+void fiber_wait_begin(FiberWaiter* waiter) {
+    FiberWaiter** bucket = &fibers.waiters[((uintptr_t)waiter->key >> 6) % FIBER_WAIT_BUCKETS];
+    pthread_mutex_lock(&fibers.mutex);
+    waiter->prev = NULL;
+    waiter->next = *bucket;
+    if (*bucket != NULL) {
+        (*bucket)->prev = waiter;
+    }
+    *bucket = waiter;
+    waiter->linked = true;
+    atomic_fetch_add(&fibers.waiting, 1);
+    pthread_mutex_unlock(&fibers.mutex);
+}
+
+void fiber_wait_end(FiberWaiter* waiter) {
+    pthread_mutex_lock(&fibers.mutex);
+    if (waiter->linked) {
+        fiber_waiter_unlink(waiter);
+    }
+    atomic_fetch_sub(&fibers.waiting, 1);
+    pthread_mutex_unlock(&fibers.mutex);
+}
+
+// Caller holds fibers.mutex
+void fiber_waiter_unlink(FiberWaiter* waiter) {
+    if (waiter->prev != NULL) {
+        waiter->prev->next = waiter->next;
+    } else {
+        fibers.waiters[((uintptr_t)waiter->key >> 6) % FIBER_WAIT_BUCKETS] = waiter->next;
+    }
+    if (waiter->next != NULL) {
+        waiter->next->prev = waiter->prev;
+    }
+    waiter->linked = false;
+}
+
+void fiber_wake_waiters(void* key, bool all) {
+    if (atomic_load(&fibers.waiting) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&fibers.mutex);
+    FiberWaiter* waiter = fibers.waiters[((uintptr_t)key >> 6) % FIBER_WAIT_BUCKETS];
+    while (waiter != NULL) {
+        FiberWaiter* next = waiter->next;
+        if (waiter->key == key) {
+            fiber_waiter_unlink(waiter);
+            fiber_wake(waiter->fiber);
+            if (!all) {
+                break;
+            }
+        }
+        waiter = next;
+    }
+    pthread_mutex_unlock(&fibers.mutex);
+}
+
+// A fiber never blocks its carrier on a shop mutex: the holder may be a
+// parked fiber that needs this very carrier to finish. Default (normal)
+// mutexes do not track their owner in glibc, so a fiber can unlock on
+// another carrier than the one it locked on. The short timed park covers a
+// plain thread releasing the mutex inside pthread_cond_wait, which does not
+// go through fiber_mutex_unlock; it backs off so a long hold costs little.
+void fiber_mutex_lock(pthread_mutex_t* mutex) {
+    Fiber* self = fiber_self();
+    if (self == NULL) {
+        pthread_mutex_lock(mutex);
+        return;
+    }
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return;
+    }
+    FiberWaiter waiter = { .fiber = self, .key = mutex };
+    long recheck_ns = FIBER_LOCK_RECHECK_NS;
+    while (1) {
+        fiber_wait_begin(&waiter);
+        if (pthread_mutex_trylock(mutex) == 0) {
+            fiber_wait_end(&waiter);
+            return;
+        }
+        struct timespec wake_at;
+        clock_gettime(CLOCK_MONOTONIC, &wake_at);
+        wake_at.tv_nsec += recheck_ns;
+        if (wake_at.tv_nsec >= 1000000000L) {
+            wake_at.tv_sec++;
+            wake_at.tv_nsec -= 1000000000L;
+        }
+        if (recheck_ns < FIBER_LOCK_RECHECK_MAX_NS) {
+            recheck_ns *= 2;
+        }
+        fiber_park(self, &wake_at);
+        fiber_wait_end(&waiter);
+    }
+}
+
+void fiber_mutex_unlock(pthread_mutex_t* mutex) {
+    pthread_mutex_unlock(mutex);
+    fiber_wake_waiters(mutex, false);
+}
+
+int fiber_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline) {
+    Fiber* self = fiber_self();
+    if (self == NULL) {
+        return deadline != NULL ? pthread_cond_timedwait(cond, mutex, deadline) : pthread_cond_wait(cond, mutex);
+    }
+    FiberWaiter waiter = { .fiber = self, .key = cond };
+    fiber_wait_begin(&waiter);
+    fiber_mutex_unlock(mutex);
+
+    struct timespec wake_at;
+    if (deadline != NULL) {  // Realtime deadline, as pthread_cond_timedwait takes it
+        struct timespec realtime;
+        clock_gettime(CLOCK_REALTIME, &realtime);
+        clock_gettime(CLOCK_MONOTONIC, &wake_at);
+        long ns = (deadline->tv_sec - realtime.tv_sec) * 1000000000L + (deadline->tv_nsec - realtime.tv_nsec);
+        wake_at.tv_sec += ns / 1000000000L;
+        wake_at.tv_nsec += ns % 1000000000L;
+        while (wake_at.tv_nsec < 0) {
+            wake_at.tv_sec--;
+            wake_at.tv_nsec += 1000000000L;
+        }
+        while (wake_at.tv_nsec >= 1000000000L) {
+            wake_at.tv_sec++;
+            wake_at.tv_nsec -= 1000000000L;
+        }
+    }
+    fiber_park(self, deadline != NULL ? &wake_at : NULL);
+    fiber_wait_end(&waiter);
+
+    fiber_mutex_lock(mutex);
+    if (deadline != NULL) {
+        struct timespec realtime;
+        clock_gettime(CLOCK_REALTIME, &realtime);
+        if (elapsed_ms((struct timespec*)deadline, &realtime) >= 0) {
+            return ETIMEDOUT;
+        }
+    }
+    return 0;
+}
+
+void fiber_cond_signal(pthread_cond_t* cond, bool all) {
+    if (all) {
+        pthread_cond_broadcast(cond);
+    } else {
+        pthread_cond_signal(cond);
+    }
+    fiber_wake_waiters(cond, all);
+}
+
+void nap_us(long us) {
+    Fiber* self = fiber_self();
+    if (self == NULL) {
+        usleep(us);
+        return;
+    }
+    struct timespec wake_at, now;
+    clock_gettime(CLOCK_MONOTONIC, &wake_at);
+    wake_at.tv_sec += us / 1000000;
+    wake_at.tv_nsec += (us % 1000000) * 1000;
+    if (wake_at.tv_nsec >= 1000000000L) {
+        wake_at.tv_sec++;
+        wake_at.tv_nsec -= 1000000000L;
+    }
+    do {
+        fiber_park(self, &wake_at);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (elapsed_ms(&now, &wake_at) > 0);
+}
+
+void worker_exit() {
+    Fiber* self = fiber_self();
+    if (self != NULL) {
+        fiber_switch_out(self, FIBER_DONE);
+    }
+    pthread_exit(NULL);
+}
+
+void report_fibers() {
+    if (fibers.carriers == 0) {
+        return;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    pthread_mutex_lock(&fibers.mutex);
+    printf("Fibers: %d workers on %d carriers, %ld switches, peak RSS %ld MiB\n", fibers.live, fibers.carriers, fibers.switches, usage.ru_maxrss / 1024);
+    fprintf(log_file, "Fibers: %d workers on %d carriers, %ld switches, peak RSS %ld MiB\n", fibers.live, fibers.carriers, fibers.switches, usage.ru_maxrss / 1024);
+    pthread_mutex_unlock(&fibers.mutex);
+}
+
+// Placement is applied by each thread to itself when it starts, so workers
+// the scaler adds later land in the same partition.
+void apply_placement(int role) {
+    RolePlacement* placement = &placements[role];
+    int error = 0;
+    if (placement->pinned) {
+        error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &placement->cpus);
+    }
+    if (error == 0 && placement->policy != -1) {
+        struct sched_param param = { .sched_priority = placement->priority };
+        error = pthread_setschedparam(pthread_self(), placement->policy, &param);
+    }
+    if (error == 0 && placement->nice_set && setpriority(PRIO_PROCESS, syscall(SYS_gettid), placement->nice) == -1) {
+        error = errno;
+    }
+    if (error != 0 && !atomic_exchange(&placement->warned, true)) {
+        fprintf(stderr, "Placement for %s threads failed: %s\n", placement->role, strerror(error));
+    }
+}
+
+RolePlacement* placement_for(const char* spec, const char** rest) {
+    for (int i = 0; i < ROLE_COUNT; i++) {
+        size_t length = strlen(placements[i].role);
+        if (strncmp(spec, placements[i].role, length) == 0 && spec[length] == ':') {
+            *rest = spec + length + 1;
+            return &placements[i];
+        }
+    }
+    fprintf(stderr, "Unknown thread role in %s (cook, courier, ingest or journal)\n", spec);
+    exit(1);
+}
+
+// "0-3,6" style, as in /proc and taskset -c
+bool parse_cpu_list(const char* list, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+    while (*list != '\0' && *list != '\n') {
+        int first, last, used;
+        if (sscanf(list, "%d-%d%n", &first, &last, &used) != 2) {
+            if (sscanf(list, "%d%n", &first, &used) != 1) {
+                return false;
+            }
+            last = first;
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        list += used;
+        if (*list == ',') {
+            list++;
+        }
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+// Unions the effective affinity of every IRQ whose /proc/interrupts line
+// names the device, e.g. irq:eth0 or irq:virtio1-input.
+bool irq_cpus(const char* device, cpu_set_t* cpus) {
+    FILE* interrupts = fopen("/proc/interrupts", "r");
+    if (interrupts == NULL) {
+        return false;
+    }
+    CPU_ZERO(cpus);
+    char line[4096];
+    while (fgets(line, sizeof(line), interrupts) != NULL) {
+        int irq;
+        if (sscanf(line, " %d:", &irq) != 1 || strstr(line, device) == NULL) {
+            continue;
+        }
+        char path[64], list[256];
+        snprintf(path, sizeof(path), "/proc/irq/%d/effective_affinity_list", irq);
+        FILE* affinity = fopen(path, "r");
+        if (affinity == NULL) {
+            snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irq);
+            affinity = fopen(path, "r");
+        }
+        cpu_set_t irq_set;
+        if (affinity != NULL && fgets(list, sizeof(list), affinity) != NULL && parse_cpu_list(list, &irq_set)) {
+            CPU_OR(cpus, cpus, &irq_set);
+        }
+        if (affinity != NULL) {
+            fclose(affinity);
+        }
+    }
+    fclose(interrupts);
+    return CPU_COUNT(cpus) > 0;
+}
+
+void parse_placement(const char* option) {
+    const char* spec;
+    if (strncmp(option, "--cpus=", 7) == 0) {
+        RolePlacement* placement = placement_for(option + 7, &spec);
+        bool parsed = strncmp(spec, "irq:", 4) == 0 ? irq_cpus(spec + 4, &placement->cpus) : parse_cpu_list(spec, &placement->cpus);
+        if (!parsed) {
+            fprintf(stderr, "No CPUs in %s\n", option);
+            exit(1);
+        }
+        placement->pinned = true;
+    } else if (strncmp(option, "--sched=", 8) == 0) {
+        RolePlacement* placement = placement_for(option + 8, &spec);
+        const char* names[] = { "other", "batch", "idle", "fifo", "rr" };
+        int policies[] = { SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO, SCHED_RR };
+        placement->policy = -1;
+        for (int i = 0; i < 5; i++) {
+            size_t length = strlen(names[i]);
+            if (strncmp(spec, names[i], length) == 0 && (spec[length] == '\0' || spec[length] == ':')) {
+                placement->policy = policies[i];
+                placement->priority = spec[length] == ':' ? atoi(spec + length + 1) : 0;
+            }
+        }
+        if (placement->policy == -1) {
+            fprintf(stderr, "Unknown policy in %s (other, batch, idle, fifo[:PRIO] or rr[:PRIO])\n", option);
+            exit(1);
+        }
+    } else {
+        RolePlacement* placement = placement_for(option + 7, &spec);
+        placement->nice = atoi(spec);
+        placement->nice_set = true;
+    }
+}
+
+void* placement_burner(void* arg) {
+    apply_placement(ROLE_COOK);
+    long* multiplications = arg;
+    while (atomic_load(&placement_bench_running)) {
+        calculate_pseudo_inverse(*multiplications % MENU_ITEMS);
+        (*multiplications)++;
+    }
+    return NULL;
+}
+
+void* placement_sleeper(void* arg) {
+    apply_placement(ROLE_COURIER);
+    while (atomic_load(&placement_bench_running)) {
+        usleep(1000);  // Couriers mostly sleep; this is their wakeup churn
+    }
+    return NULL;
+}
+
+void* placement_prober(void* arg) {
+    int port = *(int*)arg;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    while (atomic_load(&placement_bench_running)) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct timespec sent;
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            send(sock, &sent, sizeof(sent), MSG_NOSIGNAL);
+        }
+        close(sock);
+        usleep(PLACEMENT_PROBE_US);
+    }
+    return NULL;
+}
+
+// Cooks burn matrices and couriers churn wakeups with the configured
+// placement while this thread, placed as ingest, accepts probe connections
+// that carry their connect time. Run it with and without --cpus/--sched/
+// --nice to see what the partitioning buys.
+void placement_benchmark(int seconds) {
+    int cook_count = cook_pool.target, courier_count = courier_pool.target;
+    apply_placement(ROLE_INGEST);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = 0, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length = sizeof(addr);
+    if (listener == -1 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listener, 128) == -1 || getsockname(listener, (struct sockaddr*)&addr, &length) == -1) {
+        perror("Placement benchmark listener failed");
+        exit(1);
+    }
+    int port = ntohs(addr.sin_port);
+
+    long* multiplications = calloc(cook_count, sizeof(long));
+    pthread_t* threads = malloc((cook_count + courier_count + 1) * sizeof(pthread_t));
+    for (int i = 0; i < cook_count; i++) {
+        pthread_create(&threads[i], NULL, placement_burner, &multiplications[i]);
+    }
+    for (int i = 0; i < courier_count; i++) {
+        pthread_create(&threads[cook_count + i], NULL, placement_sleeper, NULL);
+    }
+    pthread_create(&threads[cook_count + courier_count], NULL, placement_prober, &port);
+
+    int capacity = seconds * (1000000 / PLACEMENT_PROBE_US) + 16, samples = 0;
+    double* latencies = malloc(capacity * sizeof(double));
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct pollfd pending = { .fd = listener, .events = POLLIN };
+    do {
+        if (poll(&pending, 1, 100) == 1) {
+            int client = accept(listener, NULL, NULL);
+            struct timespec sent;
+            if (client != -1 && recv(client, &sent, sizeof(sent), MSG_WAITALL) == sizeof(sent)) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                if (samples < capacity) {
+                    latencies[samples++] = elapsed_ms(&sent, &now) * 1000;
+                }
+            }
+            if (client != -1) {
+                close(client);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (elapsed_ms(&start, &now) < seconds * 1000.0);
+    atomic_store(&placement_bench_running, false);
+    for (int i = 0; i < cook_count + courier_count + 1; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long total = 0;
+    for (int i = 0; i < cook_count; i++) {
+        total += multiplications[i];
+    }
+    qsort(latencies, samples, sizeof(double), compare_doubles);
+    double mean = 0, variance = 0;
+    for (int i = 0; i < samples; i++) {
+        mean += latencies[i] / samples;
+    }
+    for (int i = 0; i < samples; i++) {
+        variance += (latencies[i] - mean) * (latencies[i] - mean) / samples;
+    }
+    printf("Placement benchmark, %d cooks and %d couriers over %.1f s:\n", cook_count, courier_count, elapsed_ms(&start, &now) / 1000);
+    printf("  Cook throughput: %.0f multiplications/s (%.0f per cook)\n", total / (elapsed_ms(&start, &now) / 1000), total / (elapsed_ms(&start, &now) / 1000) / (cook_count > 0 ? cook_count : 1));
+    if (samples > 0) {
+        printf("  Accept latency over %d probes: p50 %.0f us, p99 %.0f us, max %.0f us, stddev %.0f us\n", samples, latencies[samples / 2], latencies[(int)(samples * 0.99)], latencies[samples - 1], sqrt(variance));
+    }
+    exit(0);
+}
+
+// A trace starts fresh each run; stdio buffers the writes and the file is
+// flushed when the shop shuts down.
+void trace_open(const char* path) {
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL || fwrite(TRACE_MAGIC, 1, 8, trace_file) != 8) {
+        perror("Trace file opening failed");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &trace_started);
+}
+
+// Caller holds mutex_orders
+void trace_record(OrderMessage* message, struct timespec* arrived_at) {
+    // Deltas are taken against the running sum, so rounding never drifts
+    double arrived_us = elapsed_ms(&trace_started, arrived_at) * 1000;
+    double delta_us = arrived_us - trace_written_us;
+    TraceRecord record = {
+        .delta_us = delta_us < 0 ? 0 : (delta_us > UINT32_MAX ? UINT32_MAX : (uint32_t)delta_us),
+        .pid = message->pid,
+        .number_of_clients = message->number_of_clients,
+        .x = message->x,
+        .y = message->y,
+        .item = message->item,
+    };
+    fwrite(&record, sizeof(record), 1, trace_file);
+    trace_written_us += record.delta_us;
+}
+
+void waiter_init(Waiter* waiter) {
+    atomic_init(&waiter->epoch, 0);
+    atomic_init(&waiter->waiting, 0);
+    atomic_init(&waiter->parked, 0);
+    atomic_init(&waiter->shutdown, false);
+    // Spinning on one CPU only delays the thread that would wake us
+    waiter->spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? WAITER_SPIN_MAX : 0;
+    atomic_init(&waiter->spin_limit, waiter->spin_max < WAITER_SPIN_START ? waiter->spin_max : WAITER_SPIN_START);
+}
+
+// Announce before the last check of the queue, with its lock held; any
+// notify after that point changes the epoch the wait compares against.
+uint32_t waiter_prepare(Waiter* waiter) {
+    atomic_fetch_add(&waiter->waiting, 1);
+    return atomic_load(&waiter->epoch);
+}
+
+// Spins while spinning has recently paid off, then parks: a fiber with the
+// scheduler, a thread on the futex. Returns on a notify, on shutdown, or
+// spuriously; callers recheck their queue either way.
+void waiter_wait(Waiter* waiter, uint32_t key) {
+    Fiber* self = fiber_self();  // A spinning fiber would hold up its whole carrier
+    int limit = self != NULL ? 0 : atomic_load_explicit(&waiter->spin_limit, memory_order_relaxed);
+    for (int i = 0; i < limit; i++) {
+        if (atomic_load(&waiter->epoch) != key || atomic_load(&waiter->shutdown)) {
+            if (limit < waiter->spin_max) {
+                atomic_store_explicit(&waiter->spin_limit, limit * 2, memory_order_relaxed);
+            }
+            atomic_fetch_sub(&waiter->waiting, 1);
+            return;
+        }
+        CPU_RELAX();
+    }
+    if (limit > WAITER_SPIN_MIN) {
+        atomic_store_explicit(&waiter->spin_limit, limit / 2, memory_order_relaxed);
+    }
+
+    if (self != NULL) {
+        FiberWaiter parked = { .fiber = self, .key = waiter };
+        fiber_wait_begin(&parked);
+        if (atomic_load(&waiter->epoch) == key && !atomic_load(&waiter->shutdown)) {
+            fiber_park(self, NULL);
+        }
+        fiber_wait_end(&parked);
+    } else {
+        atomic_fetch_add(&waiter->parked, 1);
+        while (atomic_load(&waiter->epoch) == key && !atomic_load(&waiter->shutdown)) {
+            syscall(SYS_futex, &waiter->epoch, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+        }
+        atomic_fetch_sub(&waiter->parked, 1);
+    }
+    atomic_fetch_sub(&waiter->waiting, 1);
+}
+
+// Free when nobody waits; a syscall only when somebody is in the kernel.
+void waiter_notify(Waiter* waiter, bool all) {
+    if (atomic_load(&waiter->waiting) == 0) {
+        return;
+    }
+    atomic_fetch_add(&waiter->epoch, 1);
+    if (atomic_load(&waiter->parked) > 0) {
+        syscall(SYS_futex, &waiter->epoch, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, NULL, NULL, 0);
+    }
+    fiber_wake_waiters(waiter, all);
+}
+
+// Wakes everyone for good: waits from now on return at once.
+void waiter_shutdown(Waiter* waiter) {
+    atomic_store(&waiter->shutdown, true);
+    atomic_fetch_add(&waiter->epoch, 1);
+    syscall(SYS_futex, &waiter->epoch, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    fiber_wake_waiters(waiter, true);
+}
+
+void* waiter_bench_consumer(void* arg) {
+    WaiterBench* bench = arg;
+    while (1) {
+        pthread_mutex_lock(&bench->mutex);
+        while (bench->items == 0 && !bench->stopping) {
+            if (bench->use_condvar) {
+                pthread_cond_wait(&bench->cond, &bench->mutex);
+            } else {
+                uint32_t key = waiter_prepare(&bench->waiter);
+                pthread_mutex_unlock(&bench->mutex);
+                waiter_wait(&bench->waiter, key);
+                pthread_mutex_lock(&bench->mutex);
+            }
+        }
+        if (bench->stopping) {
+            pthread_mutex_unlock(&bench->mutex);
+            return NULL;
+        }
+        bench->items--;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        bench->latencies[bench->taken++] = elapsed_ms(&bench->posted_at, &now) * 1000;
+        pthread_mutex_unlock(&bench->mutex);
+    }
+}
+
+// One item at a time, so every handoff is a wakeup: what the producer pays
+// to post, and how long until a consumer holds the item.
+void waiter_bench_run(WaiterBench* bench, int consumers, int handoffs, int gap_us) {
+    bench->items = bench->taken = 0;
+    bench->stopping = false;
+    pthread_t* threads = malloc(consumers * sizeof(pthread_t));
+    for (int i = 0; i < consumers; i++) {
+        pthread_create(&threads[i], NULL, waiter_bench_consumer, bench);
+    }
+    usleep(100000);  // Let them all go to sleep
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    for (int i = 0; i < handoffs; i++) {
+        if (gap_us > 0) {
+            usleep(gap_us);
+        }
+        pthread_mutex_lock(&bench->mutex);
+        bench->items++;
+        clock_gettime(CLOCK_MONOTONIC, &bench->posted_at);
+        if (bench->use_condvar) {
+            pthread_cond_signal(&bench->cond);
+        }
+        pthread_mutex_unlock(&bench->mutex);
+        if (!bench->use_condvar) {
+            waiter_notify(&bench->waiter, false);
+        }
+        while (1) {  // Wait for the pickup before posting the next one
+            pthread_mutex_lock(&bench->mutex);
+            bool taken = bench->taken == i + 1;
+            pthread_mutex_unlock(&bench->mutex);
+            if (taken) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    getrusage(RUSAGE_SELF, &after);
+    pthread_mutex_lock(&bench->mutex);
+    bench->stopping = true;
+    pthread_cond_broadcast(&bench->cond);
+    pthread_mutex_unlock(&bench->mutex);
+    waiter_shutdown(&bench->waiter);
+    for (int i = 0; i < consumers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    qsort(bench->latencies, handoffs, sizeof(double), compare_doubles);
+    long switches = (after.ru_nvcsw + after.ru_nivcsw) - (before.ru_nvcsw + before.ru_nivcsw);
+    printf("  %-7s gap %4d us: wakeup p50 %6.1f us, p99 %7.1f us, %.2f context switches per handoff\n", bench->use_condvar ? "condvar" : "waiter", gap_us,
+           bench->latencies[handoffs / 2], bench->latencies[(int)(handoffs * 0.99)], (double)switches / handoffs);
+}
+
+void waiter_benchmark(int handoffs) {
+    int consumers = cook_pool.target;
+    WaiterBench bench = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+    bench.latencies = malloc(handoffs * sizeof(double));
+    printf("Waiter benchmark, %d handoffs to %d consumers:\n", handoffs, consumers);
+    int gaps[] = { 0, 200 };
+    for (int g = 0; g < 2; g++) {
+        for (int condvar = 1; condvar >= 0; condvar--) {
+            bench.use_condvar = condvar;
+            waiter_init(&bench.waiter);
+            waiter_bench_run(&bench, consumers, handoffs, gaps[g]);
+        }
+    }
+    exit(0);
+}
+
+void parse_fleet(const char* spec) {
+    while (*spec != '\0') {
+        FleetClass fleet_class;
+        int used = 0;
+        if (fleet_class_count == FLEET_CLASSES ||
+            sscanf(spec, "%d:%d:%d%n", &fleet_class.count, &fleet_class.speed, &fleet_class.capacity, &used) != 3 ||
+            fleet_class.count < 1 || fleet_class.speed < 1 || fleet_class.capacity < 1 || fleet_class.capacity > FLEET_MAX_CAPACITY ||
+            (spec[used] != ',' && spec[used] != '\0')) {
+            fprintf(stderr, "Invalid --fleet class: %s (COUNT:SPEED:CAPACITY, capacity 1-%d, at most %d classes)\n", spec, FLEET_MAX_CAPACITY, FLEET_CLASSES);
+            exit(1);
+        }
+        fleet_classes[fleet_class_count++] = fleet_class;
+        spec += used + (spec[used] == ',');
+    }
+}
+
+// Slots take the fleet's classes in order and wrap around, so a pool larger
+// than the fleet repeats the same mix.
+void moto_init(Moto* moto, int slot) {
+    memset(moto, 0, sizeof(*moto));
+    moto->capacity = MAX_DELIVERY_CAPACITY;
+    int total = 0;
+    for (int i = 0; i < fleet_class_count; i++) {
+        total += fleet_classes[i].count;
+    }
+    for (int i = 0, n = total > 0 ? slot % total : 0; i < fleet_class_count; n -= fleet_classes[i++].count) {
+        if (n < fleet_classes[i].count) {
+            moto->speed = fleet_classes[i].speed;
+            moto->capacity = fleet_classes[i].capacity;
+            break;
+        }
+    }
+}
+
+int moto_speed(const Moto* moto) {
+    return moto->speed > 0 ? moto->speed : current_config()->speed;
+}
+
+// With a fleet or the dispatcher, motos drive shop -> stops -> shop. The plain
+// shop keeps its old timing: each stop priced from the shop, no drive back.
+bool fleet_routes() {
+    return fleet_class_count > 0 || dispatch_fleet;
+}
+
+// Walks a moto's route, with orders[extra] tried at position at when extra is
+// not -1. Returns the sum of arrival times, the quantity insertion minimises.
+double route_walk(const DispatchMoto* moto, const DispatchOrder* orders, int extra, int at, double* trip_ms, double* arrivals) {
+    int x = origin_x, y = origin_y;
+    int stops = moto->count + (extra >= 0);
+    double t = moto->free_ms, sum = 0;
+    for (int i = 0, j = 0; i < stops; i++) {
+        const DispatchOrder* stop = extra >= 0 && i == at ? &orders[extra] : &orders[moto->stops[j++]];
+        t += (abs(stop->x - x) + abs(stop->y - y)) * 1000.0 / moto->speed;
+        sum += t;
+        if (arrivals != NULL) {
+            arrivals[i] = t;
+        }
+        x = stop->x;
+        y = stop->y;
+    }
+    t += (abs(origin_x - x) + abs(origin_y - y)) * 1000.0 / moto->speed;
+    if (trip_ms != NULL) {
+        *trip_ms = t - moto->free_ms;
+    }
+    return sum;
+}
+
+// Greedy insertion, oldest order first: each order goes to the moto and
+// position that add the least to the sum of arrival times, counting the delay
+// it causes to stops already planned after it. A moto still out starts its
+// route when it is due back, so a fast moto returning soon can beat a slow one
+// waiting at the shop.
+void dispatch_plan(DispatchOrder* orders, int order_count, DispatchMoto* plan, int moto_count) {
+    double base[DISPATCH_MAX_MOTOS];
+    for (int m = 0; m < moto_count; m++) {
+        base[m] = route_walk(&plan[m], orders, -1, 0, NULL, NULL);
+    }
+    for (int i = 0; i < order_count; i++) {
+        int best_moto = -1, best_at = 0;
+        double best = INFINITY;
+        for (int m = 0; m < moto_count; m++) {
+            for (int at = 0; plan[m].count < plan[m].capacity && at <= plan[m].count; at++) {
+                double cost = route_walk(&plan[m], orders, i, at, NULL, NULL) - base[m];
+                if (cost < best) {
+                    best = cost;
+                    best_moto = m;
+                    best_at = at;
+                }
+            }
+        }
+        if (best_moto == -1) {
+            break;  // Every candidate is full
+        }
+        DispatchMoto* moto = &plan[best_moto];
+        memmove(&moto->stops[best_at + 1], &moto->stops[best_at], (moto->count - best_at) * sizeof(int));
+        moto->stops[best_at] = i;
+        moto->count++;
+        base[best_moto] = route_walk(moto, orders, -1, 0, NULL, NULL);
+    }
+}
+
+// One planning round over the oldest ready orders and the motos parked or due
+// back within DISPATCH_HORIZON_MS. Only parked motos leave now; an order
+// planned onto a moto still out stays on the shelf and is planned again next
+// tick, by which time something better may have come back.
+void dispatch_tick() {
+    DispatchOrder orders[DISPATCH_MAX_ORDERS];
+    Order* shelf[DISPATCH_MAX_ORDERS];
+    DispatchMoto plan[DISPATCH_MAX_MOTOS];
+    int slots[DISPATCH_MAX_MOTOS];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    LOCK(&mutex_delivery);
+    LOCK(&delivery_queue.mutex);
+    int order_count = 0;
+    for (Order* order = delivery_queue.front; order != NULL && order_count < DISPATCH_MAX_ORDERS; order = order->next) {
+        shelf[order_count] = order;
+        orders[order_count++] = (DispatchOrder){ .x = order->x, .y = order->y, .ready_ms = -elapsed_ms(&order->ready_at, &now) };
+    }
+    int moto_count = 0, routes = 0;
+    LOCK(&mutex_workers);
+    for (int i = 0; order_count > 0 && i < courier_pool.capacity && moto_count < DISPATCH_MAX_MOTOS; i++) {
+        double free_ms = motos[i].at_shop ? 0 : elapsed_ms(&now, &motos[i].returns_at);
+        // Only a parked moto is free now: one just spawned, or back but not
+        // parked yet, would hold its planned orders back until the next tick
+        if (couriers[i].available || free_ms > DISPATCH_HORIZON_MS || (!motos[i].at_shop && free_ms <= 0)) {
+            continue;
+        }
+        plan[moto_count] = (DispatchMoto){ .speed = moto_speed(&motos[i]), .capacity = motos[i].capacity, .free_ms = free_ms > 0 ? free_ms : 0 };
+        slots[moto_count++] = i;
+    }
+    dispatch_plan(orders, order_count, plan, moto_count);
+    for (int m = 0; m < moto_count; m++) {
+        Moto* moto = &motos[slots[m]];
+        if (!moto->at_shop || plan[m].count == 0) {
+            continue;
+        }
+        double trip_ms;
+        route_walk(&plan[m], orders, -1, 0, &trip_ms, NULL);
+        for (int s = 0; s < plan[m].count; s++) {
+            Order* order = shelf[plan[m].stops[s]];
+            queue_remove(&delivery_queue, order);
+            atomic_store(&order->state, ORDER_OUT);
+            status_publish(order, STATUS_OUT);
+            moto->route[s] = order;
+        }
+        moto->route_count = plan[m].count;
+        moto->at_shop = false;
+        long trip_ns = (long)(trip_ms * 1000000);
+        moto->returns_at.tv_sec = now.tv_sec + (now.tv_nsec + trip_ns) / 1000000000L;
+        moto->returns_at.tv_nsec = (now.tv_nsec + trip_ns) % 1000000000L;
+        couriers[slots[m]].busy = true;  // Keeps a draining shop waiting until the route is driven
+        routes++;
+        dispatch_stops += plan[m].count;
+    }
+    UNLOCK(&mutex_workers);
+    UNLOCK(&delivery_queue.mutex);
+    dispatch_ticks++;
+    dispatch_routes += routes;
+    if (routes > 0) {
+        waiter_notify(&delivery_waiter, true);
+    }
+    UNLOCK(&mutex_delivery);
+}
+
+void* dispatcher_thread(void* arg) {
+    while (running) {
+        usleep(DISPATCH_TICK_MS * 1000);
+        dispatch_tick();
+    }
+    return NULL;
+}
+
+void report_dispatch() {
+    if (!dispatch_fleet) {
+        return;
+    }
+    LOCK(&mutex_delivery);
+    printf("Dispatcher: %ld routes over %ld ticks, %.2f orders per route\n", dispatch_routes, dispatch_ticks, dispatch_routes > 0 ? (double)dispatch_stops / dispatch_routes : 0);
+    fprintf(log_file, "Dispatcher: %ld routes over %ld ticks, %.2f orders per route\n", dispatch_routes, dispatch_ticks, dispatch_routes > 0 ? (double)dispatch_stops / dispatch_routes : 0);
+    UNLOCK(&mutex_delivery);
+    fflush(log_file);
+}
+
+// Runs one policy over the orders on a simulated clock, with the same streets
+// for both: legs between stops and the drive back. The free-for-all copies
+// delivery_thread: a parked moto takes the shelf's head and waits out the
+// batch window after every pick, holding mutex_delivery so no other moto can
+// load meanwhile. Fills each order's shelf-to-door time.
+void dispatch_simulate(DispatchOrder* orders, int count, const DispatchMoto* fleet, int moto_count, bool central, double* latencies, double* span_ms) {
+    DispatchMoto* motos_sim = malloc(moto_count * sizeof(DispatchMoto));
+    memcpy(motos_sim, fleet, moto_count * sizeof(DispatchMoto));
+    int* shelf = malloc(count * sizeof(int));
+    int shelf_count = 0, arrived = 0, taken = 0;
+    int loader = -1;
+    double load_next_ms = 0, last_ms = 0;
+    double batch_window_ms = current_config()->batch_window_ms;
+
+    for (double now = 0; taken < count; now += DISPATCH_TICK_MS) {
+        while (arrived < count && orders[arrived].ready_ms <= now) {
+            shelf[shelf_count++] = arrived++;
+        }
+        int departed_count = 0;
+        DispatchMoto* departing[DISPATCH_MAX_MOTOS];
+        if (central) {
+            DispatchOrder window[DISPATCH_MAX_ORDERS];
+            DispatchMoto plan[DISPATCH_MAX_MOTOS];
+            int slots[DISPATCH_MAX_MOTOS], window_count = shelf_count < DISPATCH_MAX_ORDERS ? shelf_count : DISPATCH_MAX_ORDERS, plan_count = 0;
+            for (int i = 0; i < window_count; i++) {
+                window[i] = orders[shelf[i]];
+            }
+            for (int m = 0; m < moto_count && plan_count < DISPATCH_MAX_MOTOS; m++) {
+                if (motos_sim[m].free_ms - now <= DISPATCH_HORIZON_MS) {
+                    plan[plan_count] = motos_sim[m];
+                    plan[plan_count].free_ms = motos_sim[m].free_ms > now ? motos_sim[m].free_ms - now : 0;
+                    plan[plan_count].count = 0;
+                    slots[plan_count++] = m;
+                }
+            }
+            dispatch_plan(window, window_count, plan, plan_count);
+            bool* gone = calloc(window_count, sizeof(bool));
+            for (int p = 0; p < plan_count; p++) {
+                if (motos_sim[slots[p]].free_ms > now || plan[p].count == 0) {
+                    continue;
+                }
+                DispatchMoto* moto = &motos_sim[slots[p]];
+                moto->count = plan[p].count;
+                for (int s = 0; s < plan[p].count; s++) {
+                    moto->stops[s] = shelf[plan[p].stops[s]];
+                    gone[plan[p].stops[s]] = true;
+                }
+                departing[departed_count++] = moto;
+            }
+            int kept = 0;
+            for (int i = 0; i < shelf_count; i++) {
+                if (i >= window_count || !gone[i]) {
+                    shelf[kept++] = shelf[i];
+                }
+            }
+            shelf_count = kept;
+            free(gone);
+        } else {
+            while (true) {
+                if (loader == -1) {
+                    for (int m = 0; m < moto_count && shelf_count > 0; m++) {
+                        if (motos_sim[m].free_ms <= now) {
+                            loader = m;
+                            motos_sim[m].count = 0;
+                            load_next_ms = now;
+                            break;
+                        }
+                    }
+                }
+                if (loader == -1 || load_next_ms > now) {
+                    break;
+                }
+                DispatchMoto* moto = &motos_sim[loader];
+                if (moto->count < moto->capacity && shelf_count > 0) {
+                    moto->stops[moto->count++] = shelf[0];
+                    memmove(shelf, shelf + 1, --shelf_count * sizeof(int));
+                    load_next_ms = now + batch_window_ms;
+                    if (batch_window_ms > 0) {
+                        break;
+                    }
+                } else {
+                    moto->free_ms = INFINITY;  // Out of the loader search until its trip is priced below
+                    departing[departed_count++] = moto;
+                    loader = -1;
+                    if (departed_count == DISPATCH_MAX_MOTOS) {
+                        break;
+                    }
+                }
+            }
+        }
+        for (int d = 0; d < departed_count; d++) {
+            DispatchMoto* moto = departing[d];
+            double arrivals[FLEET_MAX_CAPACITY], trip_ms;
+            moto->free_ms = now;
+            route_walk(moto, orders, -1, 0, &trip_ms, arrivals);
+            for (int s = 0; s < moto->count; s++) {
+                latencies[taken++] = arrivals[s] - orders[moto->stops[s]].ready_ms;
+                last_ms = arrivals[s] > last_ms ? arrivals[s] : last_ms;
+            }
+            moto->free_ms = now + trip_ms;
+            moto->count = 0;
+        }
+    }
+    *span_ms = last_ms - orders[0].ready_ms;
+    free(shelf);
+    free(motos_sim);
+}
+
+// Orders land on the shelf as a Poisson stream at a few multiples of what the
+// fleet could carry one order per trip; locations are uniform over a
+// DISPATCH_BENCH_GRID square. Both policies see the same orders and fleet.
+void dispatch_benchmark(int count) {
+    int moto_count = courier_pool.target;
+    if (moto_count > DISPATCH_MAX_MOTOS) {
+        moto_count = DISPATCH_MAX_MOTOS;
+    }
+    DispatchMoto fleet[DISPATCH_MAX_MOTOS];
+    double speed_sum = 0;
+    for (int m = 0; m < moto_count; m++) {
+        Moto moto;
+        moto_init(&moto, m);
+        fleet[m] = (DispatchMoto){ .speed = moto_speed(&moto), .capacity = moto.capacity };
+        speed_sum += fleet[m].speed;
+    }
+    DispatchOrder* orders = malloc(count * sizeof(DispatchOrder));
+    double* latencies = malloc(count * sizeof(double));
+    unsigned int seed = 42;
+    double distance_sum = 0;
+    for (int i = 0; i < count; i++) {
+        orders[i].x = rand_r(&seed) % DISPATCH_BENCH_GRID;
+        orders[i].y = rand_r(&seed) % DISPATCH_BENCH_GRID;
+        distance_sum += abs(orders[i].x - origin_x) + abs(orders[i].y - origin_y);
+    }
+    double single_rate = speed_sum / (2 * distance_sum / count) * 3600;  // Orders per hour, one per round trip
+    printf("Dispatch benchmark, %d orders, %d motos, batch window %d ms, single-order capacity %.0f orders/h:\n", count, moto_count, current_config()->batch_window_ms, single_rate);
+
+    double loads[] = { 0.8, 1.5, 3.0 };
+    for (int l = 0; l < 3; l++) {
+        unsigned int arrival_seed = 7;
+        double t = 0;
+        for (int i = 0; i < count; i++) {
+            orders[i].ready_ms = t;
+            t += -log((rand_r(&arrival_seed) + 1.0) / (RAND_MAX + 2.0)) * 3600000.0 / (loads[l] * single_rate);
+        }
+        for (int central = 0; central <= 1; central++) {
+            double span_ms;
+            dispatch_simulate(orders, count, fleet, moto_count, central, latencies, &span_ms);
+            qsort(latencies, count, sizeof(double), compare_doubles);
+            printf("  load %.1fx %-6s: %7.0f deliveries/h, p50 %6.1f s, p95 %6.1f s\n", loads[l], central ? "fleet" : "queue",
+                   count * 3600000.0 / span_ms, latencies[count / 2] / 1000, latencies[(int)ceil(count * 0.95) - 1] / 1000);
+        }
+    }
+    free(orders);
+    free(latencies);
+    exit(0);
+}
+
+void thank_most_orders(Worker* workers, int size, const char* role) {
+    int max_orders = 0;
+    for (int i = 0; i < size; i++) {
+        if (workers[i].spawned && workers[i].orders_processed > max_orders) {
+            max_orders = workers[i].orders_processed;
+        }
+    }
+
+    for (int i = 0; i < size; i++) {
+        if (workers[i].spawned && workers[i].orders_processed == max_orders) {
+            printf("Thanks %s %d (Orders: %d)\n", role, workers[i].id, workers[i].orders_processed);
+            fprintf(log_file, "Thanks %s %d (Orders: %d)\n", role, workers[i].id, workers[i].orders_processed);
+        }
+    }
+    fflush(log_file);
+}
+
+void enqueue(OrderQueue* queue, Order* order) {
+    order->next = NULL;  // Orders move between queues, drop the old link
+    order->prev = queue->rear;
+    if (queue->rear == NULL) {
+        queue->front = queue->rear = order;
+    } else {
+        queue->rear->next = order;
+        queue->rear = order;
+    }
+    queue->size++;
+}
+
+Order* dequeue(OrderQueue* queue) {
+    if (queue->front == NULL) {
+        return NULL;
+    }
+    Order* temp = queue->front;
+    queue->front = queue->front->next;
+    if (queue->front == NULL) {
+        queue->rear = NULL;
+    } else {
+        queue->front->prev = NULL;
+    }
+    queue->size--;
+    return temp;
+}
+
+// Unlinks an order from anywhere in the queue
+void queue_remove(OrderQueue* queue, Order* order) {
+    if (order->prev != NULL) {
+        order->prev->next = order->next;
+    } else {
+        queue->front = order->next;
+    }
+    if (order->next != NULL) {
+        order->next->prev = order->prev;
+    } else {
+        queue->rear = order->prev;
+    }
+    order->next = order->prev = NULL;
+    queue->size--;
+}
+
+// Per-client sub-queues are drained by deficit round-robin: each visit to a
+// backlogged client adds its weight to its deficit, and every order costs one.
+void enqueue_fair(ClientInfo* client, Order* order) {
+    atomic_store(&order->state, ORDER_QUEUED);
+    enqueue(&client->pending, order);
+    order_queue.size++;
+}
+
+Order* dequeue_fair() {
+    if (order_queue.size == 0) {
+        return NULL;
+    }
+    LOCK(&mutex_clients);
+    Order* order = NULL;
+    while (order == NULL) {
+        ClientInfo* client = &clients[drr_cursor];
+        if (client->pending.size > 0 && client->deficit >= 1) {
+            client->deficit--;
+            order = dequeue(&client->pending);
+            if (client->pending.size == 0) {
+                client->deficit = 0;
+            }
+        } else {
+            if (client->pending.size == 0) {
+                client->deficit = 0;
+            }
+            drr_cursor = (drr_cursor + 1) % client_count;
+            if (clients[drr_cursor].pending.size > 0) {
+                clients[drr_cursor].deficit += clients[drr_cursor].weight;
+            }
+        }
+    }
+    UNLOCK(&mutex_clients);
+    order_queue.size--;
+    atomic_store(&order->state, ORDER_COOKING);
+    status_publish(order, STATUS_COOKING);
+    return order;
+}
+
+// A client may hold at most its weighted share of MAX_ORDERS among the
+// clients that are backlogged or have recently placed an order.
+bool admit_order(ClientInfo* client) {
+    if (order_queue.size >= MAX_ORDERS) {
+        return false;
+    }
+    time_t now = time(NULL);
+    LOCK(&mutex_clients);
+    int active_weight = 0;
+    for (int i = 0; i < client_count; i++) {
+        if (&clients[i] == client || clients[i].pending.size > 0 || now - clients[i].last_seen <= CLIENT_ACTIVE_WINDOW) {
+            active_weight += clients[i].weight;
+        }
+    }
+    int share = MAX_ORDERS * client->weight / active_weight;
+    bool admitted = client->pending.size < (share > 0 ? share : 1);
+    UNLOCK(&mutex_clients);
+    return admitted;
+}
+
+int client_weight(pid_t pid) {
+    for (int i = 0; i < weight_override_count; i++) {
+        if (weight_overrides[i].pid == pid) {
+            return weight_overrides[i].weight;
+        }
+    }
+    return default_weight;
+}
+
+void parse_options(int argc, char *argv[]) {
+    for (int i = 5; i < argc; i++) {
+        int pid, weight;
+        if (sscanf(argv[i], "--default-weight=%d", &weight) == 1 && weight > 0) {
+            default_weight = weight;
+        } else if (sscanf(argv[i], "--weight=%d:%d", &pid, &weight) == 2 && weight > 0) {
+            if (weight_override_count < MAX_CLIENTS) {
+                weight_overrides[weight_override_count].pid = pid;
+                weight_overrides[weight_override_count].weight = weight;
+                weight_override_count++;
+            }
+        } else if (sscanf(argv[i], "--cook-min=%d", &cook_pool.min) == 1) {
+        } else if (sscanf(argv[i], "--cook-max=%d", &cook_pool.max) == 1) {
+        } else if (sscanf(argv[i], "--courier-min=%d", &courier_pool.min) == 1) {
+        } else if (sscanf(argv[i], "--courier-max=%d", &courier_pool.max) == 1) {
+        } else if (sscanf(argv[i], "--scale-depth=%d", &scale_depth) == 1) {
+        } else if (sscanf(argv[i], "--scale-wait=%d", &scale_wait_ms) == 1) {
+        } else if (sscanf(argv[i], "--scale-cooldown=%d", &scale_cooldown) == 1) {
+        } else if (sscanf(argv[i], "--scale-idle=%d", &scale_idle) == 1) {
+        } else if (strncmp(argv[i], "--config=", 9) == 0) {
+            config_path = argv[i] + 9;
+        } else if (strncmp(argv[i], "--upgrade-socket=", 17) == 0) {
+            upgrade_socket_path = argv[i] + 17;
+        } else if (sscanf(argv[i], "--origin=%d,%d", &origin_x, &origin_y) == 2) {
+        } else if (strncmp(argv[i], "--unix-socket=", 14) == 0) {
+            unix_socket_path = argv[i] + 14;
+        } else if (strncmp(argv[i], "--takeover=", 11) == 0) {
+            takeover_path = argv[i] + 11;
+        } else if (strncmp(argv[i], "--journal=", 10) == 0) {
+            journal_path = argv[i] + 10;
+        } else if (sscanf(argv[i], "--journal-bench=%d", &journal_bench_rate) == 1) {
+        } else if (sscanf(argv[i], "--metrics-port=%d", &metrics_port) == 1) {
+        } else if (strcmp(argv[i], "--backend=epoll") == 0 || strcmp(argv[i], "--backend=io_uring") == 0) {
+            backend_name = argv[i] + 10;
+        } else if (sscanf(argv[i], "--fibers=%d", &fiber_carriers) == 1) {
+        } else if (strncmp(argv[i], "--cpus=", 7) == 0 || strncmp(argv[i], "--sched=", 8) == 0 || strncmp(argv[i], "--nice=", 7) == 0) {
+            parse_placement(argv[i]);
+        } else if (sscanf(argv[i], "--placement-bench=%d", &placement_bench_seconds) == 1) {
+        } else if (sscanf(argv[i], "--waiter-bench=%d", &waiter_bench_handoffs) == 1) {
+        } else if (strncmp(argv[i], "--record=", 9) == 0) {
+            trace_open(argv[i] + 9);
+        } else if (strncmp(argv[i], "--fleet=", 8) == 0) {
+            parse_fleet(argv[i] + 8);
+        } else if (strcmp(argv[i], "--dispatch=queue") == 0 || strcmp(argv[i], "--dispatch=fleet") == 0) {
+            dispatch_fleet = strcmp(argv[i] + 11, "fleet") == 0;
+        } else if (sscanf(argv[i], "--dispatch-bench=%d", &dispatch_bench_orders) == 1) {
+        } else if (sscanf(argv[i], "--prep-batch=%d", &prep_batch) == 1) {
+            if (prep_batch < 1 || prep_batch > PREP_BATCH_MAX) {
+                fprintf(stderr, "--prep-batch must be between 1 and %d\n", PREP_BATCH_MAX);
+                exit(1);
+            }
+        } else if (sscanf(argv[i], "--prep-bench=%d", &prep_bench_orders) == 1) {
+        } else if (sscanf(argv[i], "--prep-cache=%d", &prep_cache_entries) == 1) {
+        } else if (strcmp(argv[i], "--kitchen=monolithic") == 0 || strcmp(argv[i], "--kitchen=staged") == 0) {
+            kitchen_staged = strcmp(argv[i] + 10, "staged") == 0;
+        } else if (sscanf(argv[i], "--kitchen-bench=%d", &kitchen_bench_orders) == 1) {
+        } else if (sscanf(argv[i], "--status-bench=%d", &status_bench_seconds) == 1) {
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+}
+
+double elapsed_ms(struct timespec* from, struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Jain's index over weight-normalised deliveries: 1.0 means every client got
+// exactly its weighted share of the cooks.
+void report_fairness() {
+    double sum = 0, sum_squares = 0;
+    int n = 0;
+    for (int i = 0; i < client_count; i++) {
+        ClientInfo* client = &clients[i];
+        int samples = client->latency_count < LATENCY_SAMPLES ? client->latency_count : LATENCY_SAMPLES;
+        double p99 = 0;
+        if (samples > 0) {
+            double sorted[LATENCY_SAMPLES];
+            memcpy(sorted, client->latencies, samples * sizeof(double));
+            qsort(sorted, samples, sizeof(double), compare_doubles);
+            p99 = sorted[(int)ceil(samples * 0.99) - 1];
+        }
+        printf("Client PID %d (weight %d): delivered %d, p99 latency %.1f ms\n", client->pid, client->weight, client->delivered, p99);
+        fprintf(log_file, "Client PID %d (weight %d): delivered %d, p99 latency %.1f ms\n", client->pid, client->weight, client->delivered, p99);
+        double share = (double)client->delivered / client->weight;
+        sum += share;
+        sum_squares += share * share;
+        n++;
+    }
+    if (n > 0 && sum_squares > 0) {
+        printf("Jain's fairness index: %.3f\n", sum * sum / (n * sum_squares));
+        fprintf(log_file, "Jain's fairness index: %.3f\n", sum * sum / (n * sum_squares));
+    }
+    fflush(log_file);
 }
 
 void cleanup_queue(OrderQueue* queue) {
-    pthread_mutex_lock(&queue->mutex);
+    LOCK(&queue->mutex);
     while (queue->front != NULL) {
         Order* temp = dequeue(queue);
-        close(temp->client_socket);
+        connection_release(temp->conn);
         free(temp);
     }
-    pthread_mutex_unlock(&queue->mutex);
+    UNLOCK(&queue->mutex);
 }
 
 void cleanup_resources() {
-    cleanup_queue(&order_queue);
+    for (int i = 0; i < client_count; i++) {
+        cleanup_queue(&clients[i].pending);
+        pthread_mutex_destroy(&clients[i].pending.mutex);
+    }
     cleanup_queue(&delivery_queue);
-    for (int i = 0; i < cook_thread_pool_size; i++) {
+    prep_cache_clear();
+    for (int i = 0; i < cook_pool.capacity; i++) {
         pthread_cond_destroy(&cooks[i].cond);
     }
-    for (int i = 0; i < delivery_thread_pool_size; i++) {
+    for (int i = 0; i < courier_pool.capacity; i++) {
         pthread_cond_destroy(&couriers[i].cond);
     }
+    free(atomic_load(&shop_config));
+    while (retired_configs != NULL) {
+        ShopConfig* next = retired_configs->retired_next;
+        free(retired_configs);
+        retired_configs = next;
+    }
     free(cooks);
     free(couriers);
     pthread_mutex_destroy(&mutex_orders);
@@ -541,9 +6243,10 @@ void cleanup_resources() {
     pthread_mutex_destroy(&mutex_delivery);
     pthread_mutex_destroy(&mutex_workers);
     pthread_mutex_destroy(&mutex_clients);
-    pthread_cond_destroy(&cond_orders);
     pthread_cond_destroy(&cond_oven);
-    pthread_cond_destroy(&cond_delivery);
     pthread_mutex_destroy(&order_queue.mutex);
     pthread_mutex_destroy(&delivery_queue.mutex);
+    if (trace_file != NULL) {
+        fclose(trace_file);
+    }
 }
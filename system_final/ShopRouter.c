@@ -0,0 +1,610 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define MAX_SHARDS 16
+#define VIRTUAL_NODES 64
+#define ROUTER_BUFFER 4096
+#define EPOLL_BATCH 64
+#define IN_FLIGHT_SLOTS 4096
+#define LATENCY_SAMPLES 65536
+#define SHM_RING_SLOTS 1024
+#define SHM_HELLO -1
+#define ORDER_CANCEL -2
+#define ORDER_STATUS -3
+#define SHARD_TAG 1
+#define CONTROL_TAG 2
+#define CONTROL_PENDING 1024
+
+// Must match OrderMessage and the shared-memory layout in PideShop.c
+typedef struct __attribute__((packed)) {
+    int32_t number_of_clients;
+    int32_t pid;
+    int32_t x, y;
+    int32_t item;
+} OrderMessage;
+
+enum { SHM_PLACED, SHM_REJECTED, SHM_DELIVERED, SHM_CANCELLED, SHM_CANCEL_LATE };
+enum { STATUS_UNKNOWN };
+
+typedef struct ClientConnection ClientConnection;
+
+// Must match StatusReply in PideShop.c
+typedef struct __attribute__((packed)) {
+    int32_t order_id;
+    int32_t state;
+    int32_t age_ms;
+    int32_t ready_ms;
+    int32_t out_ms;
+    int32_t done_ms;
+} StatusReply;
+
+typedef struct {
+    int32_t order_id;
+    int32_t state;
+    uint32_t slot;  // Order ring position a placed/rejected answer is for
+} ShmStatus;
+
+typedef struct {
+    _Atomic uint32_t head __attribute__((aligned(64)));
+    _Atomic uint32_t tail __attribute__((aligned(64)));
+} ShmRing;
+
+typedef struct {
+    ShmRing order_ring;
+    ShmRing status_ring;
+    OrderMessage orders[SHM_RING_SLOTS];
+    ShmStatus status[SHM_RING_SLOTS];
+} ShmRegion;
+
+// A cancel or status query forwarded to a shop, answered by the reply that
+// echoes its shop order id. client is NULL once the client hung up.
+typedef struct {
+    int32_t order_id;
+    ClientConnection* client;
+} PendingControl;
+
+// One PideShop instance, reached through its --unix-socket listener with the
+// shared-memory transport so the router also hears about every delivery.
+// Cancels and status queries go over a second, plain connection, on which
+// the shop answers every one with a StatusReply.
+typedef struct {
+    const char* path;
+    int sock;
+    int control;
+    char replies[ROUTER_BUFFER];
+    int replies_used;
+    PendingControl pending[CONTROL_PENDING];
+    int pending_count;
+    ShmRegion* region;
+    int to_shop, to_router;
+    double origin_x, origin_y;
+    long cells;
+    // Forward times by order ring position; a placed/rejected answer names
+    // the position it is for. The window counts orders not answered yet.
+    struct timespec in_flight[IN_FLIGHT_SLOTS];
+    unsigned in_flight_head, in_flight_tail;
+    // Forward time by shop order id, filled in when the order is placed
+    struct timespec* placed_at;
+    int placed_capacity;
+    bool doorbell_pending;
+    long forwarded, placed, rejected, delivered;
+} Shard;
+
+typedef struct {
+    uint32_t hash;
+    int shard;
+} RingPoint;
+
+struct ClientConnection {
+    int fd;
+    int used;
+    char buffer[ROUTER_BUFFER];
+};
+
+Shard shards[MAX_SHARDS];
+int shard_count = 0;
+int grid_p, grid_q;
+int tile_columns, tile_rows;
+bool route_by_hash = false;
+RingPoint hash_ring[MAX_SHARDS * VIRTUAL_NODES];
+long expected_orders = 0;
+
+double latencies[LATENCY_SAMPLES];
+long latency_count = 0;
+struct timespec first_order_at, last_delivery_at;
+bool first_order_seen = false;
+long control_routed = 0, control_answered = 0;
+volatile sig_atomic_t running = 1;
+
+void handle_sigint(int sig);
+void parse_options(int argc, char *argv[]);
+uint32_t mix32(uint32_t key);
+int compare_ring_points(const void* a, const void* b);
+void build_hash_ring();
+int route(int x, int y);
+void compute_origins();
+int connect_socket(const char* path);
+void connect_shard(Shard* shard);
+void forward_order(OrderMessage* message);
+void drain_shard(Shard* shard);
+void read_client(ClientConnection* client, bool* open);
+void route_control(ClientConnection* client, OrderMessage* message);
+void drain_control(Shard* shard);
+void forget_client(ClientConnection* client);
+void answer_unknown(ClientConnection* client, OrderMessage* message);
+double elapsed_ms(struct timespec* from, struct timespec* to);
+int compare_doubles(const void* a, const void* b);
+void report_cluster();
+
+int main(int argc, char *argv[]) {
+    if (argc < 5) {
+        fprintf(stderr, "Usage: %s [portnumber] [p] [q] [shardSocket,shardSocket,...] [--route=grid|hash] [--orders=N]\n", argv[0]);
+        fprintf(stderr, "Cancels and status queries take router order ids: shop order id * %d + shard\n", MAX_SHARDS);
+        exit(1);
+    }
+    int port = atoi(argv[1]);
+    grid_p = atoi(argv[2]);
+    grid_q = atoi(argv[3]);
+    for (char* path = strtok(argv[4], ","); path != NULL && shard_count < MAX_SHARDS; path = strtok(NULL, ",")) {
+        shards[shard_count++].path = path;
+    }
+    parse_options(argc, argv);
+    if (shard_count == 0 || grid_p <= 0 || grid_q <= 0) {
+        fprintf(stderr, "Need at least one shard and a non-empty grid\n");
+        exit(1);
+    }
+
+    signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Spatial tiles as close to square as the shard count allows
+    tile_columns = (int)ceil(sqrt(shard_count));
+    tile_rows = (shard_count + tile_columns - 1) / tile_columns;
+    build_hash_ring();
+    compute_origins();
+    for (int i = 0; i < shard_count; i++) {
+        printf("Shard %d: %s, %ld cells, start it with --origin=%d,%d\n", i, shards[i].path, shards[i].cells, (int)lround(shards[i].origin_x), (int)lround(shards[i].origin_y));
+    }
+    fflush(stdout);
+    for (int i = 0; i < shard_count; i++) {
+        connect_shard(&shards[i]);
+    }
+
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in server_addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY };
+    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 || listen(server_socket, 64) == -1) {
+        perror("Router socket setup failed");
+        exit(1);
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event);
+    for (int i = 0; i < shard_count; i++) {
+        event.data.u64 = ((uint64_t)i << 2) | SHARD_TAG;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shards[i].to_router, &event);
+        event.data.u64 = ((uint64_t)i << 2) | CONTROL_TAG;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shards[i].control, &event);
+    }
+    printf("ShopRouter routing by %s to %d shops on port %d...\n", route_by_hash ? "consistent hash" : "grid tile", shard_count, port);
+
+    while (running) {
+        struct epoll_event events[EPOLL_BATCH];
+        int ready = epoll_wait(epoll_fd, events, EPOLL_BATCH, 500);
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                int client_socket;
+                while ((client_socket = accept4(server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                    ClientConnection* client = malloc(sizeof(ClientConnection));
+                    client->fd = client_socket;
+                    client->used = 0;
+                    struct epoll_event client_event = { .events = EPOLLIN, .data.ptr = client };
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &client_event);
+                }
+            } else if (events[i].data.u64 & SHARD_TAG) {
+                drain_shard(&shards[events[i].data.u64 >> 2]);
+            } else if (events[i].data.u64 & CONTROL_TAG) {
+                drain_control(&shards[events[i].data.u64 >> 2]);
+            } else {
+                ClientConnection* client = events[i].data.ptr;
+                bool open = true;
+                read_client(client, &open);
+                if (!open) {
+                    forget_client(client);
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+                    close(client->fd);
+                    free(client);
+                }
+            }
+        }
+        // One doorbell per shard per wakeup, however many orders it got
+        for (int i = 0; i < shard_count; i++) {
+            if (shards[i].doorbell_pending) {
+                uint64_t one = 1;
+                if (write(shards[i].to_shop, &one, sizeof(one)) == -1) {
+                    perror("Doorbell write failed");
+                }
+                shards[i].doorbell_pending = false;
+            }
+        }
+        if (expected_orders > 0) {
+            long finished = 0;
+            for (int i = 0; i < shard_count; i++) {
+                finished += shards[i].delivered + shards[i].rejected;
+            }
+            if (finished >= expected_orders) {
+                running = 0;
+            }
+        }
+    }
+
+    report_cluster();
+    close(server_socket);
+    for (int i = 0; i < shard_count; i++) {
+        munmap(shards[i].region, sizeof(ShmRegion));
+        close(shards[i].sock);
+        close(shards[i].control);
+        close(shards[i].to_shop);
+        close(shards[i].to_router);
+        free(shards[i].placed_at);
+    }
+    close(epoll_fd);
+    return 0;
+}
+
+void handle_sigint(int sig) {
+    running = 0;
+}
+
+void parse_options(int argc, char *argv[]) {
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "--route=grid") == 0) {
+            route_by_hash = false;
+        } else if (strcmp(argv[i], "--route=hash") == 0) {
+            route_by_hash = true;
+        } else if (sscanf(argv[i], "--orders=%ld", &expected_orders) == 1) {
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+}
+
+uint32_t mix32(uint32_t key) {
+    key ^= key >> 16;
+    key *= 0x7feb352d;
+    key ^= key >> 15;
+    key *= 0x846ca68b;
+    key ^= key >> 16;
+    return key;
+}
+
+int compare_ring_points(const void* a, const void* b) {
+    uint32_t x = ((const RingPoint*)a)->hash, y = ((const RingPoint*)b)->hash;
+    return (x > y) - (x < y);
+}
+
+// Every shard owns VIRTUAL_NODES points on the ring, so adding a shard moves
+// only about 1/N of the locations.
+void build_hash_ring() {
+    for (int i = 0; i < shard_count; i++) {
+        for (int v = 0; v < VIRTUAL_NODES; v++) {
+            hash_ring[i * VIRTUAL_NODES + v].hash = mix32((uint32_t)(i * VIRTUAL_NODES + v) * 2654435761u + 1);
+            hash_ring[i * VIRTUAL_NODES + v].shard = i;
+        }
+    }
+    qsort(hash_ring, shard_count * VIRTUAL_NODES, sizeof(RingPoint), compare_ring_points);
+}
+
+int route(int x, int y) {
+    if (route_by_hash) {
+        uint32_t key = mix32(((uint32_t)x << 16) ^ (uint32_t)y);
+        int low = 0, high = shard_count * VIRTUAL_NODES;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (hash_ring[middle].hash < key) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return hash_ring[low % (shard_count * VIRTUAL_NODES)].shard;
+    }
+    int column = x * tile_columns / grid_p;
+    int row = y * tile_rows / grid_q;
+    column = column < 0 ? 0 : column >= tile_columns ? tile_columns - 1 : column;
+    row = row < 0 ? 0 : row >= tile_rows ? tile_rows - 1 : row;
+    int shard = row * tile_columns + column;
+    return shard < shard_count ? shard : shard_count - 1;  // The last row may be short
+}
+
+// Each shop's origin is the centroid of the cells routed to it, which keeps
+// the expected |dx|+|dy| drive small for either routing mode.
+void compute_origins() {
+    double sum_x[MAX_SHARDS] = { 0 }, sum_y[MAX_SHARDS] = { 0 };
+    for (int x = 0; x < grid_p; x++) {
+        for (int y = 0; y < grid_q; y++) {
+            int shard = route(x, y);
+            sum_x[shard] += x;
+            sum_y[shard] += y;
+            shards[shard].cells++;
+        }
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (shards[i].cells > 0) {
+            shards[i].origin_x = sum_x[i] / shards[i].cells;
+            shards[i].origin_y = sum_y[i] / shards[i].cells;
+        }
+    }
+}
+
+int connect_socket(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "Cannot reach shop at %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return sock;
+}
+
+void connect_shard(Shard* shard) {
+    shard->sock = connect_socket(shard->path);
+    shard->control = connect_socket(shard->path);
+    int fds[3];
+    fds[0] = memfd_create("shoprouter", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    fds[1] = eventfd(0, EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1 || ftruncate(fds[0], sizeof(ShmRegion)) == -1 ||
+        fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == -1) {  // The shop refuses a resizable region
+        perror("Shared memory setup failed");
+        exit(1);
+    }
+    shard->region = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (shard->region == MAP_FAILED) {
+        perror("Shared memory mapping failed");
+        exit(1);
+    }
+
+    OrderMessage hello = { SHM_HELLO, getpid(), 0, 0, 0 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(shard->sock, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+        perror("Shared memory handshake failed");
+        exit(1);
+    }
+    close(fds[0]);
+    shard->to_shop = fds[1];
+    shard->to_router = fds[2];
+    shard->placed_capacity = 1024;
+    shard->placed_at = calloc(shard->placed_capacity, sizeof(struct timespec));
+}
+
+// A full ring or in-flight window stalls the router on that shop until it
+// catches up; orders are never dropped here.
+void forward_order(OrderMessage* message) {
+    Shard* shard = &shards[route(message->x, message->y)];
+    ShmRing* ring = &shard->region->order_ring;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == SHM_RING_SLOTS
+           || shard->in_flight_tail - shard->in_flight_head == IN_FLIGHT_SLOTS) {
+        uint64_t one = 1;
+        if (write(shard->to_shop, &one, sizeof(one)) == -1) {
+            perror("Doorbell write failed");
+        }
+        struct pollfd doorbell = { .fd = shard->to_router, .events = POLLIN };
+        poll(&doorbell, 1, 1);
+        drain_shard(shard);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!first_order_seen) {
+        first_order_at = now;
+        first_order_seen = true;
+    }
+    shard->in_flight[tail % IN_FLIGHT_SLOTS] = now;
+    shard->in_flight_tail++;
+    shard->region->orders[tail % SHM_RING_SLOTS] = *message;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    shard->forwarded++;
+    shard->doorbell_pending = true;
+}
+
+void drain_shard(Shard* shard) {
+    uint64_t rings;
+    if (read(shard->to_router, &rings, sizeof(rings)) == -1 && errno != EAGAIN) {
+        perror("Doorbell read failed");
+    }
+    ShmRing* ring = &shard->region->status_ring;
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        ShmStatus status = shard->region->status[head % SHM_RING_SLOTS];
+        if (status.state == SHM_PLACED || status.state == SHM_REJECTED) {
+            struct timespec forwarded_at = shard->in_flight[status.slot % IN_FLIGHT_SLOTS];
+            shard->in_flight_head++;
+            if (status.state == SHM_REJECTED) {
+                shard->rejected++;
+                continue;
+            }
+            shard->placed++;
+            while (status.order_id >= shard->placed_capacity) {
+                shard->placed_at = realloc(shard->placed_at, 2 * shard->placed_capacity * sizeof(struct timespec));
+                memset(shard->placed_at + shard->placed_capacity, 0, shard->placed_capacity * sizeof(struct timespec));
+                shard->placed_capacity *= 2;
+            }
+            shard->placed_at[status.order_id] = forwarded_at;
+        } else if (status.order_id > 0 && status.order_id < shard->placed_capacity) {
+            clock_gettime(CLOCK_MONOTONIC, &last_delivery_at);
+            latencies[latency_count++ % LATENCY_SAMPLES] = elapsed_ms(&shard->placed_at[status.order_id], &last_delivery_at);
+            shard->delivered++;
+        }
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    // The shop pauses on a full status ring; orders still queued need a ring
+    ShmRing* orders = &shard->region->order_ring;
+    if (atomic_load_explicit(&orders->head, memory_order_acquire) != atomic_load_explicit(&orders->tail, memory_order_relaxed)) {
+        shard->doorbell_pending = true;
+    }
+}
+
+// Same framing as PideShop: whole frames are forwarded, a partial one waits
+// in the buffer for the rest.
+void read_client(ClientConnection* client, bool* open) {
+    ssize_t n = recv(client->fd, client->buffer + client->used, ROUTER_BUFFER - client->used, 0);
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        *open = false;
+        return;
+    }
+    if (n < 0) {
+        return;
+    }
+    client->used += n;
+    int offset = 0;
+    while (client->used - offset >= (int)sizeof(OrderMessage)) {
+        OrderMessage message;
+        memcpy(&message, client->buffer + offset, sizeof(message));
+        if (message.number_of_clients >= 0) {
+            forward_order(&message);
+        } else if (message.number_of_clients == ORDER_CANCEL || message.number_of_clients == ORDER_STATUS) {
+            route_control(client, &message);
+        }
+        offset += sizeof(OrderMessage);
+    }
+    memmove(client->buffer, client->buffer + offset, client->used - offset);
+    client->used -= offset;
+}
+
+// Shop order ids are per shard, so the router's clients name an order by
+// shop order id * MAX_SHARDS + shard. The frame goes to that shop with the
+// shop's own id and the client's pid, which the shop checks on a cancel.
+void route_control(ClientConnection* client, OrderMessage* message) {
+    int shard_index = message->x % MAX_SHARDS;
+    Shard* shard = &shards[shard_index];
+    if (message->x <= 0 || shard_index >= shard_count || shard->pending_count == CONTROL_PENDING) {
+        answer_unknown(client, message);
+        return;
+    }
+    OrderMessage forwarded = *message;
+    forwarded.x = message->x / MAX_SHARDS;
+    if (send(shard->control, &forwarded, sizeof(forwarded), MSG_NOSIGNAL) != sizeof(forwarded)) {
+        perror("Control forward failed");
+        answer_unknown(client, message);
+        return;
+    }
+    shard->pending[shard->pending_count++] = (PendingControl){ forwarded.x, client };
+    control_routed++;
+}
+
+// The shop answers in arrival order, so a reply goes to the oldest pending
+// frame for the order id it echoes, translated back to the router's id.
+void drain_control(Shard* shard) {
+    ssize_t n = recv(shard->control, shard->replies + shard->replies_used, ROUTER_BUFFER - shard->replies_used, MSG_DONTWAIT);
+    if (n == 0) {
+        fprintf(stderr, "Shop at %s closed its control connection\n", shard->path);
+        exit(1);
+    }
+    if (n < 0) {
+        return;
+    }
+    shard->replies_used += n;
+    int offset = 0;
+    while (shard->replies_used - offset >= (int)sizeof(StatusReply)) {
+        StatusReply reply;
+        memcpy(&reply, shard->replies + offset, sizeof(reply));
+        offset += sizeof(reply);
+        int match = 0;
+        while (match < shard->pending_count && shard->pending[match].order_id != reply.order_id) {
+            match++;
+        }
+        if (match == shard->pending_count) {
+            continue;
+        }
+        ClientConnection* client = shard->pending[match].client;
+        memmove(&shard->pending[match], &shard->pending[match + 1], (shard->pending_count - match - 1) * sizeof(PendingControl));
+        shard->pending_count--;
+        reply.order_id = reply.order_id * MAX_SHARDS + (int)(shard - shards);
+        if (client != NULL && send(client->fd, &reply, sizeof(reply), MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(reply)) {
+            perror("Control reply failed");
+        }
+    }
+    memmove(shard->replies, shard->replies + offset, shard->replies_used - offset);
+    shard->replies_used -= offset;
+}
+
+void forget_client(ClientConnection* client) {
+    for (int i = 0; i < shard_count; i++) {
+        for (int j = 0; j < shards[i].pending_count; j++) {
+            if (shards[i].pending[j].client == client) {
+                shards[i].pending[j].client = NULL;
+            }
+        }
+    }
+}
+
+// An id no shard can own gets the reply a shop gives for an id it has
+// never seen instead of silence.
+void answer_unknown(ClientConnection* client, OrderMessage* message) {
+    StatusReply reply = { message->x, STATUS_UNKNOWN, 0, -1, -1, -1 };
+    if (send(client->fd, &reply, sizeof(reply), MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(reply)) {
+        perror("Control reply failed");
+    }
+    control_answered++;
+}
+
+double elapsed_ms(struct timespec* from, struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void report_cluster() {
+    printf("\nCluster of %d shops (%s routing):\n", shard_count, route_by_hash ? "hash" : "grid");
+    long delivered = 0;
+    for (int i = 0; i < shard_count; i++) {
+        printf("Shard %d: forwarded %ld, placed %ld, rejected %ld, delivered %ld\n", i, shards[i].forwarded, shards[i].placed, shards[i].rejected, shards[i].delivered);
+        delivered += shards[i].delivered;
+    }
+    if (control_routed + control_answered > 0) {
+        printf("Cancels and status queries: %ld routed to shops, %ld answered as unknown\n", control_routed, control_answered);
+    }
+    if (delivered == 0 || !first_order_seen) {
+        return;
+    }
+    int samples = latency_count < LATENCY_SAMPLES ? latency_count : LATENCY_SAMPLES;
+    qsort(latencies, samples, sizeof(double), compare_doubles);
+    double seconds = elapsed_ms(&first_order_at, &last_delivery_at) / 1000.0;
+    printf("Cluster throughput: %.2f deliveries/s, p50 latency %.1f ms, p99 latency %.1f ms\n",
+           delivered / seconds, latencies[samples / 2], latencies[(int)(samples * 0.99)]);
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -9,44 +10,217 @@
 #include <sys/time.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <linux/fs.h>
 
 #define MAX_PATH 4096
+#define COPY_CHUNK (1L << 30)  // Most bytes asked of copy_file_range/sendfile per call
+#define SCAN_DEQUE_START 64
+#define SPLIT_DEFAULT_THRESHOLD (256L << 20)
+#define SPLIT_DEFAULT_CHUNK (64L << 20)
+#define URING_BUFFER_SIZE (64 * 1024)
+#define URING_DEFAULT_DEPTH 32
+#define URING_SQES_PER_FILE 4  // Two opens, a read and its linked write
+#define WAITER_SPIN_MIN 16
+#define WAITER_SPIN_START 256
+#define WAITER_SPIN_MAX 8192
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+typedef struct split_file split_file_t;
 
 typedef struct {
     char src_path[MAX_PATH];
     char dest_path[MAX_PATH];
+    split_file_t *split;  // Set when the item is one byte range of a large file
+    off_t offset, length;
 } file_pair_t;
 
+// A large file copied as several buffer items. The manager opens both ends
+// once; every chunk reads and writes at its own offsets through them.
+struct split_file {
+    int src_fd, dest_fd;
+    int chunks;
+    _Atomic int chunks_left;  // Whoever finishes the last one closes the file
+    _Atomic int failed;
+    _Atomic int path;         // Slowest path any chunk took; the file counts there
+};
+
+// Eventcount: spin briefly, then sleep on the futex word until notified
+typedef struct {
+    _Atomic uint32_t epoch;
+    _Atomic int waiting;
+    _Atomic int parked;
+    _Atomic int spin_limit;
+    int spin_max;
+    _Atomic int shutdown;
+} waiter_t;
+
+typedef struct {
+    char *src_path;
+    char *dest_path;
+} dir_item_t;
+
+// One per scanner. The owner pushes and pops at the bottom, so it walks its
+// part of the tree depth-first; idle scanners steal from the top, where the
+// oldest and usually biggest subtrees are.
+typedef struct {
+    pthread_mutex_t mutex;
+    dir_item_t *items;
+    int top, bottom, capacity;
+} dir_deque_t;
+
+// Tried in this order; each later one is the fallback for the one before.
+// COPY_URING is not in the chain: it replaces the worker loop itself.
+enum { COPY_REFLINK, COPY_RANGE, COPY_SENDFILE, COPY_BUFFERED, COPY_URING, COPY_PATHS };
+enum { URING_OP_OPEN_SRC, URING_OP_OPEN_DEST, URING_OP_READ, URING_OP_WRITE, URING_OP_CLOSE, URING_OPS };
+
+typedef struct {
+    int fd;
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    _Atomic unsigned *sq_head, *sq_tail;
+    unsigned sq_mask, sq_entries;
+    unsigned *sq_array;
+    unsigned to_submit;
+    _Atomic unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    char *buffers;  // Registered, URING_BUFFER_SIZE per slot
+} copy_ring_t;
+
+// A file in flight on a worker's ring. Slot i reads and writes through
+// registered buffer i and direct descriptors 2i (source) and 2i+1.
+typedef struct {
+    file_pair_t item;
+    off_t offset;
+    off_t end;                // Chunk end, -1 for a whole file
+    int pending;              // Requests of this round not completed yet
+    int src_open, dest_open;  // Direct descriptors still to close
+    int failed, closing;
+    int last_read, last_written;
+    unsigned read_length, write_length;
+} uring_slot_t;
+
 file_pair_t *buffer;
 int buffer_size;
 int buffer_count = 0;
 int done_flag = 0;
 
 pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t buffer_not_empty = PTHREAD_COND_INITIALIZER;
-pthread_cond_t buffer_not_full = PTHREAD_COND_INITIALIZER;
+waiter_t buffer_not_empty;
+waiter_t buffer_not_full;
 
-int num_regular_files = 0;
-int num_fifo_files = 0;
-int num_directories = 0;
-long total_bytes_copied = 0;
+_Atomic int num_regular_files = 0;
+_Atomic int num_fifo_files = 0;
+_Atomic int num_directories = 0;
+_Atomic int num_split_files = 0;
+_Atomic int num_chunks = 0;
+
+int scan_threads = 1;
+int scan_only = 0;  // Walk the tree and create directories, copy nothing
+dir_deque_t *scan_deques;
+_Atomic long dirs_pending = 0;  // Queued or being scanned; 0 ends the scan
+_Atomic long entries_scanned = 0;
+waiter_t dirs_available;
+double scan_seconds;
+_Atomic long total_bytes_copied = 0;
+
+const char *copy_path_names[COPY_PATHS] = { "reflink", "copy_file_range", "sendfile", "read/write", "io_uring" };
+const char *copy_path_options[COPY_PATHS] = { "reflink", "range", "sendfile", "buffered", "uring" };
+int copy_first_path = COPY_REFLINK;
+int uring_depth = URING_DEFAULT_DEPTH;  // Files in flight per worker with --copy=uring
+off_t split_threshold = SPLIT_DEFAULT_THRESHOLD;  // 0 never splits
+off_t chunk_size = SPLIT_DEFAULT_CHUNK;
+_Atomic int copy_path_unsupported[COPY_PATHS];  // Set the first time the filesystems refuse a path
+_Atomic int files_by_path[COPY_PATHS];
+_Atomic long bytes_by_path[COPY_PATHS];
 
 void handle_signal(int signal);
 void *manager_function(void *args);
-void traverse_directory(const char *source_dir, const char *dest_dir);
+void *scanner_function(void *args);
+void traverse_directory(int self, const char *source_dir, const char *dest_dir);
+void scan_push(int self, const char *src_path, const char *dest_path);
+int scan_pop(int self, dir_item_t *item);
 void *worker_function(void *args);
 void copy_file(const char *src_path, const char *dest_path);
-void add_to_buffer(const char *src_path, const char *dest_path);
-int get_from_buffer(char *src_path, char *dest_path);
+int copy_with(int path, int src_fd, int dest_fd, off_t offset, off_t length, off_t *copied, int chunked);
+void split_file(const char *src_path, const char *dest_path, off_t size);
+void copy_chunk(file_pair_t *item);
+void finish_chunk(split_file_t *split, const char *src_path, const char *dest_path, int failed);
+void note_chunk_path(split_file_t *split, int path);
+int parse_size(const char *text, off_t *size);
+int add_to_buffer(const char *src_path, const char *dest_path, split_file_t *split, off_t offset, off_t length);
+int get_from_buffer(file_pair_t *item, int block);
 void set_done_flag();
 int done_flag_set();
+void waiter_init(waiter_t *waiter);
+uint32_t waiter_prepare(waiter_t *waiter);
+void waiter_wait(waiter_t *waiter, uint32_t key);
+void waiter_notify(waiter_t *waiter);
+void waiter_cancel(waiter_t *waiter);
+void waiter_shutdown(waiter_t *waiter);
+int uring_worker();
+int ring_setup(copy_ring_t *ring, int depth);
+void ring_teardown(copy_ring_t *ring);
+struct io_uring_sqe *ring_get_sqe(copy_ring_t *ring, int slot, int op);
+int ring_enter(copy_ring_t *ring, unsigned wait_for);
+void ring_queue_chunk(copy_ring_t *ring, int slot, uring_slot_t *file);
+void ring_queue_write(copy_ring_t *ring, int slot, uring_slot_t *file, unsigned length, unsigned flags);
+void ring_queue_closes(copy_ring_t *ring, int slot, uring_slot_t *file);
+void ring_start_file(copy_ring_t *ring, int slot, uring_slot_t *file);
+int ring_advance(copy_ring_t *ring, int slot, uring_slot_t *file);
+void ring_complete(uring_slot_t *file, int op, int res);
 void print_usage_and_exit(const char *prog_name);
 void print_statistics(int num_workers, int buffer_size, struct timeval start, struct timeval end);
 
 int main(int argc, char *argv[]) {
-    if (argc != 5) {
+    if (argc < 5) {
         print_usage_and_exit(argv[0]);
     }
+    for (int i = 5; i < argc; i++) {
+        if (strncmp(argv[i], "--copy=", 7) == 0) {
+            for (copy_first_path = 0; copy_first_path < COPY_PATHS; copy_first_path++) {
+                if (strcmp(argv[i] + 7, copy_path_options[copy_first_path]) == 0) {
+                    break;
+                }
+            }
+            if (copy_first_path == COPY_PATHS) {
+                print_usage_and_exit(argv[0]);
+            }
+        } else if (strncmp(argv[i], "--chunk-size=", 13) == 0) {
+            if (!parse_size(argv[i] + 13, &chunk_size) || chunk_size <= 0) {
+                print_usage_and_exit(argv[0]);
+            }
+        } else if (strncmp(argv[i], "--split-threshold=", 18) == 0) {
+            if (!parse_size(argv[i] + 18, &split_threshold)) {
+                print_usage_and_exit(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--scan-only") == 0) {
+            scan_only = 1;
+        } else if (strncmp(argv[i], "--scan-threads=", 15) == 0) {
+            if (sscanf(argv[i] + 15, "%d", &scan_threads) != 1 || scan_threads <= 0) {
+                print_usage_and_exit(argv[0]);
+            }
+        } else if (sscanf(argv[i], "--uring-depth=%d", &uring_depth) != 1 || uring_depth <= 0) {
+            print_usage_and_exit(argv[0]);
+        }
+    }
 
     buffer_size = atoi(argv[1]);
     int num_workers = atoi(argv[2]);
@@ -62,6 +236,9 @@ int main(int argc, char *argv[]) {
         perror("Failed to allocate buffer");
         exit(EXIT_FAILURE);
     }
+    waiter_init(&buffer_not_empty);
+    waiter_init(&buffer_not_full);
+    waiter_init(&dirs_available);
 
     signal(SIGINT, handle_signal);
 
@@ -111,12 +288,69 @@ void *manager_function(void *args) {
     char *source_dir = argv[3];
     char *dest_dir = argv[4];
 
-    traverse_directory(source_dir, dest_dir);
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    scan_deques = calloc(scan_threads, sizeof(dir_deque_t));
+    for (int i = 0; i < scan_threads; i++) {
+        pthread_mutex_init(&scan_deques[i].mutex, NULL);
+    }
+    scan_push(0, source_dir, dest_dir);
+
+    // The manager is scanner 0; the others start out stealing from it
+    pthread_t scanners[scan_threads];
+    for (int i = 1; i < scan_threads; i++) {
+        if (pthread_create(&scanners[i], NULL, scanner_function, (void *)(intptr_t)i) != 0) {
+            perror("Failed to create scanner thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    scanner_function((void *)0);
+    for (int i = 1; i < scan_threads; i++) {
+        pthread_join(scanners[i], NULL);
+    }
+    gettimeofday(&end, NULL);
+    scan_seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    for (int i = 0; i < scan_threads; i++) {
+        free(scan_deques[i].items);
+        pthread_mutex_destroy(&scan_deques[i].mutex);
+    }
+    free(scan_deques);
     set_done_flag();
     return NULL;
 }
 
-void traverse_directory(const char *source_dir, const char *dest_dir) {
+void *scanner_function(void *args) {
+    int self = (intptr_t)args;
+    dir_item_t item;
+    while (1) {
+        if (!scan_pop(self, &item)) {
+            uint32_t key = waiter_prepare(&dirs_available);
+            if (atomic_load(&dirs_pending) == 0) {
+                waiter_cancel(&dirs_available);
+                break;
+            }
+            if (!scan_pop(self, &item)) {
+                waiter_wait(&dirs_available, key);
+                continue;
+            }
+            waiter_cancel(&dirs_available);
+        }
+        traverse_directory(self, item.src_path, item.dest_path);
+        free(item.src_path);
+        free(item.dest_path);
+        // Its subdirectories were counted before this one is let go, so the
+        // count only reaches 0 once the whole tree is done
+        if (atomic_fetch_sub(&dirs_pending, 1) == 1) {
+            waiter_shutdown(&dirs_available);
+        }
+    }
+    return NULL;
+}
+
+// Lists one directory: files go to the copy buffer, subdirectories onto
+// this scanner's deque for whoever gets to them first.
+void traverse_directory(int self, const char *source_dir, const char *dest_dir) {
     DIR *src_dir = opendir(source_dir);
     if (!src_dir) {
         perror("Failed to open source directory");
@@ -129,38 +363,91 @@ void traverse_directory(const char *source_dir, const char *dest_dir) {
         return;
     }
 
+    long entries = 0;
     struct dirent *entry;
     while ((entry = readdir(src_dir)) != NULL) {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
             continue;
         }
+        entries++;
 
         char src_path[MAX_PATH];
         char dest_path[MAX_PATH];
         snprintf(src_path, MAX_PATH, "%s/%s", source_dir, entry->d_name);
         snprintf(dest_path, MAX_PATH, "%s/%s", dest_dir, entry->d_name);
 
+        struct stat st;
         if (entry->d_type == DT_REG) {
             num_regular_files++;
-            add_to_buffer(src_path, dest_path);
+            if (scan_only) {
+                continue;
+            }
+            if (split_threshold > 0 && fstatat(dirfd(src_dir), entry->d_name, &st, 0) == 0 && st.st_size >= split_threshold) {
+                split_file(src_path, dest_path, st.st_size);
+            } else {
+                add_to_buffer(src_path, dest_path, NULL, 0, 0);
+            }
         } else if (entry->d_type == DT_FIFO) {
             num_fifo_files++;
         } else if (entry->d_type == DT_DIR) {
             num_directories++;
-            traverse_directory(src_path, dest_path);
+            scan_push(self, src_path, dest_path);
         }
     }
+    entries_scanned += entries;
 
     closedir(src_dir);
 }
 
+void scan_push(int self, const char *src_path, const char *dest_path) {
+    dir_deque_t *deque = &scan_deques[self];
+    atomic_fetch_add(&dirs_pending, 1);
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom == deque->capacity) {
+        if (deque->top > 0) {
+            memmove(deque->items, deque->items + deque->top, (deque->bottom - deque->top) * sizeof(dir_item_t));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        } else {
+            deque->capacity = deque->capacity > 0 ? deque->capacity * 2 : SCAN_DEQUE_START;
+            deque->items = realloc(deque->items, deque->capacity * sizeof(dir_item_t));
+        }
+    }
+    deque->items[deque->bottom].src_path = strdup(src_path);
+    deque->items[deque->bottom].dest_path = strdup(dest_path);
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->mutex);
+    waiter_notify(&dirs_available);
+}
+
+// Newest from our own deque, else the oldest from the next scanner that has any
+int scan_pop(int self, dir_item_t *item) {
+    for (int i = 0; i < scan_threads; i++) {
+        dir_deque_t *deque = &scan_deques[(self + i) % scan_threads];
+        pthread_mutex_lock(&deque->mutex);
+        if (deque->top < deque->bottom) {
+            *item = i == 0 ? deque->items[--deque->bottom] : deque->items[deque->top++];
+            if (deque->top == deque->bottom) {
+                deque->top = deque->bottom = 0;
+            }
+            pthread_mutex_unlock(&deque->mutex);
+            return 1;
+        }
+        pthread_mutex_unlock(&deque->mutex);
+    }
+    return 0;
+}
+
 void *worker_function(void *args) {
-    while (!done_flag_set() || buffer_count > 0) {
-        char src_path[MAX_PATH];
-        char dest_path[MAX_PATH];
-        if (get_from_buffer(src_path, dest_path)) {
-            if (src_path[0] != '\0' && dest_path[0] != '\0') {
-                copy_file(src_path, dest_path);
+    // Falls back to one file at a time if the kernel can't give us a ring
+    int ring_done = copy_first_path == COPY_URING && uring_worker() == 0;
+    while (!ring_done && (!done_flag_set() || buffer_count > 0)) {
+        file_pair_t item;
+        if (get_from_buffer(&item, 1)) {
+            if (item.split != NULL) {
+                copy_chunk(&item);
+            } else if (item.src_path[0] != '\0' && item.dest_path[0] != '\0') {
+                copy_file(item.src_path, item.dest_path);
                 //printf("Copied file from %s to %s\n", src_path, dest_path);
             } else {
                 fprintf(stderr, "Invalid paths received by worker\n");
@@ -184,62 +471,257 @@ void copy_file(const char *src_path, const char *dest_path) {
         return;
     }
 
+    struct stat st;
+    if (fstat(src_fd, &st) < 0) {
+        perror("Failed to stat source file");
+        close(src_fd);
+        close(dest_fd);
+        return;
+    }
+
+    // Empty files may be pseudo-files whose size is only known by reading
+    int path = st.st_size == 0 ? COPY_BUFFERED : copy_first_path == COPY_URING ? COPY_REFLINK : copy_first_path;
+    off_t copied = 0;
+    int result;
+    while ((result = copy_with(path, src_fd, dest_fd, 0, st.st_size, &copied, 0)) == 0) {
+        path++;
+    }
+    if (result > 0) {
+        files_by_path[path]++;
+    }
+    close(src_fd);
+    close(dest_fd);
+}
+
+// Moves bytes [offset + *copied, offset + length) at explicit offsets, so
+// a path that gives up halfway leaves the next one to carry on. A whole
+// file (not chunked) is read to its end, whatever its size said. Returns 1
+// when done, 0 when the path is unsupported here, -1 on a real error.
+int copy_with(int path, int src_fd, int dest_fd, off_t offset, off_t length, off_t *copied, int chunked) {
+    if (path != COPY_BUFFERED && copy_path_unsupported[path]) {
+        return 0;
+    }
+    if (path == COPY_REFLINK) {
+        // Shares the source's extents on filesystems with reflink (xfs, btrfs)
+        struct file_clone_range range = { .src_fd = src_fd, .src_offset = offset, .src_length = length, .dest_offset = offset };
+        if ((chunked ? ioctl(dest_fd, FICLONERANGE, &range) : ioctl(dest_fd, FICLONE, src_fd)) < 0) {
+            if (errno == EOPNOTSUPP || errno == ENOTTY || errno == ENOSYS) {
+                copy_path_unsupported[path] = 1;  // EXDEV and EINVAL only rule out this pair or range
+            }
+            return 0;
+        }
+        bytes_by_path[path] += length;
+        total_bytes_copied += length;
+        *copied = length;
+        return 1;
+    }
+
+    if (path == COPY_SENDFILE) {
+        if (chunked) {
+            return 0;  // Writes at the destination's file position, which chunks share
+        }
+        lseek(dest_fd, offset + *copied, SEEK_SET);
+    }
+    if (path == COPY_RANGE || path == COPY_SENDFILE) {
+        // A whole file is copied until the source runs out, not to its fstat
+        // size, so one that grew since is copied in full
+        while (!chunked || *copied < length) {
+            size_t chunk = chunked && length - *copied < COPY_CHUNK ? length - *copied : COPY_CHUNK;
+            off_t in = offset + *copied, out = in;
+            // copy_file_range stays in the kernel, and lets NFS/SMB copy on the server
+            ssize_t moved = path == COPY_RANGE ? copy_file_range(src_fd, &in, dest_fd, &out, chunk, 0)
+                                               : sendfile(dest_fd, src_fd, &in, chunk);
+            if (moved == 0) {
+                if (chunked) {
+                    fprintf(stderr, "Failed to copy file: the source shrank under a chunk\n");
+                    return -1;
+                }
+                break;  // End of the source
+            }
+            if (moved < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == ENOSYS || errno == EOPNOTSUPP) {
+                    copy_path_unsupported[path] = 1;
+                    return 0;
+                }
+                if (errno == EXDEV || errno == EINVAL) {
+                    return 0;  // Just this file: another pair of filesystems may take it
+                }
+                perror("Failed to copy file");
+                return -1;
+            }
+            *copied += moved;
+            bytes_by_path[path] += moved;
+            total_bytes_copied += moved;
+        }
+        return 1;
+    }
+
     char buffer[8192];
 
     ssize_t bytes_read, bytes_written;
 
-    while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0) {
-        bytes_written = write(dest_fd, buffer, bytes_read);
+    off_t want = sizeof(buffer);
+    while ((!chunked || (want = length - *copied < (off_t)sizeof(buffer) ? length - *copied : (off_t)sizeof(buffer)) > 0) &&
+           (bytes_read = pread(src_fd, buffer, want, offset + *copied)) > 0) {
+        bytes_written = pwrite(dest_fd, buffer, bytes_read, offset + *copied);
         if (bytes_written != bytes_read) {
             perror("Failed to write to destination file");
-            close(src_fd);
-            close(dest_fd);
-            return;
+            return -1;
         }
+        *copied += bytes_written;
+        bytes_by_path[path] += bytes_written;
         total_bytes_copied += bytes_written;
     }
-    close(src_fd);
-    close(dest_fd);
+    if (chunked && *copied < length) {
+        fprintf(stderr, "Failed to copy file: the source shrank under a chunk\n");
+        return -1;  // Leaves a hole where the rest of the chunk belongs
+    }
+    return 1;
+}
+
+// Opens both ends once and sizes the destination up front, so chunks can
+// land in any order, then queues one buffer item per chunk_size bytes.
+void split_file(const char *src_path, const char *dest_path, off_t size) {
+    split_file_t *split = malloc(sizeof(split_file_t));
+    split->src_fd = open(src_path, O_RDONLY);
+    if (split->src_fd < 0) {
+        perror("Failed to open source file");
+        free(split);
+        return;
+    }
+    split->dest_fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (split->dest_fd < 0 || ftruncate(split->dest_fd, size) < 0) {
+        perror("Failed to create destination file");
+        if (split->dest_fd >= 0) {
+            close(split->dest_fd);
+        }
+        close(split->src_fd);
+        free(split);
+        return;
+    }
+    split->chunks = (size + chunk_size - 1) / chunk_size;
+    atomic_init(&split->chunks_left, split->chunks);
+    atomic_init(&split->failed, 0);
+    atomic_init(&split->path, COPY_REFLINK);
+    num_split_files++;
+    num_chunks += split->chunks;
+
+    for (off_t offset = 0; offset < size; offset += chunk_size) {
+        off_t length = size - offset < chunk_size ? size - offset : chunk_size;
+        if (!add_to_buffer(src_path, dest_path, split, offset, length)) {
+            finish_chunk(split, src_path, dest_path, 1);  // Shutting down
+        }
+    }
 }
 
-void add_to_buffer(const char *src_path, const char *dest_path) {
+void copy_chunk(file_pair_t *item) {
+    int path = copy_first_path == COPY_URING ? COPY_REFLINK : copy_first_path;
+    off_t copied = 0;
+    int result;
+    while ((result = copy_with(path, item->split->src_fd, item->split->dest_fd, item->offset, item->length, &copied, 1)) == 0) {
+        path++;
+    }
+    if (result > 0) {
+        note_chunk_path(item->split, path);
+    }
+    finish_chunk(item->split, item->src_path, item->dest_path, result < 0);
+}
+
+void note_chunk_path(split_file_t *split, int path) {
+    int slowest = atomic_load(&split->path);
+    while (path > slowest && !atomic_compare_exchange_weak(&split->path, &slowest, path)) {
+    }
+}
+
+void finish_chunk(split_file_t *split, const char *src_path, const char *dest_path, int failed) {
+    if (failed) {
+        split->failed = 1;
+    }
+    if (atomic_fetch_sub(&split->chunks_left, 1) > 1) {
+        return;
+    }
+    close(split->src_fd);
+    close(split->dest_fd);
+    if (split->failed) {
+        fprintf(stderr, "Failed to copy file from %s to %s: a chunk went wrong\n", src_path, dest_path);
+    } else {
+        files_by_path[split->path]++;
+    }
+    free(split);
+}
+
+// Bytes, with an optional K, M or G suffix
+int parse_size(const char *text, off_t *size) {
+    long long value;
+    char unit = '\0';
+    if (sscanf(text, "%lld%c", &value, &unit) < 1 || value < 0) {
+        return 0;
+    }
+    const char *units = "KMG";
+    const char *found = unit != '\0' ? strchr(units, unit) : NULL;
+    if (unit != '\0' && found == NULL) {
+        return 0;
+    }
+    *size = found != NULL ? value << (10 * (found - units + 1)) : value;
+    return 1;
+}
+
+// Returns 0 if the item was dropped because we are shutting down
+int add_to_buffer(const char *src_path, const char *dest_path, split_file_t *split, off_t offset, off_t length) {
     pthread_mutex_lock(&buffer_mutex);
 
     while (buffer_count == buffer_size && !done_flag) {
-        pthread_cond_wait(&buffer_not_full, &buffer_mutex);
+        uint32_t key = waiter_prepare(&buffer_not_full);
+        pthread_mutex_unlock(&buffer_mutex);
+        waiter_wait(&buffer_not_full, key);
+        pthread_mutex_lock(&buffer_mutex);
     }
 
     if (done_flag) {
         pthread_mutex_unlock(&buffer_mutex);
-        return;
+        return 0;
     }
 
     strncpy(buffer[buffer_count].src_path, src_path, MAX_PATH);
     strncpy(buffer[buffer_count].dest_path, dest_path, MAX_PATH);
+    buffer[buffer_count].split = split;
+    buffer[buffer_count].offset = offset;
+    buffer[buffer_count].length = length;
     buffer_count++;
 
-    pthread_cond_signal(&buffer_not_empty);
     pthread_mutex_unlock(&buffer_mutex);
+    waiter_notify(&buffer_not_empty);
+    return 1;
 }
 
-int get_from_buffer(char *src_path, char *dest_path) {
+// Without block, returns 0 at once when the buffer is empty
+int get_from_buffer(file_pair_t *item, int block) {
     pthread_mutex_lock(&buffer_mutex);
 
-    while (buffer_count == 0 && !done_flag) {
-        pthread_cond_wait(&buffer_not_empty, &buffer_mutex);
+    while (block && buffer_count == 0 && !done_flag) {
+        uint32_t key = waiter_prepare(&buffer_not_empty);
+        pthread_mutex_unlock(&buffer_mutex);
+        waiter_wait(&buffer_not_empty, key);
+        pthread_mutex_lock(&buffer_mutex);
     }
 
-    if (buffer_count == 0 && done_flag) {
+    if (buffer_count == 0) {
         pthread_mutex_unlock(&buffer_mutex);
         return 0;
     }
 
     buffer_count--;
-    strncpy(src_path, buffer[buffer_count].src_path, MAX_PATH);
-    strncpy(dest_path, buffer[buffer_count].dest_path, MAX_PATH);
+    strncpy(item->src_path, buffer[buffer_count].src_path, MAX_PATH);
+    strncpy(item->dest_path, buffer[buffer_count].dest_path, MAX_PATH);
+    item->split = buffer[buffer_count].split;
+    item->offset = buffer[buffer_count].offset;
+    item->length = buffer[buffer_count].length;
 
-    pthread_cond_signal(&buffer_not_full);
     pthread_mutex_unlock(&buffer_mutex);
+    waiter_notify(&buffer_not_full);
 
     return 1;
 }
@@ -247,8 +729,9 @@ int get_from_buffer(char *src_path, char *dest_path) {
 void set_done_flag() {
     pthread_mutex_lock(&buffer_mutex);
     done_flag = 1;
-    pthread_cond_broadcast(&buffer_not_empty);
     pthread_mutex_unlock(&buffer_mutex);
+    waiter_shutdown(&buffer_not_empty);
+    waiter_shutdown(&buffer_not_full);
 }
 
 int done_flag_set() {
@@ -258,8 +741,384 @@ int done_flag_set() {
     return flag;
 }
 
+void waiter_init(waiter_t *waiter) {
+    atomic_init(&waiter->epoch, 0);
+    atomic_init(&waiter->waiting, 0);
+    atomic_init(&waiter->parked, 0);
+    atomic_init(&waiter->shutdown, 0);
+    // Spinning on one CPU only delays the thread that would wake us
+    waiter->spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? WAITER_SPIN_MAX : 0;
+    atomic_init(&waiter->spin_limit, waiter->spin_max < WAITER_SPIN_START ? waiter->spin_max : WAITER_SPIN_START);
+}
+
+// Call with buffer_mutex held, before unlocking to wait
+uint32_t waiter_prepare(waiter_t *waiter) {
+    atomic_fetch_add(&waiter->waiting, 1);
+    return atomic_load(&waiter->epoch);
+}
+
+// Returns once the epoch moved past key; callers recheck the buffer
+void waiter_wait(waiter_t *waiter, uint32_t key) {
+    int limit = atomic_load_explicit(&waiter->spin_limit, memory_order_relaxed);
+    for (int i = 0; i < limit; i++) {
+        if (atomic_load(&waiter->epoch) != key) {
+            if (limit < waiter->spin_max) {
+                atomic_store_explicit(&waiter->spin_limit, limit * 2, memory_order_relaxed);
+            }
+            atomic_fetch_sub(&waiter->waiting, 1);
+            return;
+        }
+        CPU_RELAX();
+    }
+    if (limit > WAITER_SPIN_MIN) {
+        atomic_store_explicit(&waiter->spin_limit, limit / 2, memory_order_relaxed);
+    }
+
+    atomic_fetch_add(&waiter->parked, 1);
+    while (atomic_load(&waiter->epoch) == key && !atomic_load(&waiter->shutdown)) {
+        syscall(SYS_futex, &waiter->epoch, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+    }
+    atomic_fetch_sub(&waiter->parked, 1);
+    atomic_fetch_sub(&waiter->waiting, 1);
+}
+
+// No syscall unless a waiter is actually asleep
+void waiter_notify(waiter_t *waiter) {
+    if (atomic_load(&waiter->waiting) == 0) {
+        return;
+    }
+    atomic_fetch_add(&waiter->epoch, 1);
+    if (atomic_load(&waiter->parked) > 0) {
+        syscall(SYS_futex, &waiter->epoch, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+// Undoes waiter_prepare when the recheck after it found there is no need to wait
+void waiter_cancel(waiter_t *waiter) {
+    atomic_fetch_sub(&waiter->waiting, 1);
+}
+
+void waiter_shutdown(waiter_t *waiter) {
+    atomic_store(&waiter->shutdown, 1);
+    atomic_fetch_add(&waiter->epoch, 1);
+    syscall(SYS_futex, &waiter->epoch, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+int ring_setup(copy_ring_t *ring, int depth) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, depth * URING_SQES_PER_FILE, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        return -1;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    char *base = ring->ring;
+    ring->sq_head = (_Atomic unsigned *)(base + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned *)(base + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned *)(base + params.sq_off.array);
+    ring->cq_head = (_Atomic unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    ring->to_submit = 0;
+
+    // One registered buffer and two direct descriptors per slot: reads and
+    // writes skip the page pinning and the fd table lookup on every call.
+    ring->buffers = aligned_alloc(4096, (size_t)depth * URING_BUFFER_SIZE);
+    struct iovec *iovecs = malloc(depth * sizeof(struct iovec));
+    for (int i = 0; i < depth; i++) {
+        iovecs[i].iov_base = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+        iovecs[i].iov_len = URING_BUFFER_SIZE;
+    }
+    struct io_uring_rsrc_register files = { .nr = depth * 2, .flags = IORING_RSRC_REGISTER_SPARSE };
+    int registered = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovecs, depth) == 0 &&
+                     syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES2, &files, sizeof(files)) == 0;
+    free(iovecs);
+    if (!registered) {
+        ring_teardown(ring);
+        return -1;
+    }
+    return 0;
+}
+
+void ring_teardown(copy_ring_t *ring) {
+    free(ring->buffers);
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring, ring->ring_size);
+    close(ring->fd);
+}
+
+struct io_uring_sqe *ring_get_sqe(copy_ring_t *ring, int slot, int op) {
+    unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) == ring->sq_entries) {
+        ring_enter(ring, 0);
+    }
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)slot * URING_OPS + op;
+    ring->sq_array[index] = index;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    ring->to_submit++;
+    return sqe;
+}
+
+// Submits everything queued since the last call and waits for wait_for
+// completions in the same syscall
+int ring_enter(copy_ring_t *ring, unsigned wait_for) {
+    int submitted;
+    do {
+        submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (submitted == -1 && errno == EINTR);
+    if (submitted > 0) {
+        ring->to_submit -= submitted;
+    }
+    return submitted;
+}
+
+// A read of a whole buffer linked to the write of it. If the read comes up
+// short (end of file) the kernel cancels the write, and the next round
+// writes just what was read.
+void ring_queue_chunk(copy_ring_t *ring, int slot, uring_slot_t *file) {
+    file->last_read = file->last_written = 0;
+    file->read_length = file->end >= 0 && file->end - file->offset < URING_BUFFER_SIZE ? file->end - file->offset : URING_BUFFER_SIZE;
+    struct io_uring_sqe *sqe = ring_get_sqe(ring, slot, URING_OP_READ);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    // Chunks of a split file go through the fds the manager opened
+    sqe->flags = (file->item.split == NULL ? IOSQE_FIXED_FILE : 0) | IOSQE_IO_LINK;
+    sqe->fd = file->item.split == NULL ? slot * 2 : file->item.split->src_fd;
+    sqe->addr = (uintptr_t)(ring->buffers + (size_t)slot * URING_BUFFER_SIZE);
+    sqe->len = file->read_length;
+    sqe->off = file->offset;
+    sqe->buf_index = slot;
+    ring_queue_write(ring, slot, file, file->read_length, 0);
+    file->pending += 2;
+}
+
+void ring_queue_write(copy_ring_t *ring, int slot, uring_slot_t *file, unsigned length, unsigned flags) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring, slot, URING_OP_WRITE);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = (file->item.split == NULL ? IOSQE_FIXED_FILE : 0) | flags;
+    sqe->fd = file->item.split == NULL ? slot * 2 + 1 : file->item.split->dest_fd;
+    sqe->addr = (uintptr_t)(ring->buffers + (size_t)slot * URING_BUFFER_SIZE);
+    sqe->len = length;
+    sqe->off = file->offset;
+    sqe->buf_index = slot;
+    file->write_length = length;
+}
+
+// Closes go out with whatever the next ring_enter submits for other slots.
+// Destination first, so it is the one chained behind a final write.
+void ring_queue_closes(copy_ring_t *ring, int slot, uring_slot_t *file) {
+    for (int i = 1; i >= 0; i--) {
+        if (i == 0 ? file->src_open : file->dest_open) {
+            struct io_uring_sqe *sqe = ring_get_sqe(ring, slot, URING_OP_CLOSE);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = slot * 2 + i + 1;
+            file->pending++;
+        }
+    }
+    file->src_open = file->dest_open = 0;
+    file->closing = 1;
+}
+
+void ring_start_file(copy_ring_t *ring, int slot, uring_slot_t *file) {
+    file->failed = file->closing = 0;
+    file->src_open = file->dest_open = 0;
+    if (file->item.split != NULL) {
+        file->offset = file->item.offset;
+        file->end = file->item.offset + file->item.length;
+        file->pending = 0;
+        ring_queue_chunk(ring, slot, file);
+        return;
+    }
+    file->offset = 0;
+    file->end = -1;
+    file->pending = 2;
+    struct io_uring_sqe *sqe = ring_get_sqe(ring, slot, URING_OP_OPEN_SRC);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)file->item.src_path;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = slot * 2 + 1;
+    sqe = ring_get_sqe(ring, slot, URING_OP_OPEN_DEST);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)file->item.dest_path;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = 0644;
+    sqe->file_index = slot * 2 + 2;
+    ring_queue_chunk(ring, slot, file);
+}
+
+// Called when every request of a slot's round has completed; queues the
+// next round. Returns 1 once the file is finished and the slot is free.
+int ring_advance(copy_ring_t *ring, int slot, uring_slot_t *file) {
+    if (!file->closing) {
+        int whole = file->item.split == NULL;
+        if (!whole && !file->failed && file->last_read >= 0 && file->last_read < (int)file->read_length) {
+            fprintf(stderr, "Failed to copy %s: the source shrank under a chunk\n", file->item.src_path);
+            file->failed = 1;
+        }
+        if (file->failed) {
+            ring_queue_closes(ring, slot, file);
+        } else if (file->last_read == (int)file->read_length && file->last_written == (int)file->read_length &&
+                   (file->end < 0 || file->offset + file->read_length < file->end)) {
+            file->offset += file->read_length;
+            ring_queue_chunk(ring, slot, file);
+            return 0;
+        } else if (file->last_read > 0 && file->last_written != file->last_read) {
+            ring_queue_write(ring, slot, file, file->last_read, whole ? IOSQE_IO_HARDLINK : 0);
+            file->pending++;
+            ring_queue_closes(ring, slot, file);
+        } else {
+            ring_queue_closes(ring, slot, file);
+        }
+        if (file->pending > 0) {
+            return 0;
+        }
+    }
+    if (file->item.split != NULL) {
+        note_chunk_path(file->item.split, COPY_URING);
+        finish_chunk(file->item.split, file->item.src_path, file->item.dest_path, file->failed);
+    } else if (!file->failed) {
+        files_by_path[COPY_URING]++;
+    }
+    return 1;
+}
+
+void ring_complete(uring_slot_t *file, int op, int res) {
+    file->pending--;
+    if (res == -ECANCELED) {
+        if (op == URING_OP_WRITE) {
+            file->last_written = res;  // Short read broke the link
+        }
+        return;
+    }
+    switch (op) {
+    case URING_OP_OPEN_SRC:
+    case URING_OP_OPEN_DEST:
+        if (res < 0) {
+            fprintf(stderr, "Failed to open %s file %s: %s\n", op == URING_OP_OPEN_SRC ? "source" : "destination",
+                    op == URING_OP_OPEN_SRC ? file->item.src_path : file->item.dest_path, strerror(-res));
+            file->failed = 1;
+        } else if (op == URING_OP_OPEN_SRC) {
+            file->src_open = 1;
+        } else {
+            file->dest_open = 1;
+        }
+        break;
+    case URING_OP_READ:
+        file->last_read = res;
+        if (res < 0) {
+            fprintf(stderr, "Failed to read %s: %s\n", file->item.src_path, strerror(-res));
+            file->failed = 1;
+        }
+        break;
+    case URING_OP_WRITE:
+        file->last_written = res;
+        if (res > 0) {
+            bytes_by_path[COPY_URING] += res;
+            total_bytes_copied += res;
+        }
+        if (res != (int)file->write_length) {
+            fprintf(stderr, "Failed to write to destination file %s\n", file->item.dest_path);
+            file->failed = 1;
+        }
+        break;
+    }
+}
+
+// Each worker keeps up to uring_depth files moving through its own ring,
+// taking new files without blocking while any are in flight. Returns -1 if
+// the kernel can't give us a ring or the ring breaks; files in flight then
+// are reported failed and the caller copies the rest one at a time.
+int uring_worker() {
+    copy_ring_t ring;
+    if (ring_setup(&ring, uring_depth) < 0) {
+        return -1;
+    }
+    uring_slot_t *files = malloc(uring_depth * sizeof(uring_slot_t));
+    int *free_slots = malloc(uring_depth * sizeof(int));
+    int free_count = uring_depth;
+    for (int i = 0; i < uring_depth; i++) {
+        free_slots[i] = uring_depth - 1 - i;
+    }
+    int result = 0;
+
+    while (1) {
+        while (free_count > 0) {
+            int slot = free_slots[free_count - 1];
+            if (!get_from_buffer(&files[slot].item, free_count == uring_depth)) {
+                break;
+            }
+            free_count--;
+            ring_start_file(&ring, slot, &files[slot]);
+        }
+        if (free_count == uring_depth) {
+            break;  // Nothing in flight and the buffer is closed
+        }
+
+        // EAGAIN and EBUSY mean the kernel is short of room for now: reap
+        // what has completed and try again
+        if (ring_enter(&ring, 1) < 0 && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter failed");
+            char *idle = calloc(uring_depth, 1);
+            for (int i = 0; i < free_count; i++) {
+                idle[free_slots[i]] = 1;
+            }
+            for (int slot = 0; slot < uring_depth; slot++) {
+                if (idle[slot]) {
+                    continue;
+                }
+                if (files[slot].item.split != NULL) {
+                    finish_chunk(files[slot].item.split, files[slot].item.src_path, files[slot].item.dest_path, 1);
+                } else {
+                    fprintf(stderr, "Failed to copy %s: the ring stopped with it in flight\n", files[slot].item.src_path);
+                }
+            }
+            free(idle);
+            result = -1;
+            break;
+        }
+        unsigned head = atomic_load_explicit(ring.cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(ring.cq_tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+            int slot = cqe->user_data / URING_OPS;
+            ring_complete(&files[slot], cqe->user_data % URING_OPS, cqe->res);
+            if (files[slot].pending == 0 && ring_advance(&ring, slot, &files[slot])) {
+                free_slots[free_count++] = slot;
+            }
+        }
+        atomic_store_explicit(ring.cq_head, head, memory_order_release);
+    }
+
+    free(files);
+    free(free_slots);
+    ring_teardown(&ring);
+    return result;
+}
+
 void print_usage_and_exit(const char *prog_name) {
-    fprintf(stderr, "Usage: %s <buffer_size> <num_workers> <source_dir> <dest_dir>\n", prog_name);
+    fprintf(stderr, "Usage: %s <buffer_size> <num_workers> <source_dir> <dest_dir> [--copy=reflink|range|sendfile|buffered|uring] [--uring-depth=N] [--chunk-size=BYTES] [--split-threshold=BYTES] [--scan-threads=N] [--scan-only]\n", prog_name);
     exit(EXIT_FAILURE);
 }
 
@@ -276,6 +1135,16 @@ void print_statistics(int num_workers, int buffer_size, struct timeval start, st
     printf("Number of Regular File: %d\n", num_regular_files);
     printf("Number of FIFO File: %d\n", num_fifo_files);
     printf("Number of Directory: %d\n", num_directories);
+    printf("Scanned %ld entries in %.3f s with %d scanner%s: %.0f entries/s\n", entries_scanned, scan_seconds, scan_threads,
+           scan_threads == 1 ? "" : "s", scan_seconds > 0 ? entries_scanned / scan_seconds : 0);
     printf("TOTAL BYTES COPIED: %ld\n", total_bytes_copied);
+    for (int path = 0; path < COPY_PATHS; path++) {
+        if (files_by_path[path] > 0 || bytes_by_path[path] > 0) {
+            printf("  via %-16s %d files, %ld bytes\n", copy_path_names[path], files_by_path[path], bytes_by_path[path]);
+        }
+    }
+    if (num_split_files > 0) {
+        printf("  split %d large files into %d chunks of up to %ld bytes\n", num_split_files, num_chunks, (long)chunk_size);
+    }
     printf("TOTAL TIME: %02ld:%02ld.%03ld (min:sec.mili)\n", minutes, seconds, miliseconds);
 }